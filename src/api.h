@@ -25,6 +25,11 @@ static inline int mutex_lock(mutex_t *const mutex)
 	return 0;
 }
 
+static inline int mutex_trylock(mutex_t *const mutex)
+{
+	return TryEnterCriticalSection(mutex) ? 0 : -1;
+}
+
 static inline int mutex_unlock(mutex_t *const mutex)
 {
 	LeaveCriticalSection(mutex);
@@ -76,6 +81,8 @@ static inline int thread_join(thread_t *const thread)
 
 typedef signed long long tic_t;
 
+#define TICS_PER_SEC 1000000000LL
+
 static inline void tic_get(tic_t *const tic)
 {
 	LARGE_INTEGER pcnt;
@@ -83,9 +90,18 @@ static inline void tic_get(tic_t *const tic)
 	if (!freq)
 		QueryPerformanceFrequency((freq = &_freq));
 	QueryPerformanceCounter(&pcnt);
-	pcnt.QuadPart *= 1000000;
-	pcnt.QuadPart /= freq->QuadPart;
-	*tic = pcnt.QuadPart;
+	/* split to keep the product in range */
+	*tic = (pcnt.QuadPart / freq->QuadPart) * TICS_PER_SEC + (pcnt.QuadPart % freq->QuadPart) * TICS_PER_SEC / freq->QuadPart;
+}
+
+/* Waits until signaled or until the absolute deadline (tic_get() base) passed. */
+static inline int cond_timedwait(cond_t *const cond, mutex_t *const mutex, const tic_t deadline)
+{
+	tic_t now;
+	tic_get(&now);
+	if (SleepConditionVariableCS(cond, mutex, deadline > now ? (DWORD)((deadline - now + 999999LL) / 1000000LL) : 0))
+		return 0;
+	return GetLastError() == ERROR_TIMEOUT ? 0 : -1;
 }
 
 static inline void sleep_ms(const unsigned ms)
@@ -97,7 +113,9 @@ static inline void sleep_ms(const unsigned ms)
 
 #	include <unistd.h>
 #	include <pthread.h>
-#	include <sys/time.h>
+#	include <sched.h>
+#	include <time.h>
+#	include <errno.h>
 
 typedef pthread_mutex_t mutex_t;
 
@@ -116,16 +134,30 @@ static inline int mutex_lock(mutex_t *const mutex)
 	return pthread_mutex_lock(mutex);
 }
 
+/* Returns 0 if the mutex was taken, non-zero if it is held. */
+static inline int mutex_trylock(mutex_t *const mutex)
+{
+	return pthread_mutex_trylock(mutex);
+}
+
 static inline int mutex_unlock(mutex_t *const mutex)
 {
-	return pthread_mutex_lock(mutex);
+	return pthread_mutex_unlock(mutex);
 }
 
 typedef pthread_cond_t cond_t;
 
+/* condition variables time out against the monotonic clock, see cond_timedwait() */
 static inline int cond_init(cond_t *const cond)
 {
-	return pthread_cond_init(cond, 0/*attr*/);
+	pthread_condattr_t attr;
+	int result;
+	if ((result = pthread_condattr_init(&attr)))
+		return result;
+	if (!(result = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC)))
+		result = pthread_cond_init(cond, &attr);
+	pthread_condattr_destroy(&attr);
+	return result;
 }
 
 static inline int cond_destroy(cond_t *const cond)
@@ -160,13 +192,94 @@ static inline int thread_join(thread_t *const thread)
 	return pthread_join(*thread, 0/*retval*/);
 }
 
+/* Scheduling of a thread: SCHED_FIFO priority (0 for SCHED_OTHER), CPU mask (0 for any) and stack size (0 for default). */
+typedef struct _thread_attr_t {
+	int prio;
+	unsigned long long cpus;
+	size_t stack;
+} thread_attr_t;
+
+#define thread_attr_initializer() { \
+	.prio = 0, .cpus = 0, .stack = 0 }
+
+static inline void thread_attr_cpus(const thread_attr_t *const attr, cpu_set_t *const set)
+{
+	unsigned i;
+	CPU_ZERO(set);
+	for (i = 0; i < 8 * sizeof(attr->cpus); i++)
+	{
+		if (attr->cpus & (1ULL << i))
+			CPU_SET(i, set);
+	}
+}
+
+/* Creates a thread that starts with the given scheduling, no window with default attributes. */
+static inline int thread_create_attr(thread_t *const thread, void *(*const thread_function)(void *const), void *const context, const thread_attr_t *const attr)
+{
+	pthread_attr_t pattr;
+	int result;
+	if ((result = pthread_attr_init(&pattr)))
+		return result;
+	if (attr->stack && (result = pthread_attr_setstacksize(&pattr, attr->stack)))
+		goto exit0;
+	if (attr->prio)
+	{
+		const struct sched_param param = { .sched_priority = attr->prio };
+		if ((result = pthread_attr_setinheritsched(&pattr, PTHREAD_EXPLICIT_SCHED)) ||
+			(result = pthread_attr_setschedpolicy(&pattr, SCHED_FIFO)) ||
+			(result = pthread_attr_setschedparam(&pattr, &param)))
+			goto exit0;
+	}
+	if (attr->cpus)
+	{
+		cpu_set_t set;
+		thread_attr_cpus(attr, &set);
+		if ((result = pthread_attr_setaffinity_np(&pattr, sizeof(set), &set)))
+			goto exit0;
+	}
+	result = pthread_create(thread, &pattr, thread_function, context);
+exit0:
+	pthread_attr_destroy(&pattr);
+	return result;
+}
+
+/* Applies priority and CPU mask of attr to the calling thread. */
+static inline int thread_attr_self(const thread_attr_t *const attr)
+{
+	int result;
+	if (attr->prio)
+	{
+		const struct sched_param param = { .sched_priority = attr->prio };
+		if ((result = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)))
+			return result;
+	}
+	if (attr->cpus)
+	{
+		cpu_set_t set;
+		thread_attr_cpus(attr, &set);
+		if ((result = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)))
+			return result;
+	}
+	return 0;
+}
+
 typedef signed long long tic_t;
 
+#define TICS_PER_SEC 1000000000LL
+
 static inline void tic_get(tic_t *const tic)
 {
-	struct timeval now;
-	gettimeofday(&now, 0);
-	*tic = (tic_t)now.tv_sec * (tic_t)1000000LL + (tic_t)now.tv_usec;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	*tic = (tic_t)now.tv_sec * TICS_PER_SEC + (tic_t)now.tv_nsec;
+}
+
+/* Waits until signaled or until the absolute deadline (tic_get() base) passed. */
+static inline int cond_timedwait(cond_t *const cond, mutex_t *const mutex, const tic_t deadline)
+{
+	const struct timespec ts = { .tv_sec = deadline / TICS_PER_SEC, .tv_nsec = deadline % TICS_PER_SEC };
+	const int result = pthread_cond_timedwait(cond, mutex, &ts);
+	return result == ETIMEDOUT ? 0 : result;
 }
 
 static inline void sleep_ms(const unsigned ms)
@@ -176,4 +289,65 @@ static inline void sleep_ms(const unsigned ms)
 
 #endif
 
+#ifdef LOCK_PROFILE
+
+/*
+ * Contention profiler, built with DEFNS=LOCK_PROFILE.
+ *
+ * The wrappers below record for each call site of mutex_lock() and
+ * cond_wait() how often the lock was taken, how often it was held by another
+ * thread, and how long it was waited for and held; a hold is accounted to the
+ * site that took the lock. For each condition variable the waits, wakeups,
+ * wakeups without a signal since the wait began (spurious) and timeouts are
+ * counted. Sites and condition variables register on first use, the results
+ * are read with lock_profile_report().
+ */
+
+#define LOCK_PROFILE_DEPTH 4 /*locks held at a time per thread*/
+#define LOCK_PROFILE_SITES 128
+#define LOCK_PROFILE_CONDS 32
+
+typedef struct _lock_site_t {
+	const char *file, *func;
+	unsigned line;
+	unsigned registered;
+	unsigned long long acquired, contended;
+	tic_t wait, wait_max, hold, hold_max;
+	struct _lock_site_t *next;
+} lock_site_t;
+
+/* A record of its own for each expansion. */
+#define lock_site() ({ \
+	static lock_site_t _site = { .file = __FILE__, .func = __FUNCTION__, .line = __LINE__ }; \
+	&_site; })
+
+typedef void (*lock_profile_emit_t)(void *const context, const char *const line);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int lock_profile_lock(mutex_t *const mutex, lock_site_t *const site);
+int lock_profile_unlock(mutex_t *const mutex);
+int lock_profile_signal(cond_t *const cond, const unsigned all);
+/* deadline -1 waits without timeout */
+int lock_profile_wait(cond_t *const cond, mutex_t *const mutex, const tic_t deadline, lock_site_t *const site);
+
+/* Emits a table of the sites, most waited first, and of the condition variables, one line per call. */
+void lock_profile_report(const lock_profile_emit_t emit, void *const context);
+
+#ifdef __cplusplus
+}
+#endif
+
+/* the profiler calls the wrappers above as (mutex_lock)(...) */
+#define mutex_lock(_mutex) lock_profile_lock(_mutex, lock_site())
+#define mutex_unlock(_mutex) lock_profile_unlock(_mutex)
+#define cond_signal(_cond) lock_profile_signal(_cond, 0)
+#define cond_broadcast(_cond) lock_profile_signal(_cond, 1)
+#define cond_wait(_cond, _mutex) lock_profile_wait(_cond, _mutex, -1, lock_site())
+#define cond_timedwait(_cond, _mutex, _deadline) lock_profile_wait(_cond, _mutex, _deadline, lock_site())
+
+#endif
+
 #endif
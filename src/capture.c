@@ -0,0 +1,66 @@
+#include "capture.h"
+
+#include <string.h>
+
+#ifndef API_WIN
+#	include <fcntl.h>
+#	include <unistd.h>
+#	include <sys/mman.h>
+#endif
+
+int capture_open(capture_t *const capture, const char *const path, const unsigned records, const char *const *const devices, const unsigned count)
+{
+#ifdef API_WIN
+	(void)(capture);
+	(void)(path);
+	(void)(records);
+	(void)(devices);
+	(void)(count);
+	return -1;
+#else
+	unsigned size_records = 1, i;
+	size_t size;
+	void *base;
+	int fd;
+	while (size_records < records)
+		size_records <<= 1;
+	size = sizeof(capture_header_t) + (size_t)size_records * sizeof(capture_record_t);
+	if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+		return -1;
+	if (ftruncate(fd, size) || ((base = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED))
+	{
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	capture->header = (capture_header_t *)base;
+	capture->ring = (capture_record_t *)(capture->header + 1);
+	capture->head = 0;
+	capture->mask = size_records - 1;
+	capture->size = size;
+	/* invalidates the sequence numbers and faults in all pages ahead of the hot path */
+	memset(capture->ring, 0xff, (size_t)size_records * sizeof(capture_record_t));
+	memcpy(capture->header->magic, CAPTURE_MAGIC, sizeof(capture->header->magic));
+	capture->header->version = CAPTURE_VERSION;
+	capture->header->record_size = sizeof(capture_record_t);
+	capture->header->records = size_records;
+	capture->header->tics_per_sec = TICS_PER_SEC;
+	for (i = 0; (i < count) && (i < CAPTURE_DEVICES); i++)
+		strncpy(capture->header->devices[i], devices[i], CAPTURE_NAME_SIZE - 1);
+	capture->header->head = 0;
+	return 0;
+#endif
+}
+
+void capture_close(capture_t *const capture)
+{
+#ifndef API_WIN
+	if (capture->header)
+	{
+		msync(capture->header, capture->size, MS_ASYNC);
+		munmap(capture->header, capture->size);
+	}
+#endif
+	capture->header = 0;
+	capture->ring = 0;
+}
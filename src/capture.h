@@ -0,0 +1,85 @@
+#ifndef INC_CAPTURE_H
+#define INC_CAPTURE_H
+
+#include "midi.h"
+
+#include <stddef.h>
+
+/*
+ * Always-on binary traffic capture into a memory-mapped ring file.
+ *
+ * A single writer appends fixed-size records with plain stores, there are no
+ * system calls on the hot path. The file consists of a header followed by a
+ * ring of capture_record_t; records carry the low bits of their sequence
+ * number, which is stored last, so a reader can tell valid records from
+ * torn or stale ones after a crash. The page cache keeps the contents when
+ * the process dies.
+ */
+
+#define CAPTURE_MAGIC "PODCAP1"
+#define CAPTURE_VERSION 3
+#define CAPTURE_RECORDS 65536 /*power of two*/
+#define CAPTURE_DEVICES 8
+#define CAPTURE_NAME_SIZE 8
+
+enum _capture_dir_t {
+	CAPTURE_OUT = 0x80, /* ored to the device id of outbound records */
+};
+
+typedef struct _capture_header_t {
+	char magic[8];
+	unsigned version;
+	unsigned record_size;
+	unsigned records; /* power of two */
+	unsigned reserved;
+	long long tics_per_sec;
+	char devices[CAPTURE_DEVICES][CAPTURE_NAME_SIZE]; /* indexed by device id */
+	unsigned long long head; /* records written */
+} capture_header_t;
+
+typedef struct _capture_record_t {
+	tic_t tic;
+	unsigned msg; /* packed midi event */
+	unsigned char dir; /* device id, CAPTURE_OUT */
+	unsigned char reserved[3];
+	unsigned seq; /* low bits of the record number, stored last */
+} capture_record_t;
+
+typedef struct _capture_t {
+	capture_header_t *header;
+	capture_record_t *ring;
+	unsigned long long head;
+	unsigned mask;
+	size_t size;
+} capture_t;
+
+#define capture_initializer() { \
+	.header = 0, .ring = 0, .head = 0, .mask = 0, .size = 0 }
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Creates or truncates the ring file, records is rounded up to a power of two. */
+int capture_open(capture_t *const capture, const char *const path, const unsigned records, const char *const *const devices, const unsigned count);
+
+void capture_close(capture_t *const capture);
+
+#ifdef __cplusplus
+}
+#endif
+
+static inline void capture_event(capture_t *const capture, const unsigned dir, const midi_event_t *const event)
+{
+	capture_record_t *rec;
+	if (!capture->ring)
+		return;
+	rec = &capture->ring[capture->head & capture->mask];
+	rec->tic = event->tic;
+	rec->msg = event->msg;
+	rec->dir = dir;
+	__atomic_store_n(&rec->seq, (unsigned)capture->head, __ATOMIC_RELEASE);
+	__atomic_store_n(&capture->header->head, ++capture->head, __ATOMIC_RELEASE);
+}
+
+#endif
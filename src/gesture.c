@@ -0,0 +1,86 @@
+#include "gesture.h"
+
+static void gesture_accept(gesture_t *const gesture, const unsigned btn, const unsigned pressed, const tic_t tic, const gesture_emit_t emit, void *const context)
+{
+	gesture_button_t *const b = &gesture->btn[btn];
+	b->state = pressed;
+	b->edge = tic;
+	if (pressed)
+	{
+		emit(context, btn, GESTURE_PRESS, tic);
+		if (b->taps && (tic - b->release <= gesture->doubletap))
+		{
+			emit(context, btn, GESTURE_DOUBLETAP, tic);
+			b->taps = 0;
+		}
+		else
+			b->taps = 1;
+		b->hold = tic + gesture->longpress;
+	}
+	else
+	{
+		emit(context, btn, GESTURE_RELEASE, tic);
+		if ((b->hold == GESTURE_NEVER) || (tic >= b->hold))
+			b->taps = 0; /* long press does not start a double tap */
+		b->release = tic;
+		b->hold = GESTURE_NEVER;
+	}
+}
+
+void gesture_input(gesture_t *const gesture, const unsigned btn, const unsigned pressed, const tic_t tic, const gesture_emit_t emit, void *const context)
+{
+	gesture_button_t *b;
+	if (btn >= GESTURE_BUTTONS)
+		return;
+	/* timers due before this edge fire first */
+	gesture_expire(gesture, tic, emit, context);
+	b = &gesture->btn[btn];
+	b->raw = !!pressed;
+	if (b->raw == b->state)
+		return;
+	if ((b->edge != GESTURE_NEVER) && (tic - b->edge < gesture->debounce))
+	{
+		b->settle = b->edge + gesture->debounce;
+		return;
+	}
+	b->settle = GESTURE_NEVER;
+	gesture_accept(gesture, btn, b->raw, tic, emit, context);
+}
+
+void gesture_expire(gesture_t *const gesture, const tic_t tic, const gesture_emit_t emit, void *const context)
+{
+	unsigned i;
+	for (i = 0; i < GESTURE_BUTTONS; i++)
+	{
+		gesture_button_t *const b = &gesture->btn[i];
+		if (b->settle <= tic)
+		{
+			const tic_t settle = b->settle;
+			b->settle = GESTURE_NEVER;
+			if (b->raw != b->state)
+				gesture_accept(gesture, i, b->raw, settle, emit, context);
+		}
+		if (b->hold <= tic)
+		{
+			const tic_t hold = b->hold;
+			b->hold = GESTURE_NEVER;
+			if (b->state)
+				emit(context, i, GESTURE_LONGPRESS, hold);
+		}
+	}
+}
+
+tic_t gesture_deadline(const gesture_t *const gesture)
+{
+	tic_t deadline = GESTURE_NEVER;
+	unsigned i;
+	for (i = 0; i < GESTURE_BUTTONS; i++)
+	{
+		const gesture_button_t *const b = &gesture->btn[i];
+		if (b->settle < deadline)
+			deadline = b->settle;
+		if (b->hold < deadline)
+			deadline = b->hold;
+	}
+	return deadline;
+}
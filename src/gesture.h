@@ -0,0 +1,68 @@
+#ifndef INC_GESTURE_H
+#define INC_GESTURE_H
+
+#include "api.h"
+
+/*
+ * Timer-driven button gesture recognizer.
+ *
+ * Press and release edges are reported immediately (leading-edge debounce):
+ * edges within the debounce window after an accepted edge are suppressed and
+ * the raw state is verified once the window has passed. A long press fires as
+ * soon as the threshold passes while the button is held, a double tap on the
+ * second press following a short press within the double-tap window.
+ *
+ * The recognizer never polls: the owner waits until gesture_deadline() and
+ * calls gesture_expire() then.
+ */
+
+#define GESTURE_BUTTONS 8
+#define GESTURE_NEVER ((tic_t)0x7fffffffffffffffLL)
+
+enum _gesture_type_t {
+	GESTURE_PRESS,
+	GESTURE_RELEASE,
+	GESTURE_LONGPRESS,
+	GESTURE_DOUBLETAP,
+	GESTURES
+};
+
+typedef struct _gesture_button_t {
+	tic_t edge; /* last accepted edge, GESTURE_NEVER before the first */
+	tic_t release; /* last accepted release after a short press */
+	tic_t hold; /* long press due */
+	tic_t settle; /* debounce verification due */
+	unsigned char raw, state, taps;
+} gesture_button_t;
+
+typedef struct _gesture_t {
+	tic_t debounce, longpress, doubletap;
+	gesture_button_t btn[GESTURE_BUTTONS];
+} gesture_t;
+
+#define gesture_button_initializer() { \
+	.edge = GESTURE_NEVER, .release = 0, .hold = GESTURE_NEVER, .settle = GESTURE_NEVER, \
+	.raw = 0, .state = 0, .taps = 0 }
+
+#define gesture_initializer(_debounce, _longpress, _doubletap) { \
+	.debounce = _debounce, .longpress = _longpress, .doubletap = _doubletap, \
+	.btn = { [0 ... GESTURE_BUTTONS - 1] = gesture_button_initializer() } }
+
+typedef void (*gesture_emit_t)(void *const context, const unsigned btn, const unsigned gesture, const tic_t tic);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void gesture_input(gesture_t *const gesture, const unsigned btn, const unsigned pressed, const tic_t tic, const gesture_emit_t emit, void *const context);
+
+void gesture_expire(gesture_t *const gesture, const tic_t tic, const gesture_emit_t emit, void *const context);
+
+/* Returns the earliest pending timer or GESTURE_NEVER. */
+tic_t gesture_deadline(const gesture_t *const gesture);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
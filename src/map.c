@@ -0,0 +1,402 @@
+#include "map.h"
+#include "midi.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define MAP_LINE_SIZE 256
+#define MAP_TOKENS 16
+
+static unsigned map_serial = 0;
+
+static const char *const MAP_TYPES[8] =
+{
+	[0x0] = "noteoff",
+	[0x1] = "note",
+	[0x2] = "polyat",
+	[0x3] = "cc",
+	[0x4] = "pc",
+	[0x5] = "at",
+	[0x6] = "bend",
+	[0x7] = 0, /* system messages are not mapped, only routed */
+};
+
+static const char *const MAP_GESTURES[GESTURES] =
+{
+	[GESTURE_PRESS] = "press",
+	[GESTURE_RELEASE] = "release",
+	[GESTURE_LONGPRESS] = "longpress",
+	[GESTURE_DOUBLETAP] = "doubletap",
+};
+
+static const char *const MAP_ACTION_NAMES[MAP_ACTIONS] =
+{
+	[MAP_ACTION_NONE] = "none",
+	[MAP_ACTION_SELECT] = "select",
+	[MAP_ACTION_TAP] = "tap",
+	[MAP_ACTION_BANK_UP] = "bank_up",
+	[MAP_ACTION_BANK_DOWN] = "bank_down",
+};
+
+static const char *const MAP_SHAPE_NAMES[MAP_SHAPES] =
+{
+	[MAP_SHAPE_LINEAR] = "linear",
+	[MAP_SHAPE_AUDIO] = "audio",
+	[MAP_SHAPE_REVERSE] = "reverse",
+	[MAP_SHAPE_S] = "s",
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static int map_name(const char *const tok, const char *const *const names, const unsigned count);
+static int map_number(const char *const tok, const unsigned max);
+static int map_status(const char *const *const tok, const unsigned n, unsigned *const i, unsigned char *const status);
+static int map_curve(map_t *const map, const unsigned shape, const unsigned char lo, const unsigned char hi, const unsigned invert, unsigned *const repeats);
+static const char *map_rule(map_t *const map, const char *const *const tok, const unsigned n, const char *const *const devices, const unsigned count);
+
+#ifdef __cplusplus
+}
+#endif
+
+static int map_name(const char *const tok, const char *const *const names, const unsigned count)
+{
+	unsigned i;
+	for (i = 0; i < count; i++)
+	{
+		if (names[i] && !strcasecmp(tok, names[i]))
+			return i;
+	}
+	return -1;
+}
+
+static int map_number(const char *const tok, const unsigned max)
+{
+	char *end;
+	const unsigned long val = strtoul(tok, &end, 0);
+	return (end == tok) || *end || (val > max) ? -1 : (int)val;
+}
+
+/* Parses "<type> <channel>" into a status byte. */
+static int map_status(const char *const *const tok, const unsigned n, unsigned *const i, unsigned char *const status)
+{
+	int type, channel;
+	if ((*i + 2 > n) || ((type = map_name(tok[*i], MAP_TYPES, 8)) < 0) || ((channel = map_number(tok[*i + 1], 16)) < 1))
+		return -1;
+	*status = 0x80 | (type << 4) | (channel - 1);
+	*i += 2;
+	return 0;
+}
+
+/*
+ * Builds the table of a response curve from lo to hi, shared with identical
+ * tables. Returns its index, -1 if the table is the identity or -2 if there
+ * are too many tables. repeats tells whether outputs repeat.
+ */
+static int map_curve(map_t *const map, const unsigned shape, const unsigned char lo, const unsigned char hi, const unsigned invert, unsigned *const repeats)
+{
+	unsigned char table[0x80];
+	unsigned i, identity = 1;
+	*repeats = 0;
+	for (i = 0; i < 0x80; i++)
+	{
+		const long x = invert ? 0x7f - i : i, y = 0x7f - x;
+		long s, num; /* shape scaled to 0..127*127 */
+		switch (shape)
+		{
+			case MAP_SHAPE_AUDIO:
+				s = x * x;
+				break;
+			case MAP_SHAPE_REVERSE:
+				s = 0x7f * 0x7f - y * y;
+				break;
+			case MAP_SHAPE_S:
+				s = (3 * 0x7f * x * x - 2 * x * x * x) / 0x7f;
+				break;
+			default:
+				s = x * 0x7f;
+				break;
+		}
+		num = ((long)hi - (long)lo) * s;
+		table[i] = lo + (num >= 0 ? num + 0x7f * 0x7f / 2 : num - 0x7f * 0x7f / 2) / (0x7f * 0x7f);
+		identity &= table[i] == i;
+		*repeats |= i && (table[i] == table[i - 1]);
+	}
+	if (identity)
+		return -1;
+	for (i = 0; i < map->curves; i++)
+	{
+		if (!memcmp(map->curve[i], table, sizeof(table)))
+			return i;
+	}
+	if (map->curves >= MAP_CURVES)
+		return -2;
+	memcpy(map->curve[map->curves], table, sizeof(table));
+	return map->curves++;
+}
+
+static const char *map_rule(map_t *const map, const char *const *const tok, const unsigned n, const char *const *const devices, const unsigned count)
+{
+	map_entry_t entry = { .kind = MAP_DROP, .status = 0, .data1 = 0, .transform = MAP_COPY, .arg = 0, .thresh = 0, .hyst = 0, .slot = MAP_NO_SLOT, .len = 0 };
+	unsigned char status, lo = 0, hi = 0x7f;
+	int dev, data1 = -1, val, max, curve;
+	unsigned i = 1, j, shape = MAP_SHAPE_LINEAR, invert = 0, repeats;
+
+	if (!strcasecmp(tok[0], "gesture"))
+	{
+		int btn = -1, gesture, action;
+		if (n != 4)
+			return "gesture rule expects button, gesture and command";
+		if (strcmp(tok[1], "*") && ((btn = map_number(tok[1], GESTURE_BUTTONS - 1)) < 0))
+			return "invalid button";
+		if ((gesture = map_name(tok[2], MAP_GESTURES, GESTURES)) < 0)
+			return "unknown gesture";
+		if ((action = map_name(tok[3], MAP_ACTION_NAMES, MAP_ACTIONS)) < 0)
+			return "unknown command";
+		for (j = 0; j < GESTURE_BUTTONS; j++)
+		{
+			if ((btn < 0) || (btn == (int)j))
+				map->gesture[j][gesture] = action;
+		}
+		return 0;
+	}
+
+	if (!strcasecmp(tok[0], "route"))
+	{
+		int dst;
+		unsigned char types = 0;
+		if (n < 3)
+			return "route rule expects source and destination";
+		if (((dev = map_name(tok[1], devices, count)) < 0) || ((dst = map_name(tok[2], devices, count)) < 0))
+			return "unknown device";
+		for (i = 3; i < n; i++)
+		{
+			int type;
+			if (!strcasecmp(tok[i], "system"))
+				type = MAP_TYPE_SYSTEM;
+			else if ((type = map_name(tok[i], MAP_TYPES, 8)) < 0)
+				return "unknown message type";
+			types |= 1 << type;
+		}
+		map->routed = 1;
+		map->routes[dev] |= 1 << dst;
+		map->filter[dev][dst] = types ? types : MAP_TYPES_ALL;
+		return 0;
+	}
+
+	if ((dev = map_name(tok[0], devices, count)) < 0)
+		return "unknown device";
+	if (map_status(tok, n, &i, &status))
+		return "invalid message type or channel";
+	if (i < n)
+	{
+		if (!strcmp(tok[i], "*"))
+			i++;
+		else if ((data1 = map_number(tok[i], 0x7f)) >= 0)
+			i++;
+	}
+	if (i >= n)
+		return "missing action";
+
+	if (!strcasecmp(tok[i], "drop"))
+		i++;
+	else if (!strcasecmp(tok[i], "forward"))
+	{
+		entry.kind = MAP_FORWARD;
+		i++;
+	}
+	else if (!strcasecmp(tok[i], "program"))
+	{
+		entry.kind = MAP_PROGRAM;
+		i++;
+	}
+	else if (!strcasecmp(tok[i], "button"))
+	{
+		if ((i + 1 >= n) || ((val = map_number(tok[i + 1], GESTURE_BUTTONS - 1)) < 0))
+			return "invalid button";
+		entry.kind = MAP_BUTTON;
+		entry.data1 = val;
+		i += 2;
+	}
+	else
+	{
+		if (map_status(tok, n, &i, &entry.status))
+			return "unknown action";
+		entry.kind = MAP_MESSAGE;
+		if ((entry.len = midi_length(entry.status)) == 3)
+		{
+			if ((i >= n) || ((val = map_number(tok[i], 0x7f)) < 0))
+				return "output data1 missing";
+			entry.data1 = val;
+			i++;
+		}
+	}
+
+	while (i < n)
+	{
+		if (!strcasecmp(tok[i], "invert"))
+		{
+			invert = 1;
+			i++;
+		}
+		else if (!strcasecmp(tok[i], "curve") && (i + 1 < n) && ((val = map_name(tok[i + 1], MAP_SHAPE_NAMES, MAP_SHAPES)) >= 0))
+		{
+			shape = val;
+			i += 2;
+		}
+		else if (!strcasecmp(tok[i], "range") && (i + 2 < n) && ((val = map_number(tok[i + 1], 0x7f)) >= 0) && ((max = map_number(tok[i + 2], 0x7f)) >= 0))
+		{
+			lo = val;
+			hi = max;
+			i += 3;
+		}
+		else if (!strcasecmp(tok[i], "switch") && (i + 1 < n) && ((val = map_number(tok[i + 1], 0x7f)) >= 0))
+		{
+			entry.transform = MAP_SWITCH;
+			entry.arg = val;
+			i += 2;
+		}
+		else if (!strcasecmp(tok[i], "thresh") && (i + 1 < n) && ((val = map_number(tok[i + 1], 0x7f)) >= 0))
+		{
+			entry.thresh = val;
+			i += 2;
+		}
+		else if (!strcasecmp(tok[i], "hyst") && (i + 1 < n) && ((val = map_number(tok[i + 1], 0x7f)) >= 0))
+		{
+			entry.hyst = val;
+			i += 2;
+		}
+		else
+			return "invalid option";
+	}
+
+	if ((curve = map_curve(map, shape, lo, hi, invert, &repeats)) != -1)
+	{
+		if (curve < 0)
+			return "too many curves";
+		if (entry.transform == MAP_SWITCH)
+			return "switch cannot be combined with a curve";
+		entry.transform = MAP_CURVE;
+		entry.arg = curve;
+	}
+
+	if (entry.thresh || entry.hyst || repeats)
+	{
+		if (entry.kind != MAP_MESSAGE)
+			return "threshold, hysteresis and curves require a message action";
+		if (map->slots >= MAP_SLOTS)
+			return "too many mappings with thresholds or curves";
+		entry.slot = map->slots++;
+	}
+
+	if (!map->row[dev][status & 0x7f] && !(map->row[dev][status & 0x7f] = (map_entry_t *)calloc(0x80, sizeof(map_entry_t))))
+		return "out of memory";
+	map->defined |= 1 << dev;
+	for (j = 0; j < 0x80; j++)
+	{
+		if ((data1 < 0) || (data1 == (int)j))
+			map->row[dev][status & 0x7f][j] = entry;
+	}
+	return 0;
+}
+
+map_t *map_parse(const char *const text, const char *const *const devices, const unsigned count, unsigned *const line, const char **const error)
+{
+	map_t *map;
+	const char *ptr = text;
+	unsigned nr = 0;
+
+	*line = 0;
+	if (count > MAP_DEVICES)
+	{
+		*error = "too many devices";
+		return 0;
+	}
+	*error = "out of memory";
+	if (!(map = (map_t *)calloc(1, sizeof(map_t))))
+		return 0;
+	map->serial = __atomic_add_fetch(&map_serial, 1, __ATOMIC_RELAXED);
+	while (*ptr)
+	{
+		char buf[MAP_LINE_SIZE], *str, *save;
+		const char *tok[MAP_TOKENS];
+		const char *const end = ptr + strcspn(ptr, "\n");
+		unsigned n = 0;
+		nr++;
+		if ((size_t)(end - ptr) >= sizeof(buf))
+		{
+			*error = "line too long";
+			goto exit0;
+		}
+		memcpy(buf, ptr, end - ptr);
+		buf[end - ptr] = 0;
+		ptr = *end ? end + 1 : end;
+		if ((str = strchr(buf, '#')))
+			*str = 0;
+		for (str = strtok_r(buf, " \t\r", &save); str; str = strtok_r(0, " \t\r", &save))
+		{
+			if (n >= MAP_TOKENS)
+			{
+				*error = "too many tokens";
+				goto exit0;
+			}
+			tok[n++] = str;
+		}
+		if (n && (*error = map_rule(map, tok, n, devices, count)))
+			goto exit0;
+	}
+	*error = 0;
+	return map;
+
+exit0:
+	*line = nr;
+	map_free(map);
+	return 0;
+}
+
+map_t *map_load(const char *const path, const char *const *const devices, const unsigned count, unsigned *const line, const char **const error)
+{
+	FILE *file;
+	char *text = 0;
+	long size;
+	map_t *map = 0;
+
+	*line = 0;
+	if (!(file = fopen(path, "rb")))
+	{
+		*error = "cannot open file";
+		return 0;
+	}
+	*error = "cannot read file";
+	if (fseek(file, 0, SEEK_END) || ((size = ftell(file)) < 0) || fseek(file, 0, SEEK_SET))
+		goto exit0;
+	if (!(text = (char *)malloc(size + 1)))
+	{
+		*error = "out of memory";
+		goto exit0;
+	}
+	if (fread(text, 1, size, file) != (size_t)size)
+		goto exit0;
+	text[size] = 0;
+	map = map_parse(text, devices, count, line, error);
+exit0:
+	free(text);
+	fclose(file);
+	return map;
+}
+
+void map_free(map_t *const map)
+{
+	unsigned i, j;
+	if (!map)
+		return;
+	for (i = 0; i < MAP_DEVICES; i++)
+	{
+		for (j = 0; j < 0x80; j++)
+			free(map->row[i][j]);
+	}
+	free(map);
+}
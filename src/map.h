@@ -0,0 +1,195 @@
+#ifndef INC_MAP_H
+#define INC_MAP_H
+
+#include "gesture.h"
+
+#include <stddef.h>
+
+/*
+ * Message mapping compiled from a text description.
+ *
+ * Every source device owns one row of entries per status byte, indexed by
+ * data1 (or the only data byte of two byte messages). Rows of unmapped status
+ * bytes are not allocated; unmapped messages are dropped. Translating a
+ * message takes a single lookup.
+ *
+ * Translated messages are passed along routes from their source device to
+ * any number of destinations; each route may be limited to some message
+ * types. Without route rules the caller's default routes apply. System
+ * messages (SysEx, system common and realtime) are never mapped, they are
+ * passed along the routes as they are, as type "system".
+ *
+ * Response curves, ranges and inversion are compiled into shared tables of
+ * 128 output values. Mappings with a threshold, hysteresis or a table that
+ * maps several inputs to one output keep their last values in a slot and
+ * drop messages that would repeat the last output.
+ *
+ * Syntax, one rule per line, later rules override earlier ones, '#' starts a
+ * comment:
+ *   <device> <type> <channel> [<data1>|*] <action> [<option> ...]
+ *   gesture <button>|* <gesture> <command>
+ *   route <device> <device> [<type> ...]
+ * Types: noteoff, note, polyat, cc, pc, at, bend (routes also: system).
+ * Actions: drop, forward, button <n>, program, <type> <channel> [<data1>].
+ * Options: thresh <n>, hyst <n>, curve <shape>, range <min> <max>, invert,
+ *   switch <value>.
+ * Shapes: linear, audio, reverse, s.
+ * Gestures: press, release, longpress, doubletap.
+ * Commands: none, select, tap, bank_up, bank_down.
+ */
+
+#define MAP_DEVICES 8
+#define MAP_SLOTS 64
+#define MAP_CURVES 32
+#define MAP_NO_SLOT 0xff
+
+enum _map_kind_t {
+	MAP_DROP,
+	MAP_FORWARD,
+	MAP_MESSAGE, /* status and data1 replaced, value transformed */
+	MAP_BUTTON, /* value is the button state of gesture button data1 */
+	MAP_PROGRAM, /* value selects bank and button */
+	MAP_KINDS
+};
+
+enum _map_transform_t {
+	MAP_COPY,
+	MAP_CURVE, /* curve table arg */
+	MAP_SWITCH, /* 0 or arg */
+	MAP_TRANSFORMS
+};
+
+enum _map_action_t {
+	MAP_ACTION_NONE,
+	MAP_ACTION_SELECT, /* program change, tap if already selected */
+	MAP_ACTION_TAP,
+	MAP_ACTION_BANK_UP,
+	MAP_ACTION_BANK_DOWN,
+	MAP_ACTIONS
+};
+
+enum _map_shape_t {
+	MAP_SHAPE_LINEAR,
+	MAP_SHAPE_AUDIO, /* slow start, log taper */
+	MAP_SHAPE_REVERSE, /* fast start, reverse log taper */
+	MAP_SHAPE_S, /* slow at both ends */
+	MAP_SHAPES
+};
+
+typedef struct _map_entry_t {
+	unsigned char kind;
+	unsigned char status; /* output status including channel */
+	unsigned char data1; /* output data1 or button */
+	unsigned char transform;
+	unsigned char arg;
+	unsigned char thresh; /* minimum change to the last output value */
+	unsigned char hyst; /* minimum input change against the last direction */
+	unsigned char slot; /* state slot of the last values */
+	unsigned char len; /* output length */
+} map_entry_t;
+
+typedef struct _map_slot_t {
+	unsigned char valid; /* a value has been sent */
+	unsigned char value; /* last output value */
+	unsigned char input; /* last input value passing the hysteresis */
+	signed char dir; /* sign of the last input change */
+} map_slot_t;
+
+#define MAP_TYPE_SYSTEM 7
+#define MAP_TYPES_ALL 0xff
+
+typedef struct _map_t {
+	map_entry_t *row[MAP_DEVICES][0x80];
+	unsigned char gesture[GESTURE_BUTTONS][GESTURES];
+	unsigned slots;
+	unsigned serial; /* differs between mappings, slot indices of one mean nothing in another */
+	unsigned curves;
+	unsigned char curve[MAP_CURVES][0x80];
+	unsigned defined; /* mask of devices with message rules */
+	unsigned routed; /* route rules present */
+	unsigned routes[MAP_DEVICES]; /* mask of destinations per source */
+	unsigned char filter[MAP_DEVICES][MAP_DEVICES]; /* mask of message types per route */
+} map_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Returns 0 on failure; line and error describe the problem (line 0 if out of memory). */
+map_t *map_parse(const char *const text, const char *const *const devices, const unsigned count, unsigned *const line, const char **const error);
+
+map_t *map_load(const char *const path, const char *const *const devices, const unsigned count, unsigned *const line, const char **const error);
+
+void map_free(map_t *const map);
+
+#ifdef __cplusplus
+}
+#endif
+
+/* Finds the entry of a message of device dev, data1 is 0 for single byte messages. */
+static inline const map_entry_t *map_lookup(const map_t *const map, const unsigned dev, const unsigned char status, const unsigned char data1)
+{
+	const map_entry_t *const row = map->row[dev][status & 0x7f];
+	return row ? &row[data1 & 0x7f] : 0;
+}
+
+/* Returns the destinations of a message of device src, defaults without route rules. */
+static inline unsigned map_routes(const map_t *const map, const unsigned src, const unsigned char status, const unsigned sysex, const unsigned defaults)
+{
+	const unsigned type = sysex || (status >= 0xf0) ? MAP_TYPE_SYSTEM : (status >> 4) & 0x7;
+	unsigned routes, mask = 0;
+	if (!map->routed)
+		return defaults;
+	for (routes = map->routes[src]; routes; routes &= routes - 1)
+	{
+		const unsigned dst = __builtin_ctz(routes);
+		if (map->filter[src][dst] & (1 << type))
+			mask |= 1 << dst;
+	}
+	return mask;
+}
+
+static inline unsigned char map_value(const map_t *const map, const map_entry_t *const entry, const unsigned char value)
+{
+	switch (entry->transform)
+	{
+		case MAP_CURVE:
+			return map->curve[entry->arg][value & 0x7f];
+		case MAP_SWITCH:
+			return value ? entry->arg : 0;
+		default:
+			return value;
+	}
+}
+
+/*
+ * Decides whether the output value of input value in is sent and updates the
+ * slot. Inputs reversing the last direction by less than the hysteresis are
+ * ignored, outputs closer than the threshold to the last one are dropped.
+ */
+static inline int map_filter(const map_entry_t *const entry, map_slot_t *const slot, const unsigned char in, const unsigned char out)
+{
+	if (slot->valid)
+	{
+		const int change = (int)in - (int)slot->input;
+		const unsigned diff = out < slot->value ? slot->value - out : out - slot->value;
+		if (!change)
+			return 0;
+		if (slot->dir && ((change > 0 ? 1 : -1) != slot->dir) && ((unsigned)(change > 0 ? change : -change) < entry->hyst))
+			return 0;
+		slot->input = in;
+		slot->dir = change > 0 ? 1 : -1;
+		if (!diff || (diff < entry->thresh))
+			return 0;
+	}
+	else
+	{
+		slot->input = in;
+		slot->dir = 0;
+	}
+	slot->valid = 1;
+	slot->value = out;
+	return 1;
+}
+
+#endif
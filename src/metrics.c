@@ -0,0 +1,180 @@
+#include "metrics.h"
+#include "transport.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef API_WIN
+#	include <errno.h>
+#	include <poll.h>
+#	include <unistd.h>
+#	include <arpa/inet.h>
+#	include <netinet/in.h>
+#	include <sys/socket.h>
+#	include <sys/un.h>
+#endif
+
+#define METRICS_REQUEST_SIZE 1024
+#define METRICS_HEADER_SIZE 128
+
+#ifndef API_WIN
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static int metrics_tcp(const char *const addr);
+static int metrics_send(const int fd, const char *const buf, const size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+/* A port number is all digits, anything else is a socket path. */
+static int metrics_tcp(const char *const addr)
+{
+	return *addr && (strspn(addr, "0123456789") == strlen(addr));
+}
+
+/* Gives up on a client that takes no data for METRICS_TIMEOUT, the serving thread must not hang on it. */
+static int metrics_send(const int fd, const char *const buf, const size_t len)
+{
+	size_t sent = 0;
+	while (sent < len)
+	{
+		struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+		const ssize_t result = send(fd, buf + sent, len - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (result >= 0)
+		{
+			sent += result;
+			continue;
+		}
+		if (errno == EINTR)
+			continue;
+		if (((errno != EAGAIN) && (errno != EWOULDBLOCK)) || (poll(&pfd, 1, METRICS_TIMEOUT) <= 0))
+			return -1;
+	}
+	return 0;
+}
+
+#endif
+
+int metrics_listen(const char *const addr)
+{
+#ifdef API_WIN
+	(void)(addr);
+	return -1;
+#else
+	int fd, err;
+	if (metrics_tcp(addr))
+	{
+		const unsigned long port = strtoul(addr, 0, 10);
+		struct sockaddr_in sa;
+		const int one = 1;
+		if (!port || (port > 0xffff))
+		{
+			errno = EINVAL;
+			return -1;
+		}
+		memset(&sa, 0, sizeof(sa));
+		sa.sin_family = AF_INET;
+		sa.sin_port = htons(port);
+		sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+			return -1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(fd, (const struct sockaddr *)&sa, sizeof(sa)))
+			goto exit0;
+	}
+	else
+	{
+		struct sockaddr_un sa;
+		if (strlen(addr) >= sizeof(sa.sun_path))
+		{
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		memset(&sa, 0, sizeof(sa));
+		sa.sun_family = AF_UNIX;
+		strcpy(sa.sun_path, addr);
+		if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+			return -1;
+		if (unix_socket_stale(addr) || bind(fd, (const struct sockaddr *)&sa, sizeof(sa)))
+			goto exit0;
+	}
+	if (listen(fd, 4))
+		goto exit0;
+	return fd;
+exit0:
+	err = errno;
+	close(fd);
+	errno = err;
+	return -1;
+#endif
+}
+
+int metrics_serve(const int fd, const metrics_write_t emit, void *const context)
+{
+#ifdef API_WIN
+	(void)(fd);
+	(void)(emit);
+	(void)(context);
+	return -1;
+#else
+	char req[METRICS_REQUEST_SIZE], header[METRICS_HEADER_SIZE], *body = 0;
+	size_t rcvd = 0, size = 0;
+	FILE *file;
+	int cfd, len;
+	if ((cfd = accept4(fd, 0, 0, SOCK_CLOEXEC)) < 0)
+		return -1;
+	/* the request ends with an empty line, a client that sends nothing gets the answer anyway */
+	while (rcvd < sizeof(req) - 1)
+	{
+		struct pollfd pfd = { .fd = cfd, .events = POLLIN };
+		ssize_t result;
+		if (poll(&pfd, 1, METRICS_TIMEOUT) <= 0)
+			break;
+		if ((result = recv(cfd, req + rcvd, sizeof(req) - 1 - rcvd, 0)) <= 0)
+			break;
+		rcvd += result;
+		req[rcvd] = 0;
+		if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+			break;
+	}
+	if ((file = open_memstream(&body, &size)))
+	{
+		emit(context, file);
+		fclose(file);
+		len = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: " METRICS_CONTENT_TYPE "\r\nContent-Length: %zu\r\n\r\n", size);
+		if (!metrics_send(cfd, header, len))
+			metrics_send(cfd, body, size);
+		free(body);
+	}
+	else
+	{
+		static const char error[] = "HTTP/1.0 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n";
+		metrics_send(cfd, error, sizeof(error) - 1);
+	}
+	close(cfd);
+	return 0;
+#endif
+}
+
+void metrics_close(const int fd, const char *const addr)
+{
+#ifdef API_WIN
+	(void)(fd);
+	(void)(addr);
+#else
+	if (fd < 0)
+		return;
+	close(fd);
+	if (!metrics_tcp(addr))
+		unlink(addr);
+#endif
+}
+
+void metrics_family(FILE *const file, const char *const name, const char *const type, const char *const help)
+{
+	fprintf(file, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
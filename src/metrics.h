@@ -0,0 +1,41 @@
+#ifndef INC_METRICS_H
+#define INC_METRICS_H
+
+#include <stdio.h>
+
+/*
+ * Minimal HTTP endpoint for Prometheus scrapes.
+ *
+ * Listens on a TCP port of the loopback interface or on a Unix socket. Each
+ * connection is answered with the text of a callback in the Prometheus text
+ * format and closed; the request is read but not interpreted. The callback
+ * runs on the serving thread and is expected to only load counters, so a
+ * scrape never waits for or blocks the MIDI path.
+ */
+
+#define METRICS_CONTENT_TYPE "text/plain; version=0.0.4"
+#define METRICS_TIMEOUT 1000 /*ms for the request to arrive, and for the client to take the answer*/
+
+typedef void (*metrics_write_t)(void *const context, FILE *const file);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Listens on "<port>" of 127.0.0.1 or on a Unix socket path, returns the descriptor or -1. */
+int metrics_listen(const char *const addr);
+
+/* Accepts one connection and answers it, returns -1 if accept failed. */
+int metrics_serve(const int fd, const metrics_write_t emit, void *const context);
+
+/* Closes the listening socket, a Unix socket is removed. */
+void metrics_close(const int fd, const char *const addr);
+
+/* Writes the HELP and TYPE lines of a metric family. */
+void metrics_family(FILE *const file, const char *const name, const char *const type, const char *const help);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,127 @@
+#include "midi.h"
+
+static const unsigned char MIDI_LENGTHS[0x80] =
+{
+	[0x00 ... 0x0f] = 3, /* 0x8n note off */
+	[0x10 ... 0x1f] = 3, /* 0x9n note on */
+	[0x20 ... 0x2f] = 3, /* 0xan polyphonic key pressure */
+	[0x30 ... 0x3f] = 3, /* 0xbn control change */
+	[0x40 ... 0x4f] = 2, /* 0xcn program change */
+	[0x50 ... 0x5f] = 2, /* 0xdn channel pressure */
+	[0x60 ... 0x6f] = 3, /* 0xen pitch bend */
+	[0x70] = 0, /* 0xf0 system exclusive */
+	[0x71] = 2, /* 0xf1 MTC quarter frame */
+	[0x72] = 3, /* 0xf2 song position */
+	[0x73] = 2, /* 0xf3 song select */
+	[0x74 ... 0x75] = 0, /* 0xf4, 0xf5 undefined */
+	[0x76] = 1, /* 0xf6 tune request */
+	[0x77] = 0, /* 0xf7 end of exclusive */
+	[0x78 ... 0x7f] = 1, /* 0xf8..0xff realtime */
+};
+
+unsigned midi_length(const unsigned char status)
+{
+	return status & 0x80 ? MIDI_LENGTHS[status & 0x7f] : 0;
+}
+
+void midi_parser_reset(midi_parser_t *const parser)
+{
+	parser->event.msg = 0;
+	parser->status = 0;
+	parser->need = 0;
+}
+
+int midi_parse(midi_parser_t *const parser, const unsigned char *const buf, const size_t len, const tic_t tic, const midi_emit_t emit, void *const context)
+{
+	midi_event_t *const event = &parser->event;
+	int result, count = 0;
+	size_t i;
+	for (i = 0; i < len; i++)
+	{
+		const unsigned char byte = buf[i];
+		if (byte >= 0xf8)
+		{
+			/* realtime, may be interleaved anywhere */
+			const midi_event_t rt = { .tic = tic, .msg = midi_msg(1, byte, 0, 0), .dtic = 0 };
+			if ((result = emit(context, &rt)) < 0)
+				return result;
+			count++;
+		}
+		else if (byte & 0x80)
+		{
+			if (midi_flags(event) & MIDI_EVENT_SYSEX)
+			{
+				/* end of exclusive or SysEx aborted by another status */
+				if (byte == 0xf7)
+				{
+					if (midi_len(event) == MIDI_EVENT_SIZE)
+					{
+						if ((result = emit(context, event)) < 0)
+							return result;
+						count++;
+						event->tic = tic;
+						event->msg = MIDI_EVENT_SYSEX << MIDI_MSG_FLAGS_SHIFT;
+					}
+					midi_append(event, byte);
+				}
+				if ((result = emit(context, event)) < 0)
+					return result;
+				count++;
+				event->msg = 0;
+				if (byte == 0xf7)
+					continue;
+			}
+			event->tic = tic;
+			event->msg = midi_msg(1, byte, 0, 0);
+			if (byte == 0xf0)
+			{
+				event->msg |= MIDI_EVENT_SYSEX << MIDI_MSG_FLAGS_SHIFT;
+				parser->status = 0;
+				continue;
+			}
+			/* system common messages cancel running status */
+			parser->status = byte < 0xf0 ? byte : 0;
+			if (!(parser->need = MIDI_LENGTHS[byte & 0x7f]))
+				event->msg = 0;
+			else if (midi_len(event) == parser->need)
+			{
+				if ((result = emit(context, event)) < 0)
+					return result;
+				count++;
+				event->msg = 0;
+			}
+		}
+		else if (midi_flags(event) & MIDI_EVENT_SYSEX)
+		{
+			if (midi_len(event) == MIDI_EVENT_SIZE)
+			{
+				if ((result = emit(context, event)) < 0)
+					return result;
+				count++;
+				event->tic = tic;
+				event->msg = MIDI_EVENT_SYSEX << MIDI_MSG_FLAGS_SHIFT;
+			}
+			midi_append(event, byte);
+		}
+		else
+		{
+			if (!midi_len(event))
+			{
+				if (!parser->status)
+					continue; /* data byte without status */
+				event->tic = tic;
+				event->msg = midi_msg(1, parser->status, 0, 0);
+				parser->need = MIDI_LENGTHS[parser->status & 0x7f];
+			}
+			midi_append(event, byte);
+			if (midi_len(event) == parser->need)
+			{
+				if ((result = emit(context, event)) < 0)
+					return result;
+				count++;
+				event->msg = 0;
+			}
+		}
+	}
+	return count;
+}
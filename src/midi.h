@@ -0,0 +1,155 @@
+#ifndef INC_MIDI_H
+#define INC_MIDI_H
+
+#include "api.h"
+
+#include <stddef.h>
+
+#define MIDI_EVENT_SIZE 3 /*bytes, also the SysEx chunk size*/
+#define MIDI_EVENT_SRCS 8 /*ports an event can enter from*/
+
+enum _midi_event_flags_t {
+	MIDI_EVENT_SYSEX = 1 << 0, /* chunk of a system exclusive message */
+};
+
+/*
+ * An event is a value of a time stamp and one word, passed and queued by
+ * copy. The word is packed like a short message of midiOutShortMsg(): the
+ * status byte (or first SysEx byte) in the low byte followed by up to two
+ * data bytes, unused bytes are 0. The high byte holds the length, the flags
+ * and the source port. SysEx messages are the only ones split into several
+ * events.
+ */
+typedef struct _midi_event_t {
+	tic_t tic;
+	unsigned msg;
+	unsigned dtic; /* latency accumulated before tic, e.g. input to translation */
+} midi_event_t;
+
+#define MIDI_MSG_DATA 0x00ffffffU
+#define MIDI_MSG_LEN_SHIFT 24
+#define MIDI_MSG_FLAGS_SHIFT 26
+#define MIDI_MSG_SRC_SHIFT 27
+
+/* Packs a message of _len bytes, the bytes past _len have to be 0. */
+#define midi_msg(_len, _b0, _b1, _b2) \
+	((unsigned)(_len) << MIDI_MSG_LEN_SHIFT | (unsigned)(_b2) << 16 | (unsigned)(_b1) << 8 | (unsigned)(_b0))
+
+#define midi_event_initializer() { \
+	.tic = 0, .msg = 0, .dtic = 0 }
+
+static inline unsigned char midi_byte(const midi_event_t *const event, const unsigned i)
+{
+	return (event->msg >> (8 * i)) & 0xff;
+}
+
+static inline unsigned midi_len(const midi_event_t *const event)
+{
+	return (event->msg >> MIDI_MSG_LEN_SHIFT) & 0x3;
+}
+
+static inline unsigned midi_flags(const midi_event_t *const event)
+{
+	return (event->msg >> MIDI_MSG_FLAGS_SHIFT) & 0x1;
+}
+
+/* Port the event entered from. */
+static inline unsigned midi_src(const midi_event_t *const event)
+{
+	return (event->msg >> MIDI_MSG_SRC_SHIFT) & (MIDI_EVENT_SRCS - 1);
+}
+
+static inline void midi_set_src(midi_event_t *const event, const unsigned src)
+{
+	event->msg = (event->msg & ~((MIDI_EVENT_SRCS - 1U) << MIDI_MSG_SRC_SHIFT)) | src << MIDI_MSG_SRC_SHIFT;
+}
+
+/* Appends a byte, the event must hold less than MIDI_EVENT_SIZE. */
+static inline void midi_append(midi_event_t *const event, const unsigned char byte)
+{
+	event->msg = (event->msg | (unsigned)byte << (8 * midi_len(event))) + (1U << MIDI_MSG_LEN_SHIFT);
+}
+
+/* Copies the bytes to buf for a write, returns their number. */
+static inline unsigned midi_unpack(const midi_event_t *const event, unsigned char *const buf)
+{
+	const unsigned len = midi_len(event);
+	unsigned i;
+	for (i = 0; i < len; i++)
+		buf[i] = midi_byte(event, i);
+	return len;
+}
+
+/*
+ * Streaming MIDI 1.0 parser.
+ *
+ * Bytes are fed in arbitrary portions as returned by read(); framing is kept
+ * across calls. Running status is expanded, i.e. every emitted channel message
+ * carries its status byte. Realtime bytes (0xf8..0xff) are emitted as soon as
+ * they are seen without disturbing the message in progress. SysEx messages are
+ * emitted as MIDI_EVENT_SYSEX chunks of up to MIDI_EVENT_SIZE bytes, the first
+ * chunk starting with 0xf0 and the last one ending with 0xf7.
+ */
+typedef struct _midi_parser_t {
+	midi_event_t event;
+	unsigned char status;
+	unsigned char need;
+} midi_parser_t;
+
+#define midi_parser_initializer() { \
+	.event = midi_event_initializer(), .status = 0, .need = 0 }
+
+/*
+ * Serializer of events into a byte stream. With running status the status
+ * byte of a channel message is left out when it equals the previous one;
+ * system common messages and SysEx cancel running status, realtime bytes do
+ * not affect it.
+ */
+typedef struct _midi_writer_t {
+	unsigned running; /* running status enabled */
+	unsigned char status;
+} midi_writer_t;
+
+#define midi_writer_initializer(_running) { \
+	.running = _running, .status = 0 }
+
+/* Appends the bytes of event to buf, returns their number. */
+static inline unsigned midi_encode(midi_writer_t *const writer, const midi_event_t *const event, unsigned char *const buf)
+{
+	const unsigned char status = midi_byte(event, 0);
+	const unsigned len = midi_len(event);
+	unsigned i, skip = 0;
+	if (midi_flags(event) & MIDI_EVENT_SYSEX)
+		writer->status = 0;
+	else if (status < 0xf0)
+	{
+		skip = writer->running && (status == writer->status);
+		writer->status = status;
+	}
+	else if (status < 0xf8)
+		writer->status = 0;
+	for (i = skip; i < len; i++)
+		buf[i - skip] = midi_byte(event, i);
+	return len - skip;
+}
+
+/* Returns a negative value to abort parsing. */
+typedef int (*midi_emit_t)(void *const context, const midi_event_t *const event);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Returns the total length of a message starting with status, 0 if undefined or variable. */
+unsigned midi_length(const unsigned char status);
+
+/* Returns the number of events emitted or the negative result of a failed emit. */
+int midi_parse(midi_parser_t *const parser, const unsigned char *const buf, const size_t len, const tic_t tic, const midi_emit_t emit, void *const context);
+
+void midi_parser_reset(midi_parser_t *const parser);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,213 @@
+#include "model.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+/* Bank and channel of program change value _v on a POD of _n programs from _base. */
+#define model_select(_base, _n, _v) \
+	((_v) >= (_base) && (_v) < (_base) + (_n) ? ((_v) - (_base)) / MODEL_CHANNELS << 8 | ((_v) - (_base)) % MODEL_CHANNELS : MODEL_NO_SELECT)
+#define model_select_4(_base, _n, _v) \
+	model_select(_base, _n, (_v)), model_select(_base, _n, (_v) + 1), \
+	model_select(_base, _n, (_v) + 2), model_select(_base, _n, (_v) + 3)
+#define model_select_16(_base, _n, _v) \
+	model_select_4(_base, _n, (_v)), model_select_4(_base, _n, (_v) + 4), \
+	model_select_4(_base, _n, (_v) + 8), model_select_4(_base, _n, (_v) + 12)
+#define model_select_64(_base, _n, _v) \
+	model_select_16(_base, _n, (_v)), model_select_16(_base, _n, (_v) + 16), \
+	model_select_16(_base, _n, (_v) + 32), model_select_16(_base, _n, (_v) + 48)
+#define model_select_table(_base, _n) { \
+	model_select_64(_base, _n, 0), model_select_64(_base, _n, 64) }
+
+/* Program change 0 is the manual mode of the Pocket POD and the POD 2.0. */
+static const unsigned short SELECT_POCKET_POD[0x80] = model_select_table(1, 124);
+static const unsigned short SELECT_POD_20[0x80] = model_select_table(1, 36);
+static const unsigned short SELECT_POD_XT[0x80] = model_select_table(0, 64);
+
+/* The same on all models, indexed by controller. */
+static const unsigned char PRIO_CCS_POD[0x80] =
+{
+	[0x2b] = 1, /* wah on/off, the foot switch */
+	[0x40] = 1, /* tap */
+};
+
+/*
+ * The family and member codes of the identity replies are not checked
+ * against a reply of a real unit yet, only the manufacturer id is known to
+ * be right. A wrong code makes --identify report an unknown model, nothing
+ * else depends on them.
+ */
+const model_t MODEL_TABLE[MODELS] =
+{
+	[MODEL_FBV_EXPRESS] = {
+		.name = "express", .title = "FBV Express Mk II", .kind = MODEL_KIND_FBV,
+#ifdef API_WIN
+		.id = "FBV Express Mk II",
+#else
+		.id = "usb-Line_6_FBV_Express_Mk_II-00",
+#endif
+		.btns = 4, .btn_cc = { 0x14, 0x15, 0x16, 0x17 },
+		.bank_down = MODEL_NO_BTN, .bank_up = MODEL_NO_BTN,
+		.volume_cc = 0x07, .pedal_cc = 0x0b, .switch_cc = 0x66,
+	},
+	[MODEL_FBV_SHORTBOARD] = {
+		.name = "shortboard", .title = "FBV Shortboard Mk II", .kind = MODEL_KIND_FBV,
+#ifdef API_WIN
+		.id = "FBV Shortboard Mk II",
+#else
+		.id = "usb-Line_6_FBV_Shortboard_Mk_II-00",
+#endif
+		.btns = 6, .btn_cc = { 0x14, 0x15, 0x16, 0x17, 0x18, 0x19 },
+		.bank_down = 4, .bank_up = 5,
+		.volume_cc = 0x07, .pedal_cc = 0x0b, .switch_cc = 0x66,
+	},
+	[MODEL_POCKET_POD] = {
+		.name = "pocketpod", .title = "Pocket POD", .kind = MODEL_KIND_POD,
+#ifdef API_WIN
+		.id = "Line 6 Pocket POD",
+#else
+		.id = "usb-Line_6_Line_6_Pocket_POD-00",
+#endif
+		.family = 0x0000, .member = 0x0600,
+		.programs = 124, .banks = 124 / MODEL_CHANNELS, .program_base = 1, .select = SELECT_POCKET_POD,
+		.prio_ccs = PRIO_CCS_POD, .wah_cc = 0x04, .wah_switch_cc = 0x2b,
+	},
+	/* serial MIDI only, the interface names the device */
+	[MODEL_POD_20] = {
+		.name = "pod20", .title = "POD 2.0", .kind = MODEL_KIND_POD, .id = 0,
+		.family = 0x0000, .member = 0x0300,
+		.programs = 36, .banks = 36 / MODEL_CHANNELS, .program_base = 1, .select = SELECT_POD_20,
+		.prio_ccs = PRIO_CCS_POD, .wah_cc = 0x04, .wah_switch_cc = 0x2b,
+	},
+	[MODEL_POD_XT] = {
+		.name = "podxt", .title = "PODxt", .kind = MODEL_KIND_POD,
+#ifdef API_WIN
+		.id = "Line 6 PODxt",
+#else
+		.id = "usb-Line_6_PODxt-00",
+#endif
+		.family = 0x0003, .member = 0x0002,
+		.programs = 64, .banks = 64 / MODEL_CHANNELS, .program_base = 0, .select = SELECT_POD_XT,
+		.prio_ccs = PRIO_CCS_POD, .wah_cc = 0x04, .wah_switch_cc = 0x2b,
+	},
+};
+
+const unsigned char MODEL_IDENTITY_REQUEST[6] = { 0xf0, 0x7e, 0x7f, 0x06, 0x01, 0xf7 };
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static int model_append(char *const buf, const size_t size, size_t *const len, const char *const format, ...) __attribute__((format(printf, 4, 5)));
+static int model_fbv(const char *const name, const model_t *const fbv, const model_t *const pod, char *const buf, const size_t size, size_t *const len);
+
+#ifdef __cplusplus
+}
+#endif
+
+int model_find(const char *const name)
+{
+	unsigned i;
+	for (i = 0; i < MODELS; i++)
+	{
+		if (!strcasecmp(name, MODEL_TABLE[i].name))
+			return i;
+	}
+	return -1;
+}
+
+/* Counts what does not fit like snprintf(), the text is cut at size - 1 bytes. */
+static int model_append(char *const buf, const size_t size, size_t *const len, const char *const format, ...)
+{
+	va_list args;
+	int n;
+	va_start(args, format);
+	n = vsnprintf(*len < size ? buf + *len : 0, *len < size ? size - *len : 0, format, args);
+	va_end(args);
+	if (n < 0)
+		return -1;
+	*len += n;
+	return 0;
+}
+
+/* The rules of one floorboard, its pedals control the POD model pod. */
+static int model_fbv(const char *const name, const model_t *const fbv, const model_t *const pod, char *const buf, const size_t size, size_t *const len)
+{
+	unsigned i;
+	if (model_append(buf, size, len, "# %s\n", fbv->title) ||
+		model_append(buf, size, len, "%s cc 1 0x%02x cc 1 0x07 thresh 2 # volume pedal\n", name, fbv->volume_cc) ||
+		model_append(buf, size, len, "%s cc 1 0x%02x cc 1 0x%02x thresh 2 # expression pedal > wah position\n", name, fbv->pedal_cc, pod->wah_cc))
+		return -1;
+	for (i = 0; i < fbv->btns; i++)
+	{
+		if (model_append(buf, size, len, "%s cc 1 0x%02x button %u\n", name, fbv->btn_cc[i], i))
+			return -1;
+	}
+	return model_append(buf, size, len, "%s cc 1 0x%02x cc 1 0x%02x switch 0x40 # foot switch > wah on/off\n", name, fbv->switch_cc, pod->wah_switch_cc);
+}
+
+int model_map(const char *const *const names, const unsigned *const models, const unsigned count, char *const buf, const size_t size)
+{
+	const model_t *pod;
+	size_t len = 0;
+	unsigned down = 0, up = 0, first, i;
+	for (first = 0; (first < count) && (MODEL_TABLE[models[first]].kind != MODEL_KIND_POD); first++);
+	if (first >= count)
+		return -1;
+	pod = &MODEL_TABLE[models[first]];
+	for (i = 0; i < count; i++)
+	{
+		const model_t *const fbv = &MODEL_TABLE[models[i]];
+		if (fbv->kind != MODEL_KIND_FBV)
+			continue;
+		if (model_fbv(names[i], fbv, pod, buf, size, &len))
+			return -1;
+		/* buttons are shared by all floorboards, each bank button is named once */
+		if (fbv->bank_down != MODEL_NO_BTN)
+			down |= 1U << fbv->bank_down;
+		if (fbv->bank_up != MODEL_NO_BTN)
+			up |= 1U << fbv->bank_up;
+	}
+	if (model_append(buf, size, &len, "# %s\n%s pc 1 * program\ngesture * press select\n", pod->title, names[first]))
+		return -1;
+	for (i = 0; i < MODEL_BTNS; i++)
+	{
+		if (((down >> i) & 1) && model_append(buf, size, &len, "gesture %u press bank_down\n", i))
+			return -1;
+		if (((up >> i) & 1) && model_append(buf, size, &len, "gesture %u press bank_up\n", i))
+			return -1;
+	}
+	return len;
+}
+
+int model_identify(model_ident_t *const ident, const unsigned char byte)
+{
+	/* F0 7E <device> 06 02, the Line 6 manufacturer id, then family and member LSB first */
+	static const unsigned char REPLY[] = { 0xf0, 0x7e, 0x00, 0x06, 0x02, 0x00, 0x01, 0x0c };
+	unsigned family, member, i;
+	if (byte >= 0xf8)
+		return -1; /* real-time, may interleave */
+	if (byte == 0xf0)
+		ident->pos = 0;
+	if (ident->pos == MODEL_IDENT_IDLE)
+		return -1;
+	if (ident->pos >= sizeof(REPLY))
+		ident->id[ident->pos - sizeof(REPLY)] = byte;
+	else if ((ident->pos != 2) && (byte != REPLY[ident->pos]))
+	{
+		ident->pos = MODEL_IDENT_IDLE;
+		return -1;
+	}
+	if (++ident->pos < sizeof(REPLY) + sizeof(ident->id))
+		return -1;
+	ident->pos = MODEL_IDENT_IDLE;
+	family = ident->id[0] | ident->id[1] << 8;
+	member = ident->id[2] | ident->id[3] << 8;
+	for (i = 0; i < MODELS; i++)
+	{
+		if ((MODEL_TABLE[i].family || MODEL_TABLE[i].member) && (MODEL_TABLE[i].family == family) && (MODEL_TABLE[i].member == member))
+			return i;
+	}
+	return MODELS;
+}
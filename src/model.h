@@ -0,0 +1,103 @@
+#ifndef INC_MODEL_H
+#define INC_MODEL_H
+
+#include <stddef.h>
+
+/*
+ * Device models.
+ *
+ * Every port is an FBV or a POD of one model. A model holds what differs
+ * between the units of a kind: the buttons and controllers of a floorboard,
+ * the program numbering and the controllers of a POD, the default device
+ * name and the Line 6 identity. The tables are constants, program changes
+ * in particular are looked up in a table of 128 entries per POD model that
+ * the preprocessor fills, so the control stage never branches on the model.
+ *
+ * Programs are organized in banks of MODEL_CHANNELS channels (A to D) on all
+ * PODs, the first channel buttons of a floorboard select them.
+ */
+
+#define MODEL_CHANNELS 4 /*per bank*/
+#define MODEL_BTNS 8 /*buttons of a floorboard, at most GESTURE_BUTTONS*/
+#define MODEL_NO_BTN 0xff
+#define MODEL_NO_SELECT 0xffff
+
+enum _model_kind_t {
+	MODEL_KIND_FBV,
+	MODEL_KIND_POD,
+	MODEL_KINDS
+};
+
+enum _model_index_t {
+	MODEL_FBV_EXPRESS,
+	MODEL_FBV_SHORTBOARD,
+	MODEL_POCKET_POD,
+	MODEL_POD_20,
+	MODEL_POD_XT,
+	MODELS
+};
+
+typedef struct _model_t {
+	const char *name; /* in port specifications */
+	const char *title; /* in messages */
+	unsigned kind;
+	const char *id; /* default "by-id" name (device name on Windows), 0 if there is none */
+	unsigned short family, member; /* of the identity reply, 0 if not known */
+	/* FBV */
+	unsigned char btns; /* buttons, the first MODEL_CHANNELS select channels */
+	unsigned char btn_cc[MODEL_BTNS];
+	unsigned char bank_down, bank_up; /* buttons or MODEL_NO_BTN */
+	unsigned char volume_cc, pedal_cc, switch_cc; /* pedals and toe switch */
+	/* POD */
+	unsigned char programs, banks;
+	unsigned char program_base; /* program change value of bank 1 channel A */
+	const unsigned short *select; /* bank << 8 | channel by program change value, MODEL_NO_SELECT if none */
+	const unsigned char *prio_ccs; /* controllers scheduled ahead of coalesced pedal data, 0 if none */
+	unsigned char wah_cc, wah_switch_cc; /* volume is the MIDI standard controller 7 */
+} model_t;
+
+/* Matches an identity reply byte by byte, see model_identify(). */
+typedef struct _model_ident_t {
+	unsigned char pos;
+	unsigned char id[4];
+} model_ident_t;
+
+#define model_ident_initializer() { \
+	.pos = MODEL_IDENT_IDLE, .id = { 0 } }
+
+#define MODEL_IDENT_IDLE 0xff
+
+extern const model_t MODEL_TABLE[MODELS];
+
+/* Universal identity request to all devices. */
+extern const unsigned char MODEL_IDENTITY_REQUEST[6];
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Returns the index of the model of that name or -1. */
+int model_find(const char *const name);
+
+/*
+ * Writes the default mapping of count ports, named and of the models given
+ * by index, see map.h. Every FBV gets the rules of its model, the first POD
+ * those of program changes. The mapping is built as text and goes through
+ * map_parse() like a mapping file, so the defaults cannot take a path of
+ * their own. Like snprintf(), returns the length of the complete text, of
+ * which at most size - 1 bytes are written, and -1 without a POD.
+ */
+int model_map(const char *const *const names, const unsigned *const models, const unsigned count, char *const buf, const size_t size);
+
+/*
+ * Feeds a byte received from a device. Returns the index of the model once a
+ * Line 6 identity reply is complete, MODELS for one of an unknown model and
+ * -1 otherwise.
+ */
+int model_identify(model_ident_t *const ident, const unsigned char byte);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
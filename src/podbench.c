@@ -0,0 +1,381 @@
+#include "api.h"
+#include "midi.h"
+#include "stats.h"
+
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+/*
+ * End-to-end benchmark of podfbv without hardware.
+ *
+ * Two pseudo-terminals stand in for the devices. podfbv is started on them
+ * with --fbv_dev/--pod_dev (plus any arguments after "--"), an injector thread
+ * writes a synthetic workload to the FBV side and the main thread reads the
+ * POD side. Every expected output message is keyed by its kind and value;
+ * the latency is taken from the last time the matching input was written.
+ * Assumes the built-in mapping.
+ */
+
+#define BENCH_SETTLE_MS 500
+#define BENCH_DRAIN_MS 300
+#define BENCH_BUF_SIZE 256
+#define BENCH_ARGS 32
+
+enum _bench_workload_t {
+	WORKLOAD_SWEEP, /* volume pedal sweeps */
+	WORKLOAD_BUTTONS, /* press/release storm over all buttons */
+	WORKLOAD_MIXED, /* pedal sweeps with buttons and foot switch */
+	WORKLOADS
+};
+
+enum _bench_key_t {
+	KEY_VOL, /* b0 07 <value> */
+	KEY_PC, /* c0 <program> */
+	KEY_FS, /* b0 2b <value> */
+	KEYS
+};
+
+static const char *const WORKLOAD_NAMES[WORKLOADS] =
+{
+	[WORKLOAD_SWEEP] = "sweep",
+	[WORKLOAD_BUTTONS] = "buttons",
+	[WORKLOAD_MIXED] = "mixed",
+};
+
+static const unsigned WORKLOAD_RATES[WORKLOADS] = /*messages per second*/
+{
+	[WORKLOAD_SWEEP] = 1000,
+	[WORKLOAD_BUTTONS] = 100,
+	[WORKLOAD_MIXED] = 1000,
+};
+
+typedef struct _bench_t {
+	unsigned workload, rate;
+	tic_t duration;
+	int fbv, pod;
+	unsigned running;
+	unsigned long long sent;
+	tic_t tic_first, tic_last;
+	tic_t keys[KEYS][0x80]; /* last input time per expected output */
+	/* reader */
+	unsigned long long rcvd, matched;
+	tic_t rcvd_first, rcvd_last;
+	histogram_t hist;
+} bench_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static int pty_open(int *const master, char *const name, const size_t size);
+static void *inject(void *const context);
+static int receive(void *const context, const midi_event_t *const event);
+static int bench_run(const char *const podfbv, char *const *const args, const unsigned nargs, const unsigned workload, const unsigned rate, const unsigned duration_ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+int main(int argc, char **argv)
+{
+	const char *podfbv = "./podfbv";
+	char *args[BENCH_ARGS];
+	unsigned nargs = 0, rate = 0, duration_ms = 2000, workload = WORKLOADS;
+	int i, result = 0;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "--podfbv") && (++i < argc))
+			podfbv = argv[i];
+		else if (!strcmp(argv[i], "--workload") && (++i < argc))
+		{
+			for (workload = 0; (workload < WORKLOADS) && strcmp(argv[i], WORKLOAD_NAMES[workload]); workload++);
+			if (workload >= WORKLOADS)
+			{
+				printf("Unknown workload \"%s\".\n", argv[i]);
+				return EXIT_FAILURE;
+			}
+		}
+		else if (!strcmp(argv[i], "--rate") && (++i < argc))
+			rate = strtoul(argv[i], 0, 0);
+		else if (!strcmp(argv[i], "--duration") && (++i < argc))
+			duration_ms = strtoul(argv[i], 0, 0);
+		else if (!strcmp(argv[i], "--"))
+		{
+			for (i++; (i < argc) && (nargs < BENCH_ARGS - 6); i++)
+				args[nargs++] = argv[i];
+		}
+		else
+		{
+			printf("Usage: %s [--podfbv <path>] [--workload sweep|buttons|mixed] [--rate <msgs/s>] [--duration <ms>] [-- <podfbv args>]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	for (i = 0; i < WORKLOADS; i++)
+	{
+		if ((workload < WORKLOADS) && (workload != (unsigned)i))
+			continue;
+		if (bench_run(podfbv, args, nargs, i, rate ? rate : WORKLOAD_RATES[i], duration_ms))
+			result = -1;
+	}
+	return result ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static int pty_open(int *const master, char *const name, const size_t size)
+{
+	struct termios tio;
+	int slave;
+	if ((*master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC)) < 0)
+		return -1;
+	if (grantpt(*master) || unlockpt(*master) || ptsname_r(*master, name, size) || ((slave = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC)) < 0))
+	{
+		close(*master);
+		return -1;
+	}
+	/* raw mode sticks to the pair as long as a slave descriptor is open */
+	if (!tcgetattr(slave, &tio))
+	{
+		cfmakeraw(&tio);
+		tcsetattr(slave, TCSANOW, &tio);
+	}
+	return slave;
+}
+
+static void *inject(void *const context)
+{
+	bench_t *const ctx = (bench_t *)context;
+	const tic_t period = TICS_PER_SEC / ctx->rate;
+	unsigned step = 0, btn = 0, pressed = 0, fs = 0, vol = 0;
+	int dir = 2;
+	tic_t next, end;
+	tic_get(&next);
+	end = next + ctx->duration;
+	ctx->tic_first = next;
+	while (__atomic_load_n(&ctx->running, __ATOMIC_RELAXED) && (next < end))
+	{
+		unsigned char msg[3] = { 0xb0 };
+		unsigned key = KEYS, val = 0, kind = ctx->workload;
+		struct timespec ts = { .tv_sec = next / TICS_PER_SEC, .tv_nsec = next % TICS_PER_SEC };
+		tic_t tic;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0);
+		if (kind == WORKLOAD_MIXED)
+			kind = !(step % 50) ? WORKLOAD_MIXED : !(step % 10) ? WORKLOAD_BUTTONS : WORKLOAD_SWEEP;
+		switch (kind)
+		{
+			case WORKLOAD_SWEEP:
+				/* triangle in steps above the pedal threshold */
+				if ((vol + dir > 0x7f) || ((int)vol + dir < 0))
+					dir = -dir;
+				vol += dir;
+				msg[1] = 0x07;
+				msg[2] = vol;
+				key = KEY_VOL;
+				val = vol;
+				break;
+			case WORKLOAD_BUTTONS:
+				msg[1] = 0x14 + btn;
+				msg[2] = (pressed = !pressed) ? 0x7f : 0x00;
+				if (pressed)
+				{
+					/* buttons cycle, so every press selects another program */
+					key = KEY_PC;
+					val = btn + 1;
+				}
+				else
+					btn = (btn + 1) % 4;
+				break;
+			default:
+				msg[1] = 0x66;
+				msg[2] = (fs = !fs) ? 0x7f : 0x00;
+				key = KEY_FS;
+				val = fs ? 0x40 : 0x00;
+				break;
+		}
+		tic_get(&tic);
+		if (key < KEYS)
+			__atomic_store_n(&ctx->keys[key][val], tic, __ATOMIC_RELAXED);
+		if (write(ctx->fbv, msg, sizeof(msg)) != sizeof(msg))
+			break;
+		ctx->tic_last = tic;
+		ctx->sent++;
+		step++;
+		next += period;
+	}
+	__atomic_store_n(&ctx->running, 0, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static int receive(void *const context, const midi_event_t *const event)
+{
+	bench_t *const ctx = (bench_t *)context;
+	unsigned key = KEYS, val = 0;
+	const unsigned char status = midi_byte(event, 0), data1 = midi_byte(event, 1);
+	tic_t sent;
+	if ((status == 0xb0) && (midi_len(event) == 3))
+	{
+		key = data1 == 0x07 ? KEY_VOL : data1 == 0x2b ? KEY_FS : KEYS;
+		val = midi_byte(event, 2);
+	}
+	else if ((status == 0xc0) && (midi_len(event) == 2))
+	{
+		key = KEY_PC;
+		val = data1;
+	}
+	if (!ctx->rcvd++)
+		ctx->rcvd_first = event->tic;
+	ctx->rcvd_last = event->tic;
+	if ((key < KEYS) && (sent = __atomic_exchange_n(&ctx->keys[key][val & 0x7f], 0, __ATOMIC_RELAXED)))
+	{
+		histogram_add(&ctx->hist, event->tic - sent);
+		ctx->matched++;
+	}
+	return 0;
+}
+
+#define tic2us(_tic) ((double)(_tic) * 1e6 / (double)TICS_PER_SEC)
+
+static int bench_run(const char *const podfbv, char *const *const args, const unsigned nargs, const unsigned workload, const unsigned rate, const unsigned duration_ms)
+{
+	static bench_t ctx;
+	char fbv_name[64], pod_name[64];
+	char *argv[BENCH_ARGS];
+	int fbv_slave = -1, pod_slave = -1, status;
+	midi_parser_t parser = midi_parser_initializer();
+	thread_t thread;
+	pid_t pid = -1;
+	unsigned i, n = 0, injecting = 0;
+	tic_t drain = 0;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.workload = workload;
+	ctx.rate = rate;
+	ctx.duration = (tic_t)duration_ms * TICS_PER_SEC / 1000;
+	ctx.fbv = ctx.pod = -1;
+	if (((fbv_slave = pty_open(&ctx.fbv, fbv_name, sizeof(fbv_name))) < 0) || ((pod_slave = pty_open(&ctx.pod, pod_name, sizeof(pod_name))) < 0))
+	{
+		printf("Failed to open pseudo-terminals (%s).\n", strerror(errno));
+		goto exit0;
+	}
+
+	argv[n++] = (char *)podfbv;
+	for (i = 0; i < nargs; i++)
+		argv[n++] = args[i];
+	argv[n++] = "--fbv_dev";
+	argv[n++] = fbv_name;
+	argv[n++] = "--pod_dev";
+	argv[n++] = pod_name;
+	argv[n] = 0;
+	if ((pid = fork()) < 0)
+		goto exit0;
+	if (!pid)
+	{
+		const int null = open("/dev/null", O_WRONLY);
+		dup2(null, STDOUT_FILENO);
+		execv(podfbv, argv);
+		_exit(EXIT_FAILURE);
+	}
+
+	/* let podfbv open and probe the devices, discard what it wrote */
+	sleep_ms(BENCH_SETTLE_MS);
+	for (;;)
+	{
+		struct pollfd fds[2] = { { .fd = ctx.fbv, .events = POLLIN }, { .fd = ctx.pod, .events = POLLIN } };
+		unsigned char buf[BENCH_BUF_SIZE];
+		if (poll(fds, 2, 0) <= 0)
+			break;
+		for (i = 0; i < 2; i++)
+		{
+			if ((fds[i].revents & POLLIN) && (read(fds[i].fd, buf, sizeof(buf)) <= 0))
+				break;
+		}
+	}
+
+	ctx.running = 1;
+	if (thread_create(&thread, &inject, &ctx))
+		goto exit0;
+	injecting = 1;
+	for (;;)
+	{
+		struct pollfd fds[2] = { { .fd = ctx.pod, .events = POLLIN }, { .fd = ctx.fbv, .events = POLLIN } };
+		unsigned char buf[BENCH_BUF_SIZE];
+		ssize_t rcvd;
+		tic_t tic;
+		if (poll(fds, 2, 10/*ms*/) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		tic_get(&tic);
+		if (fds[0].revents & POLLIN)
+		{
+			if ((rcvd = read(ctx.pod, buf, sizeof(buf))) <= 0)
+				break;
+			midi_parse(&parser, buf, rcvd, tic, &receive, &ctx);
+		}
+		if ((fds[1].revents & POLLIN) && (read(ctx.fbv, buf, sizeof(buf)) <= 0))
+			break;
+		if (fds[0].revents & (POLLHUP | POLLERR))
+			break;
+		if (!__atomic_load_n(&ctx.running, __ATOMIC_ACQUIRE))
+		{
+			if (!drain)
+				drain = tic + (tic_t)BENCH_DRAIN_MS * TICS_PER_SEC / 1000;
+			else if (tic >= drain)
+				break;
+		}
+	}
+	__atomic_store_n(&ctx.running, 0, __ATOMIC_RELAXED);
+	thread_join(&thread);
+	injecting = 0;
+
+	printf("%-8s %5u msgs/s: sent %llu (%.0f/s), received %llu (%.0f/s), matched %llu, latency p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+		WORKLOAD_NAMES[workload], rate,
+		ctx.sent, ctx.tic_last > ctx.tic_first ? (double)(ctx.sent - 1) * TICS_PER_SEC / (ctx.tic_last - ctx.tic_first) : 0.,
+		ctx.rcvd, ctx.rcvd_last > ctx.rcvd_first ? (double)(ctx.rcvd - 1) * TICS_PER_SEC / (ctx.rcvd_last - ctx.rcvd_first) : 0.,
+		ctx.matched,
+		tic2us(histogram_quantile(&ctx.hist, .5)), tic2us(histogram_quantile(&ctx.hist, .99)), tic2us(histogram_quantile(&ctx.hist, .999)),
+		tic2us(ctx.hist.max));
+
+	/* closing the devices also releases input threads blocked in read() */
+	kill(pid, SIGINT);
+	close(ctx.fbv);
+	close(ctx.pod);
+	close(fbv_slave);
+	close(pod_slave);
+	waitpid(pid, &status, 0);
+	return 0;
+
+exit0:
+	printf("Benchmark \"%s\" failed.\n", WORKLOAD_NAMES[workload]);
+	if (injecting)
+	{
+		__atomic_store_n(&ctx.running, 0, __ATOMIC_RELAXED);
+		thread_join(&thread);
+	}
+	if (pid > 0)
+	{
+		kill(pid, SIGKILL);
+		waitpid(pid, &status, 0);
+	}
+	if (ctx.fbv >= 0)
+		close(ctx.fbv);
+	if (ctx.pod >= 0)
+		close(ctx.pod);
+	if (fbv_slave >= 0)
+		close(fbv_slave);
+	if (pod_slave >= 0)
+		close(pod_slave);
+	return -1;
+}
@@ -0,0 +1,96 @@
+#include "capture.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+/*
+ * Decodes a capture ring written by "podfbv --capture <file>", oldest record
+ * first. Time is printed relative to the first record, followed by the gap
+ * to the previous record.
+ */
+
+int main(int argc, char **argv)
+{
+	const capture_header_t *header;
+	const capture_record_t *ring;
+	unsigned long long head, pos, first;
+	struct stat st;
+	void *base;
+	tic_t tic0 = 0, tic1 = 0;
+	unsigned skipped = 0, printed = 0;
+	int fd;
+
+	if (argc != 2)
+	{
+		printf("Usage: %s <capture file>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (((fd = open(argv[1], O_RDONLY)) < 0) || fstat(fd, &st))
+	{
+		printf("Failed to open \"%s\".\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+	if (((size_t)st.st_size < sizeof(capture_header_t)) || ((base = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED))
+	{
+		printf("Failed to map \"%s\".\n", argv[1]);
+		goto exit0;
+	}
+	header = (const capture_header_t *)base;
+	ring = (const capture_record_t *)(header + 1);
+	if (memcmp(header->magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) || (header->version != CAPTURE_VERSION) ||
+		(header->record_size != sizeof(capture_record_t)) || !header->records || (header->records & (header->records - 1)) ||
+		((size_t)st.st_size < sizeof(capture_header_t) + (size_t)header->records * sizeof(capture_record_t)))
+	{
+		printf("\"%s\" is not a capture file.\n", argv[1]);
+		goto exit1;
+	}
+
+	head = header->head;
+	first = head > header->records ? head - header->records : 0;
+	printf("%llu records captured, %llu in ring.\n", head, head - first);
+	for (pos = first; pos < head; pos++)
+	{
+		const capture_record_t *const rec = &ring[pos & (header->records - 1)];
+		const unsigned dev = rec->dir & ~CAPTURE_OUT;
+		midi_event_t event = midi_event_initializer();
+		char name[CAPTURE_NAME_SIZE + 8];
+		unsigned i;
+		event.msg = rec->msg;
+		if (rec->seq != (unsigned)pos)
+		{
+			skipped++; /* overwritten while the writer was running */
+			continue;
+		}
+		if (!printed++)
+			tic0 = tic1 = rec->tic;
+		if ((dev < CAPTURE_DEVICES) && header->devices[dev][0])
+			snprintf(name, sizeof(name), "%.*s", CAPTURE_NAME_SIZE, header->devices[dev]);
+		else
+			snprintf(name, sizeof(name), "dev%u", dev);
+		printf("%12.6f %+10.3f ms  %-4s %c ",
+			(double)(rec->tic - tic0) / header->tics_per_sec, (double)(rec->tic - tic1) * 1e3 / header->tics_per_sec,
+			name, rec->dir & CAPTURE_OUT ? '<' : '>');
+		for (i = 0; i < midi_len(&event); i++)
+			printf(" %02x", midi_byte(&event, i));
+		puts(midi_flags(&event) & MIDI_EVENT_SYSEX ? " (sysex)" : "");
+		tic1 = rec->tic;
+	}
+	if (skipped)
+		printf("%u records skipped.\n", skipped);
+
+	munmap(base, st.st_size);
+	close(fd);
+	return EXIT_SUCCESS;
+
+exit1:
+	munmap(base, st.st_size);
+exit0:
+	close(fd);
+	return EXIT_FAILURE;
+}
@@ -1,4 +1,18 @@
 #include "api.h"
+#include "capture.h"
+#include "gesture.h"
+#include "map.h"
+#include "metrics.h"
+#include "midi.h"
+#include "model.h"
+#include "queue.h"
+#include "rcu.h"
+#include "remote.h"
+#include "rtpmidi.h"
+#include "scheduler.h"
+#include "stats.h"
+#include "trace.h"
+#include "transport.h"
 
 #ifdef API_WIN
 #	include <mmsystem.h>
@@ -12,34 +26,77 @@
 #	include <signal.h>
 #	include <stddef.h>
 #	include <unistd.h>
+#	include <sys/epoll.h>
+#	include <sys/signalfd.h>
+#	include <sys/timerfd.h>
+#	include <sys/eventfd.h>
+#	include <sys/inotify.h>
+#	include <sys/mman.h>
+#	include <poll.h>
 #endif
 
+#include <limits.h>
+
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
-enum _fbv_btn_t {
-	FBV_BTN_A,
-	FBV_BTN_B,
-	FBV_BTN_C,
-	FBV_BTN_D,
-	FBV_BTNS
-};
+#define FBV_BTN_DEBOUNCE 10/*ms*/
+#define FBV_BTN_LONGPRESS 1000/*ms*/
+#define FBV_BTN_DOUBLETAP 300/*ms*/
+
+#define CONTROL_OUT_SIZE 8 /*events per inbound event, a selection takes one per output port*/
+#define CONTROL_TARGET 0x80 /*in the unused third byte of a selection, ored to the port it is numbered for*/
+#define CONTROL_RCU_READER 0 /*control thread or event loop*/
+
+#define RELOAD_BUF_SIZE 1024 /*inotify events*/
+
+#define REMOTE_QUEUE_SIZE 16 /*power of two, injected messages*/
+
+#define REPLAY_LIVE_DELAY 500/*ms, devices opened and probed*/
+#define REPLAY_LIVE_SETTLE (FBV_BTN_LONGPRESS + 100)/*ms, pending gestures fired*/
+
+#define HOTPLUG_DIR "/dev/snd"
+#define HOTPLUG_EVENTS (IN_CREATE | IN_MOVED_TO | IN_ATTRIB)
+#define HOTPLUG_RETRY 100/*ms, device node present but not usable yet*/
+#define HOTPLUG_POLL 1000/*ms, without inotify*/
+#define HOTPLUG_BUF_SIZE 1024 /*inotify events*/
+
+#define INP_BUF_SIZE 256 /*bytes per read*/
 
-#define FBV_BTN_LONGPRESS 1000000LL/*us*/
-#define FBV_PEDAL_THRESH 2
+#define PORTS MAP_DEVICES
+#define PORT_QUEUE_SIZE 256 /*power of two*/
+#define PORT_BATCH 16 /*events per write*/
 
-#define FBV_INP_BUF_SIZE 4
-#define FBV_OUT_BUF_SIZE FBV_INP_BUF_SIZE
-#define FBV_BUF_SIZE (FBV_INP_BUF_SIZE < FBV_OUT_BUF_SIZE ? FBV_OUT_BUF_SIZE : FBV_INP_BUF_SIZE)
+#define OUTPUT_DEADLINE 250/*ms after scheduling, a message not written by then is dropped*/
+#define WATCHDOG_STALL 1000/*ms a stage may hold work without progress*/
+#define WATCHDOG_CHECKS 4 /*per stall time*/
 
-#define POD_INP_BUF_SIZE 4
-#define POD_OUT_BUF_SIZE POD_INP_BUF_SIZE
-#define POD_BUF_SIZE (POD_INP_BUF_SIZE < POD_OUT_BUF_SIZE ? POD_OUT_BUF_SIZE : POD_INP_BUF_SIZE)
+#if PORTS > MIDI_EVENT_SRCS
+#	error "events cannot carry the source of that many ports"
+#endif
+#if PORTS > CONTROL_OUT_SIZE
+#	error "a selection does not fit the control output"
+#endif
+
+/* Arrays of queues and schedulers are initialized in place, one element per port. */
+#if PORTS != 8
+#	error "port_array_initializer() expects 8 ports"
+#endif
+#define port_array_initializer(_init) { \
+	_init(0), _init(1), _init(2), _init(3), _init(4), _init(5), _init(6), _init(7) }
+
+#define EVENT_LOOP_EVENTS 4
+#define EVENT_LOOP_BUF_SIZE 256
+
+#define RT_STACK_SIZE (256 * 1024)/*bytes per thread with --mlock*/
+#define RT_STACK_PREFAULT (64 * 1024)/*bytes of the main stack touched after mlockall()*/
 
 static unsigned
 #ifndef API_WIN
 	_daemon = 0,
+	evloop = 0,
+	identify = 0, /* identity request to each device opened */
 #endif
 	loop = 0,
 	ctl_running = 0;
@@ -47,6 +104,11 @@ static unsigned
 mutex_t mutex;
 cond_t cond_ctl;
 
+#ifndef API_WIN
+/* wakes the main thread from a hotplug wait, written by the signal handler and ending threads */
+static int main_wake = -1;
+#endif
+
 #ifdef API_WIN
 
 #	define error(_fmt, ...) do { \
@@ -70,8 +132,8 @@ cond_t cond_ctl;
 			unsigned i; \
 			if (_str) \
 				debug("%s:", _str); \
-			for (i = 0; i < *(_msg)->len; i++) \
-				printf(" 0x%02x", (_msg)->buf[i]); \
+			for (i = 0; i < midi_len(_msg); i++) \
+				printf(" 0x%02x", midi_byte(_msg, i)); \
 			puts(""); \
 		} while (0)
 #	else
@@ -109,8 +171,8 @@ cond_t cond_ctl;
 				unsigned i; \
 				if (_str) \
 					debug("%s:", _str); \
-				for (i = 0; i < *(_msg)->len; i++) \
-					printf(" 0x%02x", (_msg)->buf[i]); \
+				for (i = 0; i < midi_len(_msg); i++) \
+					printf(" 0x%02x", midi_byte(_msg, i)); \
 				puts(""); \
 			} \
 		} while (0)
@@ -133,20 +195,6 @@ cond_t cond_ctl;
 #define thread_context_initializer(_running, _mutex, _cond_rst, _cond_ctl, ...) { \
 	.running = _running, .mutex = _mutex, .cond_rst = _cond_rst, .cond_ctl = _cond_ctl, __VA_ARGS__ }
 
-typedef struct _midi_message_t {
-	tic_t *tic;
-	unsigned char *buf;
-	size_t *len;
-	tic_t *const _tic;
-	unsigned char *const _buf;
-	const size_t _size;
-	size_t *const _len;
-} midi_message_t;
-
-#define midi_message_initializer(__tic, __buf, __size, __len) { \
-	.tic = __tic, .buf = __buf, .len = __len, \
-	._tic = __tic, ._buf = __buf, ._size = __size, ._len = __len }
-
 #ifdef API_WIN
 typedef struct _fid_t {
 	HMIDIIN inp;
@@ -155,102 +203,332 @@ typedef struct _fid_t {
 #	define fid_initializer() { \
 		.inp = INVALID_HANDLE_VALUE, .out = INVALID_HANDLE_VALUE }
 #else
-typedef int fid_t;
-#	define fid_initializer() -1
+typedef transport_t fid_t;
+#	define fid_initializer() transport_initializer(&TRANSPORT_RAW)
 #endif
 
 typedef thread_context_define(message_t,
+	unsigned port;
 	cond_t *cond_dev;
-	midi_message_t *msg;
-	fid_t *fid) thread_context_message_t;
-
-#define thread_context_message_initializer(_running, _mutex, _cond_rst, _cond_ctl, _cond_dev, _msg, _fid) \
+	queue_t *queue;
+	sched_t *sched;
+	stats_path_t *stats; /* indexed by source port */
+	fid_t *fid;
+	const int *stop;
+	tic_t *work) thread_context_message_t;
+
+#define thread_context_message_initializer(_running, _mutex, _cond_rst, _cond_ctl, _port, _cond_dev, _queue, _sched, _stats, _fid, _stop) \
 	thread_context_initializer(_running, _mutex, _cond_rst, _cond_ctl, \
-		.cond_dev = _cond_dev, .msg = _msg, .fid = _fid)
-
-enum _ctl_tic_t {
-	TIC_BTN_A,
-	TIC_BTN_B,
-	TIC_BTN_C,
-	TIC_BTN_D,
-	TICS
-};
+		.port = _port, .cond_dev = _cond_dev, .queue = _queue, .sched = _sched, .stats = _stats, .fid = _fid, .stop = _stop, .work = 0)
+
+/* One device session, reopened on its own when it fails. */
+typedef struct _device_t {
+	unsigned dev;
+	const char *id, *path; /* by-id name and device node */
+	unsigned resolve; /* path is looked up from id */
+	char buf[128];
+	fid_t *fid;
+	int stop; /* eventfd, ends the input and output threads */
+	tic_t opened, retry, lost; /* retry GESTURE_NEVER: on hotplug only */
+	unsigned reconnects;
+	tic_t reconnect_last, reconnect_max;
+	tic_t inp_work, out_work; /* since when input or output holds work without progress, 0 if not */
+	tic_t stalled; /* work time of a stall found by the watchdog, the main thread resets the device */
+	unsigned stalls;
+} device_t;
+
+#define device_initializer(_dev, _id, _path, _fid) { \
+	.dev = _dev, .id = _id, .path = _path, .resolve = !(_path), .fid = _fid, .stop = -1, \
+	.opened = 0, .retry = 0, .lost = 0, .reconnects = 0, .reconnect_last = 0, .reconnect_max = 0, \
+	.inp_work = 0, .out_work = 0, .stalled = 0, .stalls = 0 }
 
 typedef struct _controller_state_t {
-	unsigned char bank, btn;
-	unsigned char vol, expr;
-	tic_t tic[TICS];
+	unsigned char bank[PORTS], btn; /* banks in the numbering of each port, btn MODEL_CHANNELS: none selected */
+	const model_t *pod; /* model of the first POD, numbers the programs of the control socket */
+	map_slot_t slot[PORTS][MAP_SLOTS]; /* last values of mappings with thresholds or curves, by source port */
+	unsigned slot_serial; /* of the mapping the slots belong to */
+	gesture_t gesture;
+	unsigned gesture_port; /* port of the last button, timer output is routed from it */
+	map_t *map; /* published by the reload thread, read under rcu */
+	rcu_t *rcu;
+	capture_t *capture;
+	const tic_t *clock; /* virtual clock of the replay, 0 for tic_get() */
+	unsigned long long wakeups; /* of the control thread or event loop */
+	tic_t work; /* since when the control thread or event loop is at work, 0 while waiting */
+	unsigned stalls; /* of the control stage, found by the watchdog */
+	unsigned published; /* bank << 8 | btn, read by the control socket */
+	int notify; /* eventfd signalled on state changes, -1 without control socket */
+	model_ident_t ident[PORTS]; /* identity replies in progress */
 } controller_state_t;
 
-#define controller_state_initializer() { \
-	.bank = 0, .btn = FBV_BTNS, \
-	.tic = { \
-			[TIC_BTN_A] = 0LL, \
-			[TIC_BTN_B] = 0LL, \
-			[TIC_BTN_C] = 0LL, \
-			[TIC_BTN_D] = 0LL, \
-		}, \
-	}
+#define ms2tic(_ms) ((tic_t)(_ms) * TICS_PER_SEC / 1000LL)
+
+#define controller_state_initializer(_map, _rcu, _capture) { \
+	.bank = { 0 }, .btn = MODEL_CHANNELS, .pod = &MODEL_TABLE[MODEL_POCKET_POD], .slot = { { { 0 } } }, .slot_serial = 0, \
+	.gesture = gesture_initializer(ms2tic(FBV_BTN_DEBOUNCE), ms2tic(FBV_BTN_LONGPRESS), ms2tic(FBV_BTN_DOUBLETAP)), .gesture_port = DEV_FBV, \
+	.map = _map, .rcu = _rcu, .capture = _capture, .clock = 0, .wakeups = 0, .work = 0, .stalls = 0, \
+	.published = MODEL_CHANNELS, .notify = -1, \
+	.ident = { [0 ... PORTS - 1] = model_ident_initializer() } }
+
+/* Arrays indexed by port. */
 typedef thread_context_define(control_t,
-	cond_t *cond_fbv_inp, *cond_fbv_out, *cond_pod_inp, *cond_pod_out;
-	midi_message_t *msg_fbv2ctl, *msg_ctl2fbv, *msg_pod2ctl, *msg_ctl2pod;
+	cond_t *cond_out;
+	queue_t *queues;
+	queue_t *inject; /* of the control socket, 0 without */
+	sched_t *scheds;
+	sched_pool_t *pool;
+	stats_path_t *stats;
 	controller_state_t *state) thread_context_control_t;
 
-#define thread_context_control_initializer(_running, _mutex, _cond_rst, _cond_ctl, _cond_fbv_inp, _cond_fbv_out, _cond_pod_inp, _cond_pod_out, _fbv2ctl, _ctl2fbv, _pod2ctl, _ctl2pod, _state) \
+#define thread_context_control_initializer(_running, _mutex, _cond_rst, _cond_ctl, _cond_out, _queues, _scheds, _pool, _stats, _state) \
 	thread_context_initializer(_running, _mutex, _cond_rst, _cond_ctl, \
-		.cond_fbv_inp = _cond_fbv_inp, .cond_fbv_out = _cond_fbv_out, .cond_pod_inp = _cond_pod_inp, .cond_pod_out = _cond_pod_out, \
-		.msg_fbv2ctl = _fbv2ctl, .msg_ctl2fbv = _ctl2fbv, .msg_pod2ctl = _pod2ctl, .msg_ctl2pod = _ctl2pod, \
-		.state = _state)
-
-#define swap_var(_i1, _i2) do { \
-	(_i1) = (_i1) ^ (_i2); \
-	(_i2) = (_i1) ^ (_i2); \
-	(_i1) = (_i1) ^ (_i2); \
-} while (0)
-
-#define swap_ptr(_p1, _p2) do { \
-	(_p1) = (typeof(_p1))((intptr_t)(_p1) ^ (intptr_t)(_p2)); \
-	(_p2) = (typeof(_p2))((intptr_t)(_p1) ^ (intptr_t)(_p2)); \
-	(_p1) = (typeof(_p1))((intptr_t)(_p1) ^ (intptr_t)(_p2)); \
-} while (0)
+		.cond_out = _cond_out, .queues = _queues, .inject = 0, .scheds = _scheds, .pool = _pool, .stats = _stats, .state = _state)
+
+/* Wakeup error of a periodic sleep, the scheduling latency the I/O threads see. */
+typedef struct _jitter_context_t {
+	unsigned running;
+	tic_t period; /* 0: disabled */
+	histogram_t hist;
+} jitter_context_t;
+
+#define jitter_context_initializer() { \
+	.running = 1, .period = 0, .hist = { .count = 0 } }
+
+typedef struct _report_context_t {
+	unsigned running;
+	const queue_t *queues;
+	const sched_t *scheds;
+	const stats_path_t *stats;
+	const device_t *devices;
+	const jitter_context_t *jitter;
+} report_context_t;
+
+#define report_context_initializer(_queues, _scheds, _stats, _devices, _jitter) { \
+	.running = 1, .queues = _queues, .scheds = _scheds, .stats = _stats, .devices = _devices, .jitter = _jitter }
+
+typedef struct _reload_context_t {
+	const char *path; /* 0 for the built-in mapping */
+	map_t **map;
+	rcu_t *rcu;
+	unsigned stop; /* also takes SIGINT and SIGTERM, the event loop has its own */
+	int wake;
+} reload_context_t;
+
+#define reload_context_initializer(_path, _map, _rcu) { \
+	.path = _path, .map = _map, .rcu = _rcu, .stop = 0, .wake = -1 }
+
+typedef struct _metrics_context_t {
+	const char *addr;
+	int fd, wake;
+	const queue_t *queues; /* 0 in the event loop */
+	const sched_t *scheds;
+	const stats_path_t *stats;
+	const device_t *devices;
+	const controller_state_t *state;
+} metrics_context_t;
+
+#define metrics_context_initializer(_queues, _scheds, _stats, _devices, _state) { \
+	.addr = 0, .fd = -1, .wake = -1, .queues = _queues, .scheds = _scheds, .stats = _stats, .devices = _devices, .state = _state }
+
+/*
+ * The control socket thread is the single producer of the inject queue. The
+ * control thread is woken through mutex and cond, the event loop through the
+ * inject eventfd.
+ */
+typedef struct _remote_context_t {
+	const char *path;
+	remote_t remote;
+	int wake; /* ends the thread */
+	int notify; /* state changes, see control_publish() */
+	int inject_wake; /* -1 unless in the event loop */
+	queue_t inject;
+	mutex_t *mutex;
+	cond_t *cond;
+	const controller_state_t *state;
+	unsigned shown; /* state last sent to subscribers */
+} remote_context_t;
+
+#define remote_context_initializer(_buf, _mutex, _cond, _state) { \
+	.path = 0, .remote = remote_initializer(), .wake = -1, .notify = -1, .inject_wake = -1, \
+	.inject = queue_initializer(_buf, REMOTE_QUEUE_SIZE), .mutex = _mutex, .cond = _cond, .state = _state, .shown = MODEL_CHANNELS }
+
+/*
+ * Checks the work times of the stages a few times per stall time. A device
+ * thread stuck for longer is reset with its device by the main thread, a
+ * stuck control stage is reported only. Without devices (event loop) only
+ * the control stage is watched, the loop resets stalled devices itself.
+ */
+typedef struct _watchdog_context_t {
+	int wake;
+	device_t *devices;
+	controller_state_t *state;
+} watchdog_context_t;
+
+#define watchdog_context_initializer(_devices, _state) { \
+	.wake = -1, .devices = _devices, .state = _state }
+
+#define stats_path_initializer() { \
+	.hist = { [STATS_QUEUE] = { .count = 0 } } }
+
+/* Wakes the consumer on the empty to non-empty transition reported by a push. */
+static inline int notify(const int result, mutex_t *const mutex, cond_t *const cond)
+{
+	if (result > 0)
+	{
+		mutex_lock(mutex);
+		cond_signal(cond);
+		mutex_unlock(mutex);
+	}
+	return result;
+}
 
 enum _podfbv_threads_t
 {
 	THREAD_CONTROL,
 #ifndef API_WIN
-	THREAD_FBV_INP,
+	THREAD_INP,
 #endif
-	THREAD_FBV_OUT,
+	THREAD_OUT,
+	THREAD_KINDS
+};
+
+/* The control thread, then the device threads of each port. */
+#define THREADS (1 + (THREAD_KINDS - 1) * PORTS)
+#define thread_index(_kind, _port) (1 + (_port) * (THREAD_KINDS - 1) + (_kind) - 1)
+#define thread_kind(_i) ((_i) ? ((_i) - 1) % (THREAD_KINDS - 1) + 1 : THREAD_CONTROL)
+#define thread_port(_i) ((_i) ? ((_i) - 1) / (THREAD_KINDS - 1) : PORTS)
+#define thread_used(_i) ((thread_port(_i) == PORTS) || (thread_port(_i) < port_count))
+
+/* Device kinds, the first ports are one of each kind. */
+enum _podfbv_devices_t
+{
+	DEV_FBV = MODEL_KIND_FBV,
+	DEV_POD = MODEL_KIND_POD,
+	DEVS = MODEL_KINDS
+};
+
+enum _podfbv_port_dirs_t
+{
+	PORT_INP = 1,
+	PORT_OUT = 2
+};
+
+/* Far end of the loopback devices during a replay through the daemon. */
+typedef struct _replay_peer_t {
+	trace_t *trace;
+	const char *names[PORTS];
+	unsigned quiet;
+	unsigned running;
+} replay_peer_t;
+
+#define replay_peer_initializer() { \
+	.trace = 0, .names = { 0 }, .quiet = 0, .running = 1 }
+
+static const char *const DEV_NAMES[DEVS] =
+{
+	[DEV_FBV] = "fbv",
+	[DEV_POD] = "pod",
+};
+
+/* Model of a port given by kind. */
+static const unsigned DEV_MODELS[DEVS] =
+{
+	[DEV_FBV] = MODEL_FBV_EXPRESS,
+	[DEV_POD] = MODEL_POCKET_POD,
+};
+
+/* Default route of each kind, to every output port of the other one. */
+static const unsigned DEV_ROUTES[DEVS] =
+{
+	[DEV_FBV] = DEV_POD,
+	[DEV_POD] = DEV_FBV,
+};
+
+/* Ports, set up by main() before any thread starts. Names as used in mappings and traces. */
+static const char *port_names[PORTS] =
+{
+	[DEV_FBV] = "FBV",
+	[DEV_POD] = "POD",
+};
+static unsigned
+	port_kinds[PORTS] = {
+		[DEV_FBV] = DEV_FBV,
+		[DEV_POD] = DEV_POD,
+	},
+	port_dirs[PORTS] = {
+		[DEV_FBV] = PORT_INP | PORT_OUT,
+		[DEV_POD] = PORT_INP | PORT_OUT,
+	},
+	port_models[PORTS] = {
+		[DEV_FBV] = MODEL_FBV_EXPRESS,
+		[DEV_POD] = MODEL_POCKET_POD,
+	},
+	port_routes[PORTS], /* default destinations without route rules */
+	port_outputs = 0, /* mask of ports that take output */
+	port_running = 0, /* mask of ports written with running status */
+	port_count = DEVS;
 #ifndef API_WIN
-	THREAD_POD_INP,
+static const transport_ops_t *port_transports[PORTS]; /* 0 for the one of "--transport" */
+/* 0 disables either */
+static tic_t
+	output_deadline = ms2tic(OUTPUT_DEADLINE),
+	watchdog_stall = ms2tic(WATCHDOG_STALL);
 #endif
-	THREAD_POD_OUT,
-	THREADS
+
+static const char *const STATS_NAMES[STATS_STAGES] =
+{
+	[STATS_QUEUE] = "queue",
+	[STATS_MAP] = "map",
+	[STATS_OUTPUT] = "output",
+	[STATS_TOTAL] = "total",
 };
 
+#define tic2us(_tic) ((double)(_tic) * 1e6 / (double)TICS_PER_SEC)
+
+/* Built-in mapping of the port models, set up by main(). Device names as in port_names. */
+static char *map_default = 0;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 static void *control(void *const);
 #ifdef API_WIN
-static void CALLBACK fbvinp(HMIDIIN, UINT, DWORD_PTR, DWORD_PTR, DWORD_PTR);
-#else
-static void *fbvinp(void *const);
-#endif
-static void *fbvout(void *const);
-#ifdef API_WIN
-static void CALLBACK podinp(HMIDIIN, UINT, DWORD_PTR, DWORD_PTR, DWORD_PTR);
+static void CALLBACK portinp(HMIDIIN, UINT, DWORD_PTR, DWORD_PTR, DWORD_PTR);
 #else
-static void *podinp(void *const);
+static void *portinp(void *const);
 #endif
-static void *podout(void *const);
+static void *portout(void *const);
+static int parse_port(char *const str, const char **const id);
 
+static void report(const queue_t *const queues, const sched_t *const scheds, const stats_path_t *const stats, const device_t *const devices, const jitter_context_t *const jitter);
+#ifdef LOCK_PROFILE
+static void report_line(void *const context, const char *const line);
+#endif
+static int replay(const char *const path, const unsigned loops, const unsigned quiet, controller_state_t *const state);
 #ifdef API_WIN
 static int get_inp_num(const char *const name);
 static int get_out_num(const char *const name);
 #else
 static const char *id2dev(const char *const id, char *const buf, const size_t size);
+static int hotplug_watch(const char *const *const paths, const unsigned count);
+static unsigned hotplug_wait(const int ifd, const int timeout);
+static int device_open(device_t *const dev, const int hotplug);
+static void device_close(device_t *const dev);
+static tic_t device_deadline(const device_t *const devices);
+static int event_loop(device_t *const devices, sched_t *const scheds, sched_pool_t *const pool, stats_path_t *const stats, controller_state_t *const state, const int hotplug, const jitter_context_t *const jitter, remote_context_t *const remote);
+static void *reporter(void *const context);
+static void *reloader(void *const context);
+static void reload(reload_context_t *const ctx);
+static void *metrics_server(void *const context);
+static void metrics_write(void *const context, FILE *const file);
+static void *remote_server(void *const context);
+static void remote_command(void *const context, remote_client_t *const client, char *const line);
+static void *replay_live(void *const context);
+static void *jitter_probe(void *const context);
+static void *watchdog(void *const context);
+static int rt_thread_create(thread_t *const thread, void *(*const thread_function)(void *const), void *const context, thread_attr_t *const attr);
+static int parse_cpus(const char *const str, unsigned long long *const cpus);
 static void register_signals();
 static void daemonize();
 #endif
@@ -259,113 +537,145 @@ static void daemonize();
 }
 #endif
 
-static void *(*const THREAD_FUNCTIONS[THREADS])(void *const) =
+static void *(*const THREAD_FUNCTIONS[THREAD_KINDS])(void *const) =
 {
 	[THREAD_CONTROL] = &control,
 #ifndef API_WIN
-	[THREAD_FBV_INP] = &fbvinp,
-#endif
-	[THREAD_FBV_OUT] = &fbvout,
-#ifndef API_WIN
-	[THREAD_POD_INP] = &podinp,
+	[THREAD_INP] = &portinp,
 #endif
-	[THREAD_POD_OUT] = &podout,
+	[THREAD_OUT] = &portout,
 };
 
 int main(int argc, char **argv)
 {
-#ifdef API_WIN
+	/* 0: the default of the model */
 	const char
-		*fbv_id = "FBV Express Mk II",
-		*pod_id = "Line 6 Pocket POD";
-#else
-	char
-		fbv_str[128], pod_str[128];
+		*fbv_id = 0,
+		*pod_id = 0;
+#ifndef API_WIN
 	const char
-		*fbv_id = "usb-Line_6_FBV_Express_Mk_II-00",
-		*pod_id = "usb-Line_6_Line_6_Pocket_POD-00",
 		*fbv_dev = 0,
 		*pod_dev = 0;
 #endif
-	fid_t
-		fid_fbv = fid_initializer(),
-		fid_pod = fid_initializer();
-	tic_t tic = 0;
+	const char
+		*map_path = 0,
+		*replay_path = 0;
+	unsigned
+		replay_loops = 1,
+		quiet = 0;
+#ifndef API_WIN
+	char map_real[PATH_MAX];
+	const char *capture_path = 0;
+	char *running_status = 0;
+	unsigned capture_records = CAPTURE_RECORDS;
+	const transport_ops_t *transport = &TRANSPORT_NONBLOCK;
+	replay_peer_t replay_peer = replay_peer_initializer();
+	thread_t thread_replay;
+	unsigned replay_running = 0;
+	thread_attr_t
+		rt = thread_attr_initializer(), /* control and I/O threads, event loop, jitter probe */
+		helper = thread_attr_initializer();
+	unsigned locked = 0;
+	jitter_context_t ctx_jitter = jitter_context_initializer();
+	thread_t thread_jitter;
+	unsigned jitter_running = 0;
+#endif
+	const char *ids[PORTS] = { 0 };
+#ifndef API_WIN
+	const char *paths[PORTS] = { 0 };
+#endif
+	fid_t fids[PORTS];
+#ifdef API_WIN
 	unsigned retry = 0;
-	unsigned i;
+#else
+	device_t devices[PORTS];
+	unsigned reset, pending, hotplugged = 0;
+	int hotplug = -1;
+	tic_t tic;
+#endif
+	unsigned alive = 0;
+	unsigned i, j;
 
 	unsigned
-		fbv2ctl_running = 0, ctl2fbv_running = 0,
-		pod2ctl_running = 0, ctl2pod_running = 0;
+		inp_running[PORTS] = { 0 },
+		out_running[PORTS] = { 0 };
 	cond_t
 		cond_rst,
-		cond_fbv_inp,
-		cond_fbv_out,
-		cond_pod_inp,
-		cond_pod_out;
+		cond_out[PORTS];
 
+	rcu_t rcu = rcu_initializer();
+	capture_t capture = capture_initializer();
 	controller_state_t
-		state = controller_state_initializer();
-	tic_t
-		tic_fbv2ctl[2] = { 0, 0 },
-		tic_ctl2fbv[2] = { 0, 0 },
-		tic_pod2ctl[2] = { 0, 0 },
-		tic_ctl2pod[2] = { 0, 0 };
-	unsigned char
-		buf_fbv2ctl[2 * FBV_OUT_BUF_SIZE],
-		buf_ctl2fbv[2 * FBV_INP_BUF_SIZE],
-		buf_pod2ctl[2 * POD_OUT_BUF_SIZE],
-		buf_ctl2pod[2 * POD_INP_BUF_SIZE];
-	size_t
-		len_fbv2ctl[2] = { 0, 0 },
-		len_ctl2fbv[2] = { 0, 0 },
-		len_pod2ctl[2] = { 0, 0 },
-		len_ctl2pod[2] = { 0, 0 };
-	midi_message_t
-		msg_fbv2ctl = midi_message_initializer(tic_fbv2ctl, buf_fbv2ctl, FBV_OUT_BUF_SIZE, len_fbv2ctl),
-		msg_ctl2fbv = midi_message_initializer(tic_ctl2fbv, buf_ctl2fbv, FBV_INP_BUF_SIZE, len_ctl2fbv),
-		msg_pod2ctl = midi_message_initializer(tic_pod2ctl, buf_pod2ctl, POD_OUT_BUF_SIZE, len_pod2ctl),
-		msg_ctl2pod = midi_message_initializer(tic_ctl2pod, buf_ctl2pod, POD_INP_BUF_SIZE, len_ctl2pod);
+		state = controller_state_initializer(0/*map*/, &rcu, &capture);
+	midi_event_t evt_inp[PORTS][PORT_QUEUE_SIZE];
+#define port_queue_initializer(_port) queue_initializer(evt_inp[_port], PORT_QUEUE_SIZE)
+	queue_t queues[PORTS] = port_array_initializer(port_queue_initializer);
+#undef port_queue_initializer
+	/* events routed to several ports are stored once */
+	static sched_pool_t pool = sched_pool_initializer();
+#define port_sched_initializer(_port) sched_initializer(scheds[_port], 0/*prio_cc*/, &pool)
+	sched_t scheds[PORTS] = port_array_initializer(port_sched_initializer);
+#undef port_sched_initializer
+	stats_path_t stats[PORTS]; /* indexed by source port */
 
 	thread_context_control_t
-		ctx_control = thread_context_control_initializer(&ctl_running, &mutex, &cond_rst, &cond_ctl, &cond_fbv_inp, &cond_fbv_out, &cond_pod_inp, &cond_pod_out, &msg_fbv2ctl, &msg_ctl2fbv, &msg_pod2ctl, &msg_ctl2pod, &state);
+		ctx_control = thread_context_control_initializer(&ctl_running, &mutex, &cond_rst, &cond_ctl, cond_out, queues, scheds, &pool, stats, &state);
 	thread_context_message_t
-		ctx_fbv2ctl = thread_context_message_initializer(&fbv2ctl_running, &mutex, &cond_rst, &cond_ctl, &cond_fbv_inp, &msg_fbv2ctl, &fid_fbv),
-		ctx_ctl2fbv = thread_context_message_initializer(&ctl2fbv_running, &mutex, &cond_rst, &cond_ctl, &cond_fbv_out, &msg_ctl2fbv, &fid_fbv),
-		ctx_pod2ctl = thread_context_message_initializer(&pod2ctl_running, &mutex, &cond_rst, &cond_ctl, &cond_pod_inp, &msg_pod2ctl, &fid_pod),
-		ctx_ctl2pod = thread_context_message_initializer(&ctl2pod_running, &mutex, &cond_rst, &cond_ctl, &cond_pod_out, &msg_ctl2pod, &fid_pod);
-	void *const context[THREADS] = {
-		[THREAD_CONTROL] = (void *)&ctx_control,
-#ifndef API_WIN
-		[THREAD_FBV_INP] = (void *)&ctx_fbv2ctl,
-#endif
-		[THREAD_FBV_OUT] = (void *)&ctx_ctl2fbv,
-#ifndef API_WIN
-		[THREAD_POD_INP] = (void *)&ctx_pod2ctl,
-#endif
-		[THREAD_POD_OUT] = (void *)&ctx_ctl2pod,
-	};
-	unsigned *const running[THREADS] = {
-		[THREAD_CONTROL] = (void *)&ctl_running,
-#ifndef API_WIN
-		[THREAD_FBV_INP] = (void *)&fbv2ctl_running,
-#endif
-		[THREAD_FBV_OUT] = (void *)&ctl2fbv_running,
+		ctx_inp[PORTS],
+		ctx_out[PORTS];
 #ifndef API_WIN
-		[THREAD_POD_INP] = (void *)&pod2ctl_running,
+	report_context_t
+		ctx_report = report_context_initializer(queues, scheds, stats, devices, &ctx_jitter);
+	thread_t thread_report;
+	reload_context_t
+		ctx_reload = reload_context_initializer(0/*path*/, &state.map, &rcu);
+	thread_t thread_reload;
+	unsigned reload_running = 0;
+	metrics_context_t
+		ctx_metrics = metrics_context_initializer(queues, scheds, stats, devices, &state);
+	thread_t thread_metrics;
+	unsigned metrics_running = 0;
+	midi_event_t evt_inject[REMOTE_QUEUE_SIZE];
+	remote_context_t
+		ctx_remote = remote_context_initializer(evt_inject, &mutex, &cond_ctl, &state);
+	thread_t thread_remote;
+	unsigned remote_running = 0;
+	watchdog_context_t
+		ctx_watchdog = watchdog_context_initializer(devices, &state);
+	thread_t thread_watchdog;
+	unsigned watchdog_running = 0;
+	sigset_t mask, mask_old;
 #endif
-		[THREAD_POD_OUT] = (void *)&ctl2pod_running,
-	};
+	void *context[THREADS];
+	unsigned *running[THREADS];
 
 	thread_t threads[THREADS];
 
+	context[THREAD_CONTROL] = (void *)&ctx_control;
+	running[THREAD_CONTROL] = &ctl_running;
+	for (i = 0; i < PORTS; i++)
+	{
+		fids[i] = (fid_t)fid_initializer();
+		stats[i] = (stats_path_t)stats_path_initializer();
+		ctx_inp[i] = (thread_context_message_t)thread_context_message_initializer(&inp_running[i], &mutex, &cond_rst, &cond_ctl, i, 0, &queues[i], 0, stats, &fids[i], 0);
+		ctx_out[i] = (thread_context_message_t)thread_context_message_initializer(&out_running[i], &mutex, &cond_rst, &cond_ctl, i, &cond_out[i], 0, &scheds[i], stats, &fids[i], 0);
+#ifndef API_WIN
+		devices[i] = (device_t)device_initializer(i, 0/*id*/, 0/*path*/, &fids[i]);
+		ctx_inp[i].stop = ctx_out[i].stop = &devices[i].stop;
+		ctx_inp[i].work = &devices[i].inp_work;
+		ctx_out[i].work = &devices[i].out_work;
+		context[thread_index(THREAD_INP, i)] = (void *)&ctx_inp[i];
+		running[thread_index(THREAD_INP, i)] = &inp_running[i];
+#endif
+		context[thread_index(THREAD_OUT, i)] = (void *)&ctx_out[i];
+		running[thread_index(THREAD_OUT, i)] = &out_running[i];
+	}
+
 	mutex_init(&mutex);
 	cond_init(&cond_rst);
 	cond_init(&cond_ctl);
-	cond_init(&cond_fbv_inp);
-	cond_init(&cond_fbv_out);
-	cond_init(&cond_pod_inp);
-	cond_init(&cond_pod_out);
+	for (i = 0; i < PORTS; i++)
+		cond_init(&cond_out[i]);
 
 	for (i = 1; i < argc; i++)
 	{
@@ -379,15 +689,251 @@ int main(int argc, char **argv)
 		else if (!strcmp(argv[i], "--pod_dev") && (++i < argc))
 			pod_id = pod_dev = argv[i];
 #endif
+		else if ((!strcmp(argv[i], "--fbv_model") || !strcmp(argv[i], "--pod_model")) && (i + 1 < argc))
+		{
+			const unsigned kind = argv[i][2] == 'f' ? DEV_FBV : DEV_POD;
+			const int model = model_find(argv[++i]);
+			if ((model < 0) || (MODEL_TABLE[model].kind != kind))
+			{
+				error("Unknown %s model \"%s\".\n", port_names[kind], argv[i]);
+				return EXIT_FAILURE;
+			}
+			port_models[kind] = model;
+		}
+		else if (!strcmp(argv[i], "--port") && (++i < argc))
+		{
+			const char *id;
+			const int port = parse_port(argv[i], &id);
+			if (port < 0)
+			{
+				error("Invalid port, expected <name>:<fbv|pod|model>:<id>[:in|:out] with a unique name and at most %u ports.\n", PORTS);
+				return EXIT_FAILURE;
+			}
+			ids[port] = id;
+#ifndef API_WIN
+			/* a device node instead of a by-id name */
+			if (*id == '/')
+				paths[port] = id;
+#endif
+		}
+		else if (!strcmp(argv[i], "--map") && (++i < argc))
+			map_path = argv[i];
+		else if (!strcmp(argv[i], "--replay") && (++i < argc))
+			replay_path = argv[i];
+		else if (!strcmp(argv[i], "--replay_loops") && (++i < argc))
+			replay_loops = strtoul(argv[i], 0, 0);
+		else if (!strcmp(argv[i], "--quiet"))
+			quiet = 1;
 		else if (!strcmp(argv[i], "--loop"))
 			loop = 1;
 #ifndef API_WIN
 		else if (!strcmp(argv[i], "--daemon") || !strcmp(argv[i], "-d"))
 			_daemon = loop = 1;
+		else if (!strcmp(argv[i], "--event_loop"))
+			evloop = 1;
+		else if (!strcmp(argv[i], "--identify"))
+			identify = 1;
+		else if (!strcmp(argv[i], "--capture") && (++i < argc))
+			capture_path = argv[i];
+		else if (!strcmp(argv[i], "--capture_records") && (++i < argc))
+			capture_records = strtoul(argv[i], 0, 0);
+		else if (!strcmp(argv[i], "--running_status") && (++i < argc))
+			running_status = argv[i];
+		else if (!strcmp(argv[i], "--rtpmidi") && (++i < argc))
+		{
+			const char *id;
+			const int port = parse_port(argv[i], &id);
+			if (port < 0)
+			{
+				error("Invalid port, expected <name>:<fbv|pod|model>:[<host>/]<udp port>[:in|:out] with a unique name and at most %u ports.\n", PORTS);
+				return EXIT_FAILURE;
+			}
+			ids[port] = paths[port] = id;
+			port_transports[port] = &TRANSPORT_RTPMIDI;
+		}
+		else if (!strcmp(argv[i], "--rtpmidi_playout") && (++i < argc))
+			rtpmidi_playout(strtoul(argv[i], 0, 0));
+		else if (!strcmp(argv[i], "--write_deadline") && (++i < argc))
+			output_deadline = ms2tic(strtoul(argv[i], 0, 0));
+		else if (!strcmp(argv[i], "--watchdog") && (++i < argc))
+			watchdog_stall = ms2tic(strtoul(argv[i], 0, 0));
+		else if (!strcmp(argv[i], "--metrics") && (++i < argc))
+			ctx_metrics.addr = argv[i];
+		else if (!strcmp(argv[i], "--control") && (++i < argc))
+			ctx_remote.path = argv[i];
+		else if (!strcmp(argv[i], "--transport") && (++i < argc))
+		{
+			if (!(transport = transport_find(argv[i])))
+			{
+				error("Unknown transport \"%s\".\n", argv[i]);
+				return EXIT_FAILURE;
+			}
+		}
+		else if (!strcmp(argv[i], "--rt_prio") && (++i < argc))
+		{
+			rt.prio = strtol(argv[i], 0, 0);
+			if ((rt.prio < sched_get_priority_min(SCHED_FIFO)) || (rt.prio > sched_get_priority_max(SCHED_FIFO)))
+			{
+				error("Invalid SCHED_FIFO priority \"%s\".\n", argv[i]);
+				return EXIT_FAILURE;
+			}
+		}
+		else if (!strcmp(argv[i], "--cpus") && (++i < argc))
+		{
+			if (parse_cpus(argv[i], &rt.cpus))
+			{
+				error("Invalid CPU list \"%s\".\n", argv[i]);
+				return EXIT_FAILURE;
+			}
+		}
+		else if (!strcmp(argv[i], "--mlock"))
+			locked = 1;
+		else if (!strcmp(argv[i], "--jitter") && (++i < argc))
+			ctx_jitter.period = (tic_t)strtoul(argv[i], 0, 0) * TICS_PER_SEC / 1000000LL;
+#endif
+	}
+
+	ids[DEV_FBV] = fbv_id ? fbv_id : MODEL_TABLE[port_models[DEV_FBV]].id;
+	ids[DEV_POD] = pod_id ? pod_id : MODEL_TABLE[port_models[DEV_POD]].id;
+	for (i = 0; i < DEVS; i++)
+	{
+		if (!ids[i])
+		{
+			error("The %s has no device name of its own, use \"--%s_id\".\n", MODEL_TABLE[port_models[i]].title, DEV_NAMES[i]);
+			return EXIT_FAILURE;
+		}
+	}
+	state.pod = &MODEL_TABLE[port_models[DEV_POD]];
+	/* without route rules each port sends to the output ports of the other kind */
+	for (i = 0; i < port_count; i++)
+	{
+		if (port_dirs[i] & PORT_OUT)
+			port_outputs |= 1 << i;
+		for (j = 0, port_routes[i] = 0; j < port_count; j++)
+		{
+			if ((port_kinds[j] == DEV_ROUTES[port_kinds[i]]) && (port_dirs[j] & PORT_OUT))
+				port_routes[i] |= 1 << j;
+		}
+	}
+	for (i = 0; i < port_count; i++)
+		scheds[i].prio_cc = MODEL_TABLE[port_models[i]].prio_ccs;
+
+#ifndef API_WIN
+	/* ports are known by name once all of them are parsed */
+	if (running_status)
+	{
+		char *name, *save;
+		for (name = strtok_r(running_status, ",", &save); name; name = strtok_r(0, ",", &save))
+		{
+			for (j = 0; (j < port_count) && strcasecmp(name, port_names[j]); j++);
+			if (j >= port_count)
+			{
+				error("Unknown port \"%s\" for running status.\n", name);
+				return EXIT_FAILURE;
+			}
+			port_running |= 1 << j;
+		}
+	}
+#endif
+
+#ifndef API_WIN
+	paths[DEV_FBV] = fbv_dev;
+	paths[DEV_POD] = pod_dev;
+	/* the event loop never blocks in a device call */
+	if (evloop && !transport->nonblock)
+		transport = &TRANSPORT_NONBLOCK;
+	for (i = 0; i < port_count; i++)
+	{
+		fids[i].ops = port_transports[i] ? port_transports[i] : transport;
+		/* loopback names are used as they are */
+		if (!paths[i] && (transport == &TRANSPORT_LOOPBACK))
+			paths[i] = ids[i];
+		devices[i].id = ids[i];
+		devices[i].path = paths[i];
+		devices[i].resolve = !paths[i];
+	}
+#endif
+
+#ifndef API_WIN
+	/* the daemon changes to the root directory, reloads need the absolute path */
+	if (map_path && !(map_path = realpath(map_path, map_real)))
+	{
+		error("Failed to resolve mapping path (%s).\n", strerror(errno));
+		goto exit0;
+	}
+	ctx_reload.path = map_path;
+	ctx_reload.stop = !evloop;
+	if (capture_path && capture_open(&capture, capture_path, capture_records, port_names, port_count))
+	{
+		error("Failed to open capture file \"%s\" (%s).\n", capture_path, strerror(errno));
+		goto exit0;
+	}
+#endif
+	if (!map_path)
+	{
+		const int len = model_map(port_names, port_models, port_count, 0, 0);
+		if ((len < 0) || !(map_default = (char *)malloc(len + 1)))
+		{
+			error("Failed to build the default mapping.\n");
+			goto exit0;
+		}
+		model_map(port_names, port_models, port_count, map_default, len + 1);
+	}
+	{
+		const char *err;
+		unsigned line;
+		if (!(state.map = map_path ? map_load(map_path, port_names, port_count, &line, &err) : map_parse(map_default, port_names, port_count, &line, &err)))
+		{
+			error("Failed to load mapping \"%s\", line %u: %s.\n", map_path ? map_path : "default", line, err);
+			goto exit0;
+		}
+	}
+
+#ifndef API_WIN
+	/* with loopback devices the trace runs through the complete daemon */
+	if (replay_path && (transport == &TRANSPORT_LOOPBACK))
+	{
+		const char *err;
+		unsigned line;
+		if (!(replay_peer.trace = trace_load(replay_path, port_names, port_count, &line, &err)))
+		{
+			error("Failed to load trace \"%s\", line %u: %s.\n", replay_path, line, err);
+			goto exit0;
+		}
+		for (i = 0; i < port_count; i++)
+			replay_peer.names[i] = paths[i];
+		replay_peer.quiet = quiet;
+		replay_path = 0;
+		loop = 0;
+	}
 #endif
+	if (replay_path)
+	{
+		const int result = replay(replay_path, replay_loops, quiet, &state);
+		capture_close(&capture);
+		map_free(state.map);
+		free(map_default);
+		return result ? EXIT_FAILURE : EXIT_SUCCESS;
 	}
 
 #ifndef API_WIN
+	/*
+	 * SIGUSR1 dumps statistics, either via signalfd or the report thread,
+	 * SIGHUP reloads the mapping, SIGINT and SIGTERM stop, via the signalfd
+	 * of the event loop or the reload thread. All are blocked before
+	 * daemonizing, so none is lost or takes the default action.
+	 */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	if (sigprocmask(SIG_BLOCK, &mask, 0))
+	{
+		error("Failed to block signals (%s).\n", strerror(errno));
+		goto exit0;
+	}
+
 	if (_daemon)
 	{
 		daemonize();
@@ -395,121 +941,210 @@ int main(int argc, char **argv)
 	}
 	else
 		register_signals();
-#endif
 
-	for (;;)
+	/* after the fork of daemonize(), locks are not inherited */
+	if (locked)
 	{
-#ifdef API_WIN
-		if (fid_fbv.inp == INVALID_HANDLE_VALUE)
+		if (mlockall(MCL_CURRENT | MCL_FUTURE))
+			error("Failed to lock memory (%s).\n", strerror(errno));
+		else
 		{
-			int num;
-			if ((num = get_inp_num(fbv_id)) < 0)
-				goto cont0;
-			if ((midiInOpen(&fid_fbv.inp, num, (DWORD_PTR)&fbvinp, (DWORD_PTR)&ctx_fbv2ctl, CALLBACK_FUNCTION) != MMSYSERR_NOERROR))
-			{
-				debug("Failed to open FBV input \"%s\".\n", fbv_id);
-				goto cont0;
-			}
-			midiInStart(fid_fbv.inp);
-			fbv2ctl_running = 1;
+			/* locked stacks are populated in full, default sized ones would lock megabytes each */
+			volatile unsigned char prefault[RT_STACK_PREFAULT];
+			memset((unsigned char *)prefault, 0, sizeof(prefault));
+			rt.stack = helper.stack = RT_STACK_SIZE;
 		}
-		if (fid_fbv.out == INVALID_HANDLE_VALUE)
+	}
+
+	/* helper threads take no asynchronous signals, SIGINT has to reach the event loop's signalfd */
+	sigfillset(&mask);
+	sigprocmask(SIG_BLOCK, &mask, &mask_old);
+	if (ctx_jitter.period)
+	{
+		if (rt_thread_create(&thread_jitter, &jitter_probe, &ctx_jitter, &rt))
 		{
-			int num;
-			if ((num = get_out_num(fbv_id)) < 0)
-				goto cont0;
-			if ((midiOutOpen(&fid_fbv.out, num, 0, 0, CALLBACK_NULL) != MMSYSERR_NOERROR))
-			{
-				debug("Failed to open FBV output \"%s\".\n", fbv_id);
-				goto cont0;
-			}
+			sigprocmask(SIG_SETMASK, &mask_old, 0);
+			error("Failed to create jitter thread.\n");
+			goto exit0;
 		}
-		if (fid_pod.inp == INVALID_HANDLE_VALUE)
+		jitter_running = 1;
+	}
+	if (!evloop && thread_create_attr(&thread_report, &reporter, &ctx_report, &helper))
+	{
+		sigprocmask(SIG_SETMASK, &mask_old, 0);
+		error("Failed to create report thread.\n");
+		goto exit0;
+	}
+	if (((ctx_reload.wake = eventfd(0, EFD_CLOEXEC)) < 0) || thread_create_attr(&thread_reload, &reloader, &ctx_reload, &helper))
+	{
+		sigprocmask(SIG_SETMASK, &mask_old, 0);
+		error("Failed to create reload thread.\n");
+		goto exit0;
+	}
+	reload_running = 1;
+	if (ctx_metrics.addr)
+	{
+		if (evloop)
+			ctx_metrics.queues = 0;
+		if (((ctx_metrics.fd = metrics_listen(ctx_metrics.addr)) < 0) ||
+			((ctx_metrics.wake = eventfd(0, EFD_CLOEXEC)) < 0) || thread_create_attr(&thread_metrics, &metrics_server, &ctx_metrics, &helper))
 		{
-			int num;
-			if ((num = get_inp_num(pod_id)) < 0)
-				goto cont0;
-			if ((midiInOpen(&fid_pod.inp, num, (DWORD_PTR)&podinp, (DWORD_PTR)&ctx_pod2ctl, CALLBACK_FUNCTION) != MMSYSERR_NOERROR))
-			{
-				debug("Failed to open FBV input \"%s\".\n", pod_id);
-				goto cont0;
-			}
-			midiInStart(fid_pod.inp);
-			pod2ctl_running = 1;
+			sigprocmask(SIG_SETMASK, &mask_old, 0);
+			error("Failed to serve metrics on \"%s\" (%s).\n", ctx_metrics.addr, strerror(errno));
+			goto exit0;
+		}
+		metrics_running = 1;
+	}
+	if (ctx_remote.path)
+	{
+		if ((remote_listen(&ctx_remote.remote, ctx_remote.path) < 0) ||
+			((ctx_remote.wake = eventfd(0, EFD_CLOEXEC)) < 0) ||
+			((state.notify = ctx_remote.notify = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) ||
+			(evloop && ((ctx_remote.inject_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)) ||
+			thread_create_attr(&thread_remote, &remote_server, &ctx_remote, &helper))
+		{
+			sigprocmask(SIG_SETMASK, &mask_old, 0);
+			error("Failed to serve control socket \"%s\" (%s).\n", ctx_remote.path, strerror(errno));
+			goto exit0;
 		}
-		if (fid_pod.out == INVALID_HANDLE_VALUE)
+		ctx_control.inject = &ctx_remote.inject;
+		remote_running = 1;
+	}
+	if (watchdog_stall)
+	{
+		/* the event loop resets its devices itself */
+		if (evloop)
+			ctx_watchdog.devices = 0;
+		if (((ctx_watchdog.wake = eventfd(0, EFD_CLOEXEC)) < 0) || thread_create_attr(&thread_watchdog, &watchdog, &ctx_watchdog, &helper))
 		{
-			int num;
-			if ((num = get_out_num(pod_id)) < 0)
-				goto cont0;
-			if ((midiOutOpen(&fid_pod.out, num, 0, 0, CALLBACK_NULL) != MMSYSERR_NOERROR))
-			{
-				debug("Failed to open FBV output \"%s\".\n", pod_id);
-				goto cont0;
-			}
+			sigprocmask(SIG_SETMASK, &mask_old, 0);
+			error("Failed to create watchdog thread.\n");
+			goto exit0;
 		}
-#else
-		if (fid_fbv < 0)
+		watchdog_running = 1;
+	}
+	if (replay_peer.trace)
+	{
+		if (thread_create_attr(&thread_replay, &replay_live, &replay_peer, &helper))
 		{
-			if ((fbv_dev != fbv_id) && !(fbv_dev = id2dev(fbv_id, fbv_str, sizeof(fbv_str))))
-				goto cont0;
-			if ((fid_fbv = open(fbv_dev, O_RDWR)) < 0)
-			{
-				debug("Failed to open FBV \"%s\".\n", fbv_dev ? fbv_dev : "<null>");
-				goto cont0;
-			}
-			info("FBV device \"%s\" ready.\n", fbv_dev);
+			sigprocmask(SIG_SETMASK, &mask_old, 0);
+			error("Failed to create replay thread.\n");
+			goto exit0;
+		}
+		replay_running = 1;
+	}
+	sigprocmask(SIG_SETMASK, &mask_old, 0);
+
+	if ((main_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+	{
+		error("Failed to create wake descriptor (%s).\n", strerror(errno));
+		goto exit0;
+	}
+	for (i = 0; i < port_count; i++)
+	{
+		if ((devices[i].stop = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+		{
+			error("Failed to create stop descriptor (%s).\n", strerror(errno));
+			goto exit0;
 		}
-		if (fid_pod < 0)
+	}
+	if (loop && (transport != &TRANSPORT_LOOPBACK))
+	{
+		const char *watch[PORTS];
+		/* explicit device paths, the others appear below HOTPLUG_DIR; network ports have no node */
+		for (i = 0; i < port_count; i++)
+			watch[i] = port_transports[i] ? 0 : paths[i];
+		if ((hotplug = hotplug_watch(watch, port_count)) < 0)
+			error("Failed to watch device nodes (%s), polling every %u ms.\n", strerror(errno), HOTPLUG_POLL);
+	}
+#endif
+
+	for (;;)
+	{
+#ifdef API_WIN
+		for (i = 0; i < port_count; i++)
 		{
-			if ((pod_dev != pod_id) && !(pod_dev = id2dev(pod_id, pod_str, sizeof(pod_str))))
-				goto cont0;
-			if ((fid_pod = open(pod_dev, O_RDWR)) < 0)
+			fid_t *const fid = &fids[i];
+			int num;
+			if (fid->inp == INVALID_HANDLE_VALUE)
 			{
-				debug("Failed to open POD \"%s\".\n", pod_dev ? pod_dev : "<null>");
-				goto cont0;
+				if ((num = get_inp_num(ids[i])) < 0)
+					goto cont0;
+				if ((midiInOpen(&fid->inp, num, (DWORD_PTR)&portinp, (DWORD_PTR)&ctx_inp[i], CALLBACK_FUNCTION) != MMSYSERR_NOERROR))
+				{
+					debug("Failed to open %s input \"%s\".\n", port_names[i], ids[i]);
+					goto cont0;
+				}
+				midiInStart(fid->inp);
+				inp_running[i] = 1;
 			}
-			for (i = 0; i < 5; i++)
+			if (fid->out == INVALID_HANDLE_VALUE)
 			{
-				ssize_t sent;
-				char c;
-				sleep_ms(100);
-				if ((sent = write(fid_pod, &c, 0)) >= 0)
-					break;
-				close(fid_pod);
-				if ((fid_pod = open(pod_dev, O_RDWR)) < 0)
+				if ((num = get_out_num(ids[i])) < 0)
+					goto cont0;
+				if ((midiOutOpen(&fid->out, num, 0, 0, CALLBACK_NULL) != MMSYSERR_NOERROR))
 				{
-					error("Failed to open POD device \"%s\".\n", pod_dev);
-					goto exit0;
+					debug("Failed to open %s output \"%s\".\n", port_names[i], ids[i]);
+					goto cont0;
 				}
 			}
-			if (i >= 5)
-			{
-				error("Failed write initial channel to pod (%s).\n", strerror(errno));
+		}
+#else
+		/* each device is opened on its own, missing ones are waited for */
+		tic_get(&tic);
+		for (i = 0, pending = 0; i < port_count; i++)
+		{
+			if (transport_opened(devices[i].fid))
+				continue;
+			if (((tic < devices[i].retry) && !hotplugged) || device_open(&devices[i], hotplug))
+				pending |= 1 << i;
+		}
+		hotplugged = 0;
+		if (pending && !loop)
+			break;
+		if (evloop)
+		{
+			int result;
+			/* the event loop runs on the main thread */
+			if ((rt.prio || rt.cpus) && (result = thread_attr_self(&rt)))
+				error("Failed to apply real-time attributes to the event loop (%s).\n", strerror(result));
+			if (event_loop(devices, scheds, &pool, stats, &state, hotplug, &ctx_jitter, remote_running ? &ctx_remote : 0) < 0)
 				goto exit0;
-			}
-			info("POD device \"%s\" ready.\n", pod_dev);
+			break;
 		}
 #endif
 
+#ifdef API_WIN
 		retry = 0;
-		tic_get(&tic);
-		for (i = 0; i < TICS; i++)
-			state.tic[i] = tic;
+#endif
 		for (i = 0; i < THREADS; i++)
 		{
+			if (!thread_used(i))
+				continue;
+#ifndef API_WIN
+			/* threads of a device start with its session */
+			if ((thread_port(i) < PORTS) && !transport_opened(devices[thread_port(i)].fid))
+				continue;
+#endif
 			if (!*running[i])
 			{
 debug("Create %i\n", i);
-				if (thread_create(&threads[i], THREAD_FUNCTIONS[i], context[i]))
+				/* set first, a real-time thread may run before thread_create() returns */
+				*running[i] = 1;
+#ifdef API_WIN
+				if (thread_create(&threads[i], THREAD_FUNCTIONS[thread_kind(i)], context[i]))
+#else
+				if (rt_thread_create(&threads[i], THREAD_FUNCTIONS[thread_kind(i)], context[i], &rt))
+#endif
 				{
+					*running[i] = 0;
 					error("Failed to create thread(s).\n");
 					goto exit0;
 				}
-				*running[i] = 1;
 			}
 		}
 
+#ifdef API_WIN
 		mutex_lock(&mutex);
 		{
 			unsigned sleep;
@@ -521,149 +1156,423 @@ debug("Create %i\n", i);
 					goto exit0;
 				}
 				for (i = 0, sleep = 1; i < THREADS; i++)
-					sleep &= *running[i] != 0;
+					sleep &= !thread_used(i) || (*running[i] != 0);
 			} while (sleep);
 		}
-		if (!ctl_running)
-			fbv2ctl_running = ctl2fbv_running = pod2ctl_running = ctl2pod_running = 0;
-		if ((!fbv2ctl_running || !ctl2fbv_running) &&
-#ifdef API_WIN
-			(fid_fbv.inp != INVALID_HANDLE_VALUE) && (fid_fbv.out != INVALID_HANDLE_VALUE)
-#else
-			(fid_fbv >= 0)
-#endif
-			)
+		for (i = 0; i < port_count; i++)
 		{
-debug("Reset FBV\n");
-#ifdef API_WIN
-			midiOutReset(fid_fbv.out);
-			midiOutClose(fid_fbv.out);
-			midiInStop(fid_fbv.inp);
-			midiInClose(fid_fbv.inp);
-			fid_fbv.inp = INVALID_HANDLE_VALUE;
-			fid_fbv.out = INVALID_HANDLE_VALUE;
-#else
-			close(fid_fbv);
-			fid_fbv = -1;
-#endif
-			fbv2ctl_running = ctl2fbv_running = 0;
+			if (!ctl_running)
+				inp_running[i] = out_running[i] = 0;
+			if ((!inp_running[i] || !out_running[i]) &&
+				(fids[i].inp != INVALID_HANDLE_VALUE) && (fids[i].out != INVALID_HANDLE_VALUE))
+			{
+debug("Reset %s\n", port_names[i]);
+				midiOutReset(fids[i].out);
+				midiOutClose(fids[i].out);
+				midiInStop(fids[i].inp);
+				midiInClose(fids[i].inp);
+				fids[i].inp = INVALID_HANDLE_VALUE;
+				fids[i].out = INVALID_HANDLE_VALUE;
+				inp_running[i] = out_running[i] = 0;
+			}
 		}
-		if ((!pod2ctl_running || !ctl2pod_running) &&
-#ifdef API_WIN
-			(fid_pod.inp != INVALID_HANDLE_VALUE) && (fid_pod.out != INVALID_HANDLE_VALUE)
-#else
-			(fid_pod >= 0)
-#endif
-			)
+		cond_broadcast(&cond_ctl);
+		for (i = 0; i < PORTS; i++)
+			cond_broadcast(&cond_out[i]);
+		mutex_unlock(&mutex);
+
+		for (i = 0; i < THREADS; i++)
 		{
-debug("Reset POD\n");
-#ifdef API_WIN
-			midiOutReset(fid_pod.out);
-			midiOutClose(fid_pod.out);
-			midiInStop(fid_pod.inp);
-			midiInClose(fid_pod.inp);
-			fid_pod.inp = INVALID_HANDLE_VALUE;
-			fid_pod.out = INVALID_HANDLE_VALUE;
+			if (thread_used(i) && !*running[i])
+			{
+debug("Join %i\n", i);
+				thread_join(&threads[i]);
+			}
+		}
 #else
-			close(fid_pod);
-			fid_pod = -1;
-#endif
-			pod2ctl_running = ctl2pod_running = 0;
+		/* sleeps until a thread ended, a device node appeared, a retry is due or a signal arrived */
+		{
+			const tic_t deadline = device_deadline(devices);
+			int timeout = -1;
+			if (deadline != GESTURE_NEVER)
+			{
+				tic_get(&tic);
+				timeout = deadline > tic ? (deadline - tic + ms2tic(1) - 1) / ms2tic(1) : 0;
+			}
+			hotplugged = hotplug_wait(hotplug, timeout);
 		}
-		cond_broadcast(&cond_ctl);
-		cond_broadcast(&cond_fbv_inp);
-		cond_broadcast(&cond_fbv_out);
-		cond_broadcast(&cond_pod_inp);
-		cond_broadcast(&cond_pod_out);
+		mutex_lock(&mutex);
+		if (!ctl_running)
+		{
+			mutex_unlock(&mutex);
+			break;
+		}
+		/* a failed device takes down its own threads only, control and the other devices keep running */
+		for (i = 0, reset = 0; i < THREADS; i++)
+		{
+			if ((thread_port(i) < port_count) && !*running[i] && transport_opened(devices[thread_port(i)].fid))
+				reset |= 1 << thread_port(i);
+		}
+		/* a stall found by the watchdog counts as a failure unless the threads were restarted since */
+		for (i = 0; i < port_count; i++)
+		{
+			const tic_t stalled = __atomic_exchange_n(&devices[i].stalled, 0, __ATOMIC_RELAXED);
+			if (stalled && transport_opened(devices[i].fid) &&
+				((stalled == __atomic_load_n(&devices[i].inp_work, __ATOMIC_RELAXED)) || (stalled == __atomic_load_n(&devices[i].out_work, __ATOMIC_RELAXED))))
+				reset |= 1 << i;
+		}
+		for (i = 0; i < THREADS; i++)
+		{
+			if ((thread_port(i) < PORTS) && (reset & (1 << thread_port(i))))
+				*running[i] = 0;
+		}
+		for (i = 0; i < PORTS; i++)
+			cond_broadcast(&cond_out[i]);
 		mutex_unlock(&mutex);
-
+		for (i = 0; i < port_count; i++)
+		{
+			if (reset & (1 << i))
+			{
+debug("Reset %s\n", port_names[i]);
+				eventfd_write(devices[i].stop, 1);
+			}
+		}
 		for (i = 0; i < THREADS; i++)
 		{
-			if (!*running[i])
+			if ((thread_port(i) < PORTS) && (reset & (1 << thread_port(i))))
 			{
 debug("Join %i\n", i);
 				thread_join(&threads[i]);
 			}
 		}
+		for (i = 0; i < port_count; i++)
+		{
+			if (reset & (1 << i))
+			{
+				eventfd_t value;
+				eventfd_read(devices[i].stop, &value);
+				__atomic_store_n(&devices[i].inp_work, 0, __ATOMIC_RELAXED);
+				__atomic_store_n(&devices[i].out_work, 0, __ATOMIC_RELAXED);
+				/* closed once no thread uses it, loopback devices are freed on close */
+				device_close(&devices[i]);
+			}
+		}
+		if (reset && !loop)
+			break;
+#endif
 
+#ifdef API_WIN
 cont0:
 		if (!loop)
 			break;
 		sleep_ms(retry++ < 100 ? 100 : 1000);
+#endif
 	}
 
-	cond_destroy(&cond_rst);
-	cond_destroy(&cond_ctl);
-	cond_destroy(&cond_fbv_inp);
-	cond_destroy(&cond_fbv_out);
-	cond_destroy(&cond_pod_inp);
-	cond_destroy(&cond_pod_out);
-	mutex_destroy(&mutex);
+	/* threads of a device that is still up must not outlive their conditions */
+	mutex_lock(&mutex);
+	for (i = 0; i < THREADS; i++)
+	{
+		alive |= *running[i] << i;
+		*running[i] = 0;
+	}
+	cond_broadcast(&cond_ctl);
+	for (i = 0; i < PORTS; i++)
+		cond_broadcast(&cond_out[i]);
+	mutex_unlock(&mutex);
+#ifndef API_WIN
+	for (i = 0; i < port_count; i++)
+		eventfd_write(devices[i].stop, 1);
+#endif
+	for (i = 0; i < THREADS; i++)
+	{
+		if (alive & (1 << i))
+			thread_join(&threads[i]);
+	}
+#ifndef API_WIN
+	/* a signal during shutdown still takes the mutex in request_stop() */
+	eventfd_write(ctx_reload.wake, 1);
+	thread_join(&thread_reload);
+	close(ctx_reload.wake);
+#endif
 
-#ifdef API_WIN
-	if (fid_fbv.out != INVALID_HANDLE_VALUE)
+#ifndef API_WIN
+	if (!evloop)
+	{
+		__atomic_store_n(&ctx_report.running, 0, __ATOMIC_RELAXED);
+		kill(getpid(), SIGUSR1);
+		thread_join(&thread_report);
+	}
+	if (metrics_running)
 	{
-		midiOutReset(fid_fbv.out);
-		midiOutClose(fid_fbv.out);
+		eventfd_write(ctx_metrics.wake, 1);
+		thread_join(&thread_metrics);
 	}
-	if (fid_fbv.inp != INVALID_HANDLE_VALUE)
+	if (ctx_metrics.wake >= 0)
+		close(ctx_metrics.wake);
+	metrics_close(ctx_metrics.fd, ctx_metrics.addr);
+	if (remote_running)
 	{
-		midiInStop(fid_fbv.inp);
-		midiInClose(fid_fbv.inp);
+		eventfd_write(ctx_remote.wake, 1);
+		thread_join(&thread_remote);
 	}
-	if (fid_pod.out != INVALID_HANDLE_VALUE)
+	state.notify = -1;
+	if (ctx_remote.wake >= 0)
+		close(ctx_remote.wake);
+	if (ctx_remote.notify >= 0)
+		close(ctx_remote.notify);
+	if (ctx_remote.inject_wake >= 0)
+		close(ctx_remote.inject_wake);
+	remote_close(&ctx_remote.remote, ctx_remote.path);
+	if (replay_running)
+		thread_join(&thread_replay);
+	if (jitter_running)
 	{
-		midiOutReset(fid_pod.out);
-		midiOutClose(fid_pod.out);
+		__atomic_store_n(&ctx_jitter.running, 0, __ATOMIC_RELAXED);
+		thread_join(&thread_jitter);
 	}
-	if (fid_pod.inp != INVALID_HANDLE_VALUE)
+	if (watchdog_running)
 	{
-		midiInStop(fid_pod.inp);
-		midiInClose(fid_pod.inp);
+		eventfd_write(ctx_watchdog.wake, 1);
+		thread_join(&thread_watchdog);
 	}
+	if (ctx_watchdog.wake >= 0)
+		close(ctx_watchdog.wake);
+	trace_free(replay_peer.trace);
+	if (hotplug >= 0)
+		close(hotplug);
+	for (i = 0; i < port_count; i++)
+	{
+		if (devices[i].stop >= 0)
+			close(devices[i].stop);
+	}
+	if (main_wake >= 0)
+		close(main_wake);
+	report(evloop ? 0 : queues, scheds, stats, devices, &ctx_jitter);
+#else
+	report(queues, scheds, stats, 0/*devices*/, 0/*jitter*/);
+#endif
+
+	/* after the helpers, a command on the control socket still notifies cond_ctl */
+	cond_destroy(&cond_rst);
+	cond_destroy(&cond_ctl);
+	for (i = 0; i < PORTS; i++)
+		cond_destroy(&cond_out[i]);
+	mutex_destroy(&mutex);
+
+	for (i = 0; i < port_count; i++)
+	{
+#ifdef API_WIN
+		if (fids[i].out != INVALID_HANDLE_VALUE)
+		{
+			midiOutReset(fids[i].out);
+			midiOutClose(fids[i].out);
+		}
+		if (fids[i].inp != INVALID_HANDLE_VALUE)
+		{
+			midiInStop(fids[i].inp);
+			midiInClose(fids[i].inp);
+		}
 #else
-	if (fid_fbv >= 0)
-		close(fid_fbv);
-	if (fid_pod >= 0)
-		close(fid_pod);
+		transport_close(&fids[i]);
+#endif
+	}
+#ifndef API_WIN
 	if (_daemon)
 		info("Daemon terminated successfully.\n");
 #endif
+	capture_close(&capture);
+	map_free(state.map);
+	free(map_default);
 	return EXIT_SUCCESS;
 
 exit0:
+	for (i = 0; i < port_count; i++)
+	{
 #ifdef API_WIN
-	if (fid_fbv.out != INVALID_HANDLE_VALUE)
+		if (fids[i].out != INVALID_HANDLE_VALUE)
+		{
+			midiOutReset(fids[i].out);
+			midiOutClose(fids[i].out);
+		}
+		if (fids[i].inp != INVALID_HANDLE_VALUE)
+		{
+			midiInStop(fids[i].inp);
+			midiInClose(fids[i].inp);
+		}
+#else
+		transport_close(&fids[i]);
+#endif
+	}
+#ifndef API_WIN
+	if (reload_running)
 	{
-		midiOutReset(fid_fbv.out);
-		midiOutClose(fid_fbv.out);
+		eventfd_write(ctx_reload.wake, 1);
+		thread_join(&thread_reload);
 	}
-	if (fid_fbv.inp != INVALID_HANDLE_VALUE)
+	if (ctx_reload.wake >= 0)
+		close(ctx_reload.wake);
+	if (metrics_running)
 	{
-		midiInStop(fid_fbv.inp);
-		midiInClose(fid_fbv.inp);
+		eventfd_write(ctx_metrics.wake, 1);
+		thread_join(&thread_metrics);
 	}
-	if (fid_pod.out != INVALID_HANDLE_VALUE)
+	if (ctx_metrics.wake >= 0)
+		close(ctx_metrics.wake);
+	metrics_close(ctx_metrics.fd, ctx_metrics.addr);
+	if (remote_running)
 	{
-		midiOutReset(fid_pod.out);
-		midiOutClose(fid_pod.out);
+		eventfd_write(ctx_remote.wake, 1);
+		thread_join(&thread_remote);
 	}
-	if (fid_pod.inp != INVALID_HANDLE_VALUE)
+	state.notify = -1;
+	if (ctx_remote.wake >= 0)
+		close(ctx_remote.wake);
+	if (ctx_remote.notify >= 0)
+		close(ctx_remote.notify);
+	if (ctx_remote.inject_wake >= 0)
+		close(ctx_remote.inject_wake);
+	remote_close(&ctx_remote.remote, ctx_remote.path);
+	if (replay_running)
 	{
-		midiInStop(fid_pod.inp);
-		midiInClose(fid_pod.inp);
+		__atomic_store_n(&replay_peer.running, 0, __ATOMIC_RELAXED);
+		thread_join(&thread_replay);
 	}
-#else
-	if (fid_fbv >= 0)
-		close(fid_fbv);
-	if (fid_pod >= 0)
-		close(fid_pod);
+	if (jitter_running)
+	{
+		__atomic_store_n(&ctx_jitter.running, 0, __ATOMIC_RELAXED);
+		thread_join(&thread_jitter);
+	}
+	if (watchdog_running)
+	{
+		eventfd_write(ctx_watchdog.wake, 1);
+		thread_join(&thread_watchdog);
+	}
+	if (ctx_watchdog.wake >= 0)
+		close(ctx_watchdog.wake);
+	trace_free(replay_peer.trace);
+	if (hotplug >= 0)
+		close(hotplug);
+	for (i = 0; i < port_count; i++)
+	{
+		if (devices[i].stop >= 0)
+			close(devices[i].stop);
+	}
+	if (main_wake >= 0)
+		close(main_wake);
 	if (_daemon)
 		error("Daemon terminated with error(s).\n");
 #endif
+	capture_close(&capture);
+	map_free(state.map);
+	free(map_default);
 	return EXIT_FAILURE;
 }
 
+static void report(const queue_t *const queues, const sched_t *const scheds, const stats_path_t *const stats, const device_t *const devices, const jitter_context_t *const jitter)
+{
+	unsigned i, j;
+	for (i = 0; i < port_count; i++)
+	{
+		const sched_t *const sched = &scheds[i];
+		if (queues && (port_dirs[i] & PORT_INP))
+			info("Queue \"%s > CTL\": high-water mark %u, overflows %u.\n", port_names[i], queue_hwm(&queues[i]), queue_overflows(&queues[i]));
+		if (port_dirs[i] & PORT_OUT)
+			info("Queue \"%s < CTL\": high-water mark %u/%u/%u (prio/fifo/cc), overflows %u, coalesced %u, lost %u, expired %llu.\n", port_names[i],
+				queue_hwm(&sched->prio), queue_hwm(&sched->fifo), queue_hwm(&sched->keys),
+				queue_overflows(&sched->prio) + queue_overflows(&sched->fifo), sched_coalesced(sched), sched_lost(sched),
+				__atomic_load_n(&stats[i].expired, __ATOMIC_RELAXED));
+	}
+	for (i = 0; i < port_count; i++)
+	{
+		/* labeled with the default routes, traffic is accounted to its source */
+		char dsts[128] = "";
+		unsigned routes;
+		size_t len = 0;
+		for (routes = port_routes[i]; routes && (len < sizeof(dsts)); routes &= routes - 1)
+			len += snprintf(dsts + len, sizeof(dsts) - len, "%s%s", len ? "," : "", port_names[__builtin_ctz(routes)]);
+		for (j = 0; j < STATS_STAGES; j++)
+		{
+			const histogram_t *const hist = &stats[i].hist[j];
+			const unsigned long long count = __atomic_load_n(&hist->count, __ATOMIC_ACQUIRE);
+			if (!count)
+				continue;
+			info("Latency \"%s > %s\" %s: count %llu, mean %.1f us, p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us.\n",
+				port_names[i], dsts, STATS_NAMES[j], count,
+				tic2us(__atomic_load_n(&hist->sum, __ATOMIC_RELAXED)) / count,
+				tic2us(histogram_quantile(hist, .5)), tic2us(histogram_quantile(hist, .99)), tic2us(histogram_quantile(hist, .999)),
+				tic2us(__atomic_load_n(&hist->max, __ATOMIC_RELAXED)));
+		}
+	}
+	for (i = 0; devices && (i < port_count); i++)
+	{
+		if (devices[i].reconnects || devices[i].stalls)
+			info("Device \"%s\": reconnects %u, last %.1f ms, max %.1f ms, stalls %u.\n", port_names[i],
+				devices[i].reconnects, tic2us(devices[i].reconnect_last) / 1e3, tic2us(devices[i].reconnect_max) / 1e3,
+				__atomic_load_n(&devices[i].stalls, __ATOMIC_RELAXED));
+	}
+	if (jitter && jitter->period)
+	{
+		const histogram_t *const hist = &jitter->hist;
+		const unsigned long long count = __atomic_load_n(&hist->count, __ATOMIC_ACQUIRE);
+		if (count)
+			info("Jitter %.0f us period: count %llu, mean %.1f us, p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us.\n",
+				tic2us(jitter->period), count,
+				tic2us(__atomic_load_n(&hist->sum, __ATOMIC_RELAXED)) / count,
+				tic2us(histogram_quantile(hist, .5)), tic2us(histogram_quantile(hist, .99)), tic2us(histogram_quantile(hist, .999)),
+				tic2us(__atomic_load_n(&hist->max, __ATOMIC_RELAXED)));
+	}
+#ifdef LOCK_PROFILE
+	lock_profile_report(&report_line, 0);
+#endif
+}
+
+#ifdef LOCK_PROFILE
+static void report_line(void *const context, const char *const line)
+{
+	(void)context;
+	info("%s\n", line);
+}
+#endif
+
+/* Adds a port from "<name>:<kind|model>:<id>[:in|:out]", returns its index and the id or -1. */
+static int parse_port(char *const str, const char **const id)
+{
+	char *tok[4], *ptr = str;
+	unsigned n, i;
+	int kind = -1, model;
+	for (n = 0; ptr && (n < 4); n++)
+	{
+		tok[n] = ptr;
+		if ((ptr = strchr(ptr, ':')))
+			*ptr++ = 0;
+	}
+	if (ptr || (n < 3) || !*tok[0] || !*tok[2] || (port_count >= PORTS))
+		return -1;
+	/* a kind stands for its default model */
+	model = model_find(tok[1]);
+	for (i = 0; i < DEVS; i++)
+	{
+		if (!strcasecmp(tok[1], DEV_NAMES[i]))
+			model = DEV_MODELS[i];
+	}
+	if (model >= 0)
+		kind = MODEL_TABLE[model].kind;
+	for (i = 0; i < port_count; i++)
+	{
+		if (!strcasecmp(tok[0], port_names[i]))
+			return -1;
+	}
+	if ((kind < 0) || ((n > 3) && strcmp(tok[3], "in") && strcmp(tok[3], "out")))
+		return -1;
+	port_names[port_count] = tok[0];
+	port_kinds[port_count] = kind;
+	port_models[port_count] = model;
+	port_dirs[port_count] = n < 4 ? PORT_INP | PORT_OUT : !strcmp(tok[3], "in") ? PORT_INP : PORT_OUT;
+	*id = tok[2];
+	return port_count++;
+}
+
 #ifdef API_WIN
 
 static int get_inp_num(const char *const name)
@@ -744,588 +1653,2231 @@ exit0:
 	return 0;
 }
 
-#ifdef __cplusplus
-extern "C" {
-#endif
-
-static void sig_handler(int signum);
-
-#ifdef __cplusplus
+/*
+ * Watches HOTPLUG_DIR, its "by-id" folder and the folders of explicit device
+ * paths for new or changed nodes, so a missing device is reopened as soon as
+ * udev created it instead of on the next poll.
+ */
+static int hotplug_watch(const char *const *const paths, const unsigned count)
+{
+	unsigned i;
+	int ifd;
+	if ((ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+		return -1;
+	/* both appear with the first sound device, their parents are watched until then */
+	if (inotify_add_watch(ifd, HOTPLUG_DIR, HOTPLUG_EVENTS) < 0)
+		inotify_add_watch(ifd, "/dev", IN_CREATE);
+	else if (inotify_add_watch(ifd, HOTPLUG_DIR "/by-id", HOTPLUG_EVENTS) < 0)
+		debug("No \"%s/by-id\" yet.\n", HOTPLUG_DIR);
+	for (i = 0; i < count; i++)
+	{
+		const char *const name = paths[i] ? strrchr(paths[i], '/') : 0;
+		char dir[PATH_MAX];
+		if (!name)
+			continue;
+		snprintf(dir, sizeof(dir), "%.*s", name > paths[i] ? (int)(name - paths[i]) : 1, paths[i]);
+		if (inotify_add_watch(ifd, dir, HOTPLUG_EVENTS) < 0)
+			error("Failed to watch \"%s\" (%s).\n", dir, strerror(errno));
+	}
+	return ifd;
 }
-#endif
-static void register_signals()
+
+/*
+ * Sleeps until a device node appears or changes, the timeout passes or
+ * main_wake is signaled. Returns 1 if device nodes changed.
+ */
+static unsigned hotplug_wait(const int ifd, const int timeout)
 {
-	if (_daemon)
+	struct pollfd fds[2] = {
+		{ .fd = main_wake, .events = POLLIN },
+		{ .fd = ifd, .events = POLLIN },
+	};
+	char buf[HOTPLUG_BUF_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
+	eventfd_t value;
+	unsigned changed = 0;
+	if (poll(fds, 2, (ifd < 0) && (timeout < 0) ? HOTPLUG_POLL : timeout) <= 0)
+		return 0;
+	if (fds[0].revents & POLLIN)
+		eventfd_read(main_wake, &value);
+	while ((ifd >= 0) && ((len = read(ifd, buf, sizeof(buf))) > 0))
 	{
-		signal(SIGCHLD, SIG_IGN);
-		signal(SIGHUP, SIG_IGN);
+		const char *ptr;
+		for (ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + ((const struct inotify_event *)ptr)->len)
+		{
+			const struct inotify_event *const event = (const struct inotify_event *)ptr;
+			if ((event->mask & IN_ISDIR) && event->len && !strcmp(event->name, "snd"))
+				inotify_add_watch(ifd, HOTPLUG_DIR, HOTPLUG_EVENTS);
+			if ((event->mask & IN_ISDIR) && event->len && !strcmp(event->name, "by-id"))
+				inotify_add_watch(ifd, HOTPLUG_DIR "/by-id", HOTPLUG_EVENTS);
+//debug("Node \"%s\" changed.\n", event->len ? event->name : "");
+		}
+		changed = 1;
 	}
-	signal(SIGINT, &sig_handler);
+	return changed;
 }
 
-static void sig_handler(int signum)
+/*
+ * Opens one device, looking its node up by id first if needed. A failed
+ * device is retried on its own: on hotplug only if its node is missing and
+ * inotify works, otherwise after HOTPLUG_RETRY (HOTPLUG_POLL without inotify).
+ */
+static int device_open(device_t *const dev, const int hotplug)
 {
-	switch (signum)
+	const char *const name = port_names[dev->dev];
+	unsigned i;
+	tic_t tic;
+	int err;
+	if (dev->resolve && !(dev->path = id2dev(dev->id, dev->buf, sizeof(dev->buf))))
 	{
-		case SIGINT:
-			mutex_lock(&mutex);
-			loop = ctl_running = 0;
-			cond_broadcast(&cond_ctl);
-			mutex_unlock(&mutex);
-		default:
+		errno = ENOENT;
+		goto exit0;
+	}
+	if (transport_open(dev->fid, dev->path))
+	{
+		err = errno;
+		debug("Failed to open %s \"%s\".\n", name, dev->path);
+		errno = err;
+		goto exit0;
+	}
+	for (i = 0; (port_kinds[dev->dev] == DEV_POD) && (i < 5); i++)
+	{
+		unsigned char c;
+		/* a fresh node may not take writes yet, only then the POD gets time */
+		if (transport_write(dev->fid, &c, 0) >= 0)
 			break;
+		sleep_ms(100);
+		transport_close(dev->fid);
+		if (transport_open(dev->fid, dev->path))
+			goto exit0;
+	}
+	if (i >= 5)
+	{
+		err = errno;
+		error("Failed to write to %s device \"%s\" (%s).\n", name, dev->path, strerror(err));
+		transport_close(dev->fid);
+		errno = err;
+		goto exit0;
+	}
+	/* the reply is logged by the control stage, a full buffer only skips it */
+	if (identify && (transport_write(dev->fid, MODEL_IDENTITY_REQUEST, sizeof(MODEL_IDENTITY_REQUEST)) < 0))
+		debug("Identity request to %s \"%s\" failed.\n", name, dev->path);
+	tic_get(&tic);
+	__atomic_store_n(&dev->opened, tic, __ATOMIC_RELAXED);
+	if (dev->lost)
+	{
+		const tic_t gap = tic - dev->lost;
+		__atomic_store_n(&dev->reconnects, dev->reconnects + 1, __ATOMIC_RELAXED);
+		dev->reconnect_last = gap;
+		if (gap > dev->reconnect_max)
+			dev->reconnect_max = gap;
+		info("%s device \"%s\" ready, reconnected after %.1f ms.\n", name, dev->path, (double)gap / ms2tic(1));
 	}
-	signal(signum, SIG_DFL);
+	else
+		info("%s device \"%s\" ready.\n", name, dev->path);
+	__atomic_store_n(&dev->lost, 0, __ATOMIC_RELAXED);
+	return 0;
+exit0:
+	err = errno;
+	tic_get(&tic);
+	if ((err == ENOENT) && (hotplug >= 0))
+		dev->retry = GESTURE_NEVER;
+	else
+		dev->retry = tic + ms2tic(hotplug >= 0 ? HOTPLUG_RETRY : HOTPLUG_POLL);
+	return -1;
 }
 
-static void daemonize()
+/* Closes a failed device, it is reopened HOTPLUG_RETRY after it was opened at the earliest. */
+static void device_close(device_t *const dev)
 {
-	int i;
-	pid_t pid;
-	if ((pid = fork()) < 0)
-		exit(EXIT_FAILURE);
-	if (pid > 0)
-		exit(EXIT_SUCCESS);
-	if (setsid() < 0)
-		exit(EXIT_FAILURE);
-	register_signals();
-	if ((pid = fork()) < 0)
-		exit(EXIT_FAILURE);
-	if (pid > 0)
-		exit(EXIT_SUCCESS);
-	umask(0);
-	chdir("/");
-	for (i = sysconf(_SC_OPEN_MAX); i >= 0; i--)
-		close(i);
-	openlog("podfbv", LOG_PID, LOG_DAEMON);
+	tic_t tic;
+	transport_close(dev->fid);
+	tic_get(&tic);
+	__atomic_store_n(&dev->lost, tic, __ATOMIC_RELAXED);
+	dev->retry = dev->opened + ms2tic(HOTPLUG_RETRY);
+	info("%s device \"%s\" lost.\n", port_names[dev->dev], dev->path);
 }
 
-#endif /*API_WIN*/
-
+/* Returns the earliest retry of the closed devices or GESTURE_NEVER. */
+static tic_t device_deadline(const device_t *const devices)
+{
+	tic_t deadline = GESTURE_NEVER;
+	unsigned i;
+	for (i = 0; i < port_count; i++)
+	{
+		if (!transport_opened(devices[i].fid) && (devices[i].retry < deadline))
+			deadline = devices[i].retry;
+	}
+	return deadline;
+}
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-#ifdef API_WIN
-static void CALLBACK callback_input(HMIDIIN handle, const UINT message_type, const DWORD_PTR context, const DWORD_PTR param1, const DWORD_PTR param2, const char *const func);
-#else
-static void *thread_function_input(void *const context, const char *const func);
-#endif
+static void request_stop();
 
 #ifdef __cplusplus
 }
 #endif
-
-#ifdef API_WIN
-static void CALLBACK fbvinp(HMIDIIN handle, UINT message_type, DWORD_PTR context, DWORD_PTR param1, DWORD_PTR param2)
+static void register_signals()
 {
-	callback_input(handle, message_type, context, param1, param2, __FUNCTION__);
+	if (_daemon)
+	{
+		signal(SIGCHLD, SIG_IGN);
+		/* SIGHUP, SIGINT and SIGTERM are blocked and consumed by the reload thread or the event loop */
+	}
 }
-static void CALLBACK podinp(HMIDIIN handle, UINT message_type, DWORD_PTR context, DWORD_PTR param1, DWORD_PTR param2)
+
+/* Stops the threads and the main loop on SIGINT or SIGTERM, not a signal handler. */
+static void request_stop()
 {
-	callback_input(handle, message_type, context, param1, param2, __FUNCTION__);
+	mutex_lock(&mutex);
+	loop = ctl_running = 0;
+	cond_broadcast(&cond_ctl);
+	mutex_unlock(&mutex);
+	if (main_wake >= 0)
+		eventfd_write(main_wake, 1);
 }
-#else
-static void *fbvinp(void *const context)
+
+static void *reporter(void *const context)
 {
-	void *ret;
-	ret = thread_function_input(context, __FUNCTION__);
-	return ret;
+	report_context_t *const ctx = (report_context_t *)context;
+	sigset_t mask;
+	int signum;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+	debug("%s started.\n", __FUNCTION__);
+	while (!sigwait(&mask, &signum) && __atomic_load_n(&ctx->running, __ATOMIC_RELAXED))
+		report(ctx->queues, ctx->scheds, ctx->stats, ctx->devices, ctx->jitter);
+	debug("%s exit.\n", __FUNCTION__);
+	return 0;
 }
-static void *podinp(void *const context)
+
+/* Sleeps to absolute deadlines one period apart and records how late each wakeup was. */
+static void *jitter_probe(void *const context)
 {
-	void *ret;
-	ret = thread_function_input(context, __FUNCTION__);
-	return ret;
+	jitter_context_t *const ctx = (jitter_context_t *)context;
+	tic_t next, tic;
+	debug("%s started.\n", __FUNCTION__);
+	tic_get(&next);
+	while (__atomic_load_n(&ctx->running, __ATOMIC_RELAXED))
+	{
+		struct timespec ts;
+		next += ctx->period;
+		ts.tv_sec = next / TICS_PER_SEC;
+		ts.tv_nsec = next % TICS_PER_SEC;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR);
+		tic_get(&tic);
+		histogram_add(&ctx->hist, tic - next);
+		/* an overrun counts once, the following periods are not late by it */
+		if (tic - next > ctx->period)
+			next = tic;
+	}
+	debug("%s exit.\n", __FUNCTION__);
+	return 0;
 }
-#endif
-
-
-#ifndef API_WIN
-
-#ifdef __cplusplus
-extern "C" {
-#endif
 
-static ssize_t parse_input(const unsigned char *const buf, const size_t len);
-
-#ifdef __cplusplus
+static void *watchdog(void *const context)
+{
+	watchdog_context_t *const ctx = (watchdog_context_t *)context;
+	static const char *const STAGES[2] = { "input", "output" };
+	const int period = watchdog_stall / WATCHDOG_CHECKS / ms2tic(1) + 1;
+	tic_t control = 0, reported[PORTS][2] = { { 0 } }; /* work times already reported */
+	unsigned i, j;
+	debug("%s started.\n", __FUNCTION__);
+	for (;;)
+	{
+		struct pollfd fds = { .fd = ctx->wake, .events = POLLIN };
+		tic_t tic, work;
+		if (poll(&fds, 1, period) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			error("Watchdog wait failed (%s).\n", strerror(errno));
+			break;
+		}
+		if (fds.revents)
+			break;
+		tic_get(&tic);
+		work = __atomic_load_n(&ctx->state->work, __ATOMIC_RELAXED);
+		if (work && (work != control) && (tic - work >= watchdog_stall))
+		{
+			control = work;
+			__atomic_store_n(&ctx->state->stalls, ctx->state->stalls + 1, __ATOMIC_RELAXED);
+			error("Control stage stalled for %.0f ms.\n", (double)(tic - work) / ms2tic(1));
+		}
+		for (i = 0; ctx->devices && (i < port_count); i++)
+		{
+			device_t *const dev = &ctx->devices[i];
+			for (j = 0; j < 2; j++)
+			{
+				work = __atomic_load_n(j ? &dev->out_work : &dev->inp_work, __ATOMIC_RELAXED);
+				if (!work || (work == reported[i][j]) || (tic - work < watchdog_stall))
+					continue;
+				reported[i][j] = work;
+				__atomic_store_n(&dev->stalls, dev->stalls + 1, __ATOMIC_RELAXED);
+				error("%s %s stalled for %.0f ms, resetting the device.\n", port_names[i], STAGES[j], (double)(tic - work) / ms2tic(1));
+				__atomic_store_n(&dev->stalled, work, __ATOMIC_RELAXED);
+				eventfd_write(main_wake, 1);
+			}
+		}
+	}
+	debug("%s exit.\n", __FUNCTION__);
+	return 0;
 }
-#endif
 
-#endif
+/* Creates a thread with rt, without the privilege for SCHED_FIFO it and all later ones run with default scheduling. */
+static int rt_thread_create(thread_t *const thread, void *(*const thread_function)(void *const), void *const context, thread_attr_t *const attr)
+{
+	int result;
+	if (!(result = thread_create_attr(thread, thread_function, context, attr)) || !attr->prio || (result != EPERM))
+		return result;
+	error("No permission for SCHED_FIFO priority %i, using default scheduling.\n", attr->prio);
+	attr->prio = 0;
+	return thread_create_attr(thread, thread_function, context, attr);
+}
 
-#ifdef API_WIN
-static void CALLBACK callback_input(HMIDIIN handle, const UINT message_type, const DWORD_PTR context, const DWORD_PTR param1, const DWORD_PTR param2, const char *const func)
-#else
-static void *thread_function_input(void *const context, const char *const func)
-#endif
+/* Parses a CPU list like "2,3" or "1-3" into a mask. */
+static int parse_cpus(const char *const str, unsigned long long *const cpus)
 {
-	thread_context_message_t *const ctx = (thread_context_message_t *)context;
-	mutex_t *const mutex = ctx->mutex;
-	cond_t
-		*const cond_rst = ctx->cond_rst,
-		*const cond_inp2ctl = ctx->cond_ctl,
-		*const cond_ctl2inp = ctx->cond_dev;
-	unsigned *const running = ctx->running;
-	midi_message_t *const msg = ctx->msg;
-	tic_t
-		*tic1 = msg->_tic,
-		*tic2 = msg->_tic + 1;
-	unsigned char
-		*buf1 = msg->_buf,
-		*buf2 = msg->_buf + msg->_size;
-	size_t
-		*len1 = msg->_len,
-		*len2 = msg->_len + 1;
-#ifndef API_WIN
-	debug("%s started.\n", func);
-#endif
-	mutex_lock(mutex);
-#ifdef API_WIN
-//debug("Callback %i\n", message_type);
-	switch (message_type)
+	const char *ptr = str;
+	*cpus = 0;
+	do
 	{
-		case MIM_OPEN:
-#endif
-	*(msg->len = len1) = 0;
-	cond_broadcast(cond_inp2ctl);
-	debug("%s ready.\n", func);
-#ifdef API_WIN
-		case MIM_DATA:
-		case MIM_LONGDATA:
-		case MIM_MOREDATA:
-			break;
-		default:
-			goto exit1;
+		char *end;
+		unsigned long first, last, cpu;
+		first = last = strtoul(ptr, &end, 10);
+		if (end == ptr)
+			return -1;
+		if (*end == '-')
+		{
+			ptr = end + 1;
+			last = strtoul(ptr, &end, 10);
+			if (end == ptr)
+				return -1;
+		}
+		if ((first > last) || (last >= 8 * sizeof(*cpus)))
+			return -1;
+		for (cpu = first; cpu <= last; cpu++)
+			*cpus |= 1ULL << cpu;
+		ptr = end;
+	} while ((*ptr == ',') && ++ptr);
+	return *ptr ? -1 : 0;
+}
+
+/* Reloads the mapping on SIGHUP or when the mapping file is replaced, stops on SIGINT and SIGTERM if asked to. */
+static void *reloader(void *const context)
+{
+	reload_context_t *const ctx = (reload_context_t *)context;
+	const char *const name = ctx->path ? strrchr(ctx->path, '/') + 1 : 0;
+	sigset_t mask;
+	int sfd, ifd = -1;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGHUP);
+	if (ctx->stop)
+	{
+		sigaddset(&mask, SIGINT);
+		sigaddset(&mask, SIGTERM);
 	}
-#endif
+	if ((sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+	{
+		error("Failed to create reload signal descriptor (%s).\n", strerror(errno));
+		return 0;
+	}
+	if (ctx->path)
+	{
+		char dir[PATH_MAX];
+		snprintf(dir, sizeof(dir), "%.*s", (int)(name - ctx->path), ctx->path);
+		/* editors replace the file, so the directory is watched */
+		if (((ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) || (inotify_add_watch(ifd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0))
+			error("Failed to watch \"%s\" (%s), reload on SIGHUP only.\n", dir, strerror(errno));
+	}
+	debug("%s started.\n", __FUNCTION__);
 	for (;;)
 	{
-		unsigned char *ptr = buf1;
-#ifndef API_WIN
-		const fid_t *const fid = ctx->fid;
-		ssize_t left = 1;
-#endif
-#ifdef API_WIN
-		if (*len1)
-			goto exit1;
-		switch (message_type)
+		struct pollfd fds[3] = {
+			{ .fd = ctx->wake, .events = POLLIN },
+			{ .fd = sfd, .events = POLLIN },
+			{ .fd = ifd, .events = POLLIN },
+		};
+		unsigned changed = 0;
+		if (poll(fds, 3, -1/*timeout*/) < 0)
 		{
-			case MIM_DATA:
-			{
-				intptr_t val = (intptr_t)param1;
-				switch (val & 0xff)
-				{
-					case 0xb0:
-						*ptr++ = val & 0xff;
-						val >>= 8;
-						*ptr++ = val & 0xff;
-						val >>= 8;
-						*ptr++ = val & 0xff;
-						break;
-					case 0xc0:
-						*ptr++ = val & 0xff;
-						val >>= 8;
-						*ptr++ = val & 0xff;
-					default:
-						break;
-				}
-			}
-			default:
-				break;
+			if (errno == EINTR)
+				continue;
+			error("Reload wait failed (%s).\n", strerror(errno));
+			break;
 		}
-#else
-		while (*running && *len1)
+		if (fds[0].revents)
+			break;
+		if (fds[1].revents & POLLIN)
 		{
-			if (cond_wait(cond_ctl2inp, mutex))
+			struct signalfd_siginfo info;
+			while (read(sfd, &info, sizeof(info)) == sizeof(info))
 			{
-				debug("Wait failed.\n");
-				goto exit1;
+				if (info.ssi_signo == SIGHUP)
+					changed = 1;
+				else
+					request_stop();
 			}
 		}
-		if (!*running)
-			goto exit1;
-		mutex_unlock(mutex);
-		do
+		if (fds[2].revents & POLLIN)
 		{
-			ssize_t rcvd;
-			if ((rcvd = read(*fid, ptr, left)) < 0)
-			{
-				debug("Failed to read data.\n");
-				goto exit0;
-			}
-			if (left == 1)
-				tic_get(tic1);
-			ptr += rcvd;
-			if ((left = parse_input(buf1, ptr - buf1)) < 0)
+			char buf[RELOAD_BUF_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+			ssize_t len;
+			while ((len = read(ifd, buf, sizeof(buf))) > 0)
 			{
-				debug("Received unsupported message.\n");
-				left = 1;
+				const char *ptr;
+				for (ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + ((const struct inotify_event *)ptr)->len)
+				{
+					const struct inotify_event *const event = (const struct inotify_event *)ptr;
+					if (event->len && !strcmp(event->name, name))
+						changed = 1;
+				}
 			}
-		} while (left);
-		mutex_lock(mutex);
-		if (!*running)
-			goto exit1;
-#endif
-		if ((*(msg->len = len1) = (ptr - (msg->buf = buf1))))
-		{
-			msg->tic = tic1;
-//debug_msg(func, msg);
-			cond_signal(cond_inp2ctl);
-			swap_ptr(tic1, tic2);
-			swap_ptr(buf1, buf2);
-			swap_ptr(len1, len2);
 		}
-#ifdef API_WIN
-		break;
-#endif
+		if (changed)
+			reload(ctx);
 	}
-#ifndef API_WIN
-	goto exit1;
-exit0:
-	mutex_lock(mutex);
-#endif
-exit1:
-#ifdef API_WIN
-	switch (message_type)
+	if (ifd >= 0)
+		close(ifd);
+	close(sfd);
+	debug("%s exit.\n", __FUNCTION__);
+	return 0;
+}
+
+/* Builds the new tables off the hot path, publishes them and frees the old ones after a grace period. */
+static void reload(reload_context_t *const ctx)
+{
+	const char *err;
+	unsigned line;
+	map_t *map, *old;
+	if (!(map = ctx->path ? map_load(ctx->path, port_names, port_count, &line, &err) : map_parse(map_default, port_names, port_count, &line, &err)))
 	{
-		case MIM_CLOSE:
-#endif
-	*running = 0;
-	cond_broadcast(cond_rst);
-#ifdef API_WIN
-		default:
+		error("Failed to reload mapping \"%s\", line %u: %s, keeping the current one.\n", ctx->path ? ctx->path : "default", line, err);
+		return;
+	}
+	old = __atomic_exchange_n(ctx->map, map, __ATOMIC_SEQ_CST);
+	rcu_synchronize(ctx->rcu);
+	map_free(old);
+	info("Mapping \"%s\" reloaded.\n", ctx->path ? ctx->path : "default");
+}
+
+/* Answers scrapes until woken for shutdown, only loads counters and never takes a lock. */
+static void *metrics_server(void *const context)
+{
+	metrics_context_t *const ctx = (metrics_context_t *)context;
+	debug("%s started.\n", __FUNCTION__);
+	for (;;)
+	{
+		struct pollfd fds[2] = {
+			{ .fd = ctx->wake, .events = POLLIN },
+			{ .fd = ctx->fd, .events = POLLIN },
+		};
+		if (poll(fds, 2, -1/*timeout*/) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			error("Metrics wait failed (%s).\n", strerror(errno));
 			break;
+		}
+		if (fds[0].revents)
+			break;
+		if ((fds[1].revents & POLLIN) && metrics_serve(ctx->fd, &metrics_write, ctx))
+			debug("Failed to accept metrics connection (%s).\n", strerror(errno));
 	}
-#endif
-	mutex_unlock(mutex);
-#ifndef API_WIN
-	debug("%s exit.\n", func);
+	debug("%s exit.\n", __FUNCTION__);
 	return 0;
-#endif
 }
 
-#ifndef API_WIN
+static void metrics_write(void *const context, FILE *const file)
+{
+	const metrics_context_t *const ctx = (const metrics_context_t *)context;
+	static const double QUANTILES[] = { .5, .99, .999 };
+	unsigned i, j, k;
+	metrics_family(file, "podfbv_messages_in_total", "counter", "Messages read from a port.");
+	for (i = 0; i < port_count; i++)
+		fprintf(file, "podfbv_messages_in_total{port=\"%s\"} %llu\n", port_names[i], __atomic_load_n(&ctx->stats[i].inp, __ATOMIC_RELAXED));
+	metrics_family(file, "podfbv_messages_out_total", "counter", "Messages written to a port.");
+	for (i = 0; i < port_count; i++)
+		fprintf(file, "podfbv_messages_out_total{port=\"%s\"} %llu\n", port_names[i], __atomic_load_n(&ctx->stats[i].out, __ATOMIC_RELAXED));
+	metrics_family(file, "podfbv_dropped_total", "counter", "Messages dropped on input queue or output overflow, overtaken in the shared pool or past their write deadline.");
+	for (i = 0; i < port_count; i++)
+	{
+		const sched_t *const sched = &ctx->scheds[i];
+		if (ctx->queues && (port_dirs[i] & PORT_INP))
+			fprintf(file, "podfbv_dropped_total{port=\"%s\",reason=\"input_overflow\"} %u\n", port_names[i], queue_overflows(&ctx->queues[i]));
+		if (!(port_dirs[i] & PORT_OUT))
+			continue;
+		fprintf(file, "podfbv_dropped_total{port=\"%s\",reason=\"output_overflow\"} %u\n", port_names[i], queue_overflows(&sched->prio) + queue_overflows(&sched->fifo));
+		fprintf(file, "podfbv_dropped_total{port=\"%s\",reason=\"lost\"} %u\n", port_names[i], sched_lost(sched));
+		fprintf(file, "podfbv_dropped_total{port=\"%s\",reason=\"expired\"} %llu\n", port_names[i], __atomic_load_n(&ctx->stats[i].expired, __ATOMIC_RELAXED));
+	}
+	metrics_family(file, "podfbv_coalesced_total", "counter", "Control changes replaced by a newer value before they were written.");
+	for (i = 0; i < port_count; i++)
+	{
+		if (port_dirs[i] & PORT_OUT)
+			fprintf(file, "podfbv_coalesced_total{port=\"%s\"} %u\n", port_names[i], sched_coalesced(&ctx->scheds[i]));
+	}
+	/* accounted to the port the messages came from, as in the report */
+	metrics_family(file, "podfbv_latency_seconds", "summary", "Latency of the messages of a source port per stage.");
+	for (i = 0; i < port_count; i++)
+	{
+		for (j = 0; j < STATS_STAGES; j++)
+		{
+			const histogram_t *const hist = &ctx->stats[i].hist[j];
+			const unsigned long long count = __atomic_load_n(&hist->count, __ATOMIC_ACQUIRE);
+			if (!count)
+				continue;
+			for (k = 0; k < sizeof(QUANTILES)/sizeof(*QUANTILES); k++)
+				fprintf(file, "podfbv_latency_seconds{port=\"%s\",stage=\"%s\",quantile=\"%g\"} %.9f\n",
+					port_names[i], STATS_NAMES[j], QUANTILES[k], (double)histogram_quantile(hist, QUANTILES[k]) / TICS_PER_SEC);
+			fprintf(file, "podfbv_latency_seconds_sum{port=\"%s\",stage=\"%s\"} %.9f\n",
+				port_names[i], STATS_NAMES[j], (double)__atomic_load_n(&hist->sum, __ATOMIC_RELAXED) / TICS_PER_SEC);
+			fprintf(file, "podfbv_latency_seconds_count{port=\"%s\",stage=\"%s\"} %llu\n", port_names[i], STATS_NAMES[j], count);
+		}
+	}
+	metrics_family(file, "podfbv_device_up", "gauge", "Whether the device of a port is open.");
+	for (i = 0; i < port_count; i++)
+	{
+		const device_t *const dev = &ctx->devices[i];
+		fprintf(file, "podfbv_device_up{port=\"%s\"} %u\n", port_names[i],
+			__atomic_load_n(&dev->opened, __ATOMIC_RELAXED) && !__atomic_load_n(&dev->lost, __ATOMIC_RELAXED));
+	}
+	metrics_family(file, "podfbv_device_reconnects_total", "counter", "Reopens of the device of a port after it was lost.");
+	for (i = 0; i < port_count; i++)
+		fprintf(file, "podfbv_device_reconnects_total{port=\"%s\"} %u\n", port_names[i], __atomic_load_n(&ctx->devices[i].reconnects, __ATOMIC_RELAXED));
+	metrics_family(file, "podfbv_device_stalls_total", "counter", "Stalls of the input or output of a port found by the watchdog, each resets the device.");
+	for (i = 0; i < port_count; i++)
+		fprintf(file, "podfbv_device_stalls_total{port=\"%s\"} %u\n", port_names[i], __atomic_load_n(&ctx->devices[i].stalls, __ATOMIC_RELAXED));
+	metrics_family(file, "podfbv_control_wakeups_total", "counter", "Wakeups of the control thread or event loop.");
+	fprintf(file, "podfbv_control_wakeups_total %llu\n", __atomic_load_n(&ctx->state->wakeups, __ATOMIC_RELAXED));
+	metrics_family(file, "podfbv_control_stalls_total", "counter", "Stalls of the control thread or event loop found by the watchdog.");
+	fprintf(file, "podfbv_control_stalls_total %u\n", __atomic_load_n(&ctx->state->stalls, __ATOMIC_RELAXED));
+}
 
-static ssize_t parse_input(const unsigned char *const buf, const size_t len)
+/* Formats the published bank and button, buttons are the POD channels A to D, the program is the program change value. */
+static void remote_state(const unsigned published, const model_t *const pod, char *const buf, const size_t size)
 {
-	ssize_t left = -1;
-	if (len)
+	const unsigned bank = published >> 8, btn = published & 0xff;
+	if (btn < MODEL_CHANNELS)
+		snprintf(buf, size, "state bank %u channel %c program %u\n", bank + 1, 'A' + btn, pod->program_base + btn + bank * MODEL_CHANNELS);
+	else
+		snprintf(buf, size, "state bank %u channel - program 0\n", bank + 1);
+}
+
+/* Serves the control socket until woken for shutdown, subscribers get each published state. */
+static void *remote_server(void *const context)
+{
+	remote_context_t *const ctx = (remote_context_t *)context;
+	const int fds[2] = { ctx->wake, ctx->notify };
+	debug("%s started.\n", __FUNCTION__);
+	for (;;)
 	{
-		size_t msglen = 0;
-		switch (*buf)
+		int ready;
+		if ((ready = remote_poll(&ctx->remote, fds, 2, &remote_command, ctx)) < 0)
 		{
-			case 0xb0: /* Control change */
-				msglen = 3;
-				break;
-			case 0xc0: /* Program change */
-				msglen = 2;
-			default:
-				break;
+			error("Control socket wait failed (%s).\n", strerror(errno));
+			break;
+		}
+		if (ready & 1)
+			break;
+		if (ready & 2)
+		{
+			const unsigned published = __atomic_load_n(&ctx->state->published, __ATOMIC_ACQUIRE);
+			eventfd_t value;
+			char buf[REMOTE_LINE_SIZE];
+			eventfd_read(ctx->notify, &value);
+			/* changes in between are folded into the latest state */
+			if (published == ctx->shown)
+				continue;
+			ctx->shown = published;
+			remote_state(published, ctx->state->pod, buf, sizeof(buf));
+			remote_broadcast(&ctx->remote, "%s", buf);
 		}
-		if (msglen && (len <= msglen))
-			left = msglen - len;
 	}
-	return left;
+	debug("%s exit.\n", __FUNCTION__);
+	return 0;
 }
 
-#endif
+/*
+ * Commands of the control socket:
+ *   state        replies the current state
+ *   subscribe    replies the current state and sends each change
+ *   unsubscribe  stops the changes
+ *   pc <n>       sends program change n to the routes of the FBV
+ */
+static void remote_command(void *const context, remote_client_t *const client, char *const line)
+{
+	remote_context_t *const ctx = (remote_context_t *)context;
+	char buf[REMOTE_LINE_SIZE], *save, *end;
+	const char *const cmd = strtok_r(line, " \t", &save), *const arg = strtok_r(0, " \t", &save);
+	if (!cmd)
+		return;
+	if (!strcmp(cmd, "state") || !strcmp(cmd, "subscribe"))
+	{
+		if (!strcmp(cmd, "subscribe"))
+			client->subscribed = 1;
+		remote_state(__atomic_load_n(&ctx->state->published, __ATOMIC_ACQUIRE), ctx->state->pod, buf, sizeof(buf));
+		remote_reply(client, "%s", buf);
+	}
+	else if (!strcmp(cmd, "unsubscribe"))
+	{
+		client->subscribed = 0;
+		remote_reply(client, "ok\n");
+	}
+	else if (!strcmp(cmd, "pc"))
+	{
+		const unsigned long program = arg ? strtoul(arg, &end, 0) : 0;
+		midi_event_t event = midi_event_initializer();
+		int result;
+		if (!arg || (end == arg) || *end || (program > 0x7f))
+		{
+			remote_reply(client, "error invalid program\n");
+			return;
+		}
+		event.msg = midi_msg(2, 0xc0, program, 0);
+		tic_get(&event.tic);
+		result = queue_push(&ctx->inject, &event);
+		if (ctx->inject_wake >= 0)
+		{
+			if (result > 0)
+				eventfd_write(ctx->inject_wake, 1);
+		}
+		else
+			notify(result, ctx->mutex, ctx->cond);
+		remote_reply(client, result < 0 ? "error overflow\n" : "ok\n");
+	}
+	else
+		remote_reply(client, "error unknown command\n");
+}
+
+static void daemonize()
+{
+	int i;
+	pid_t pid;
+	if ((pid = fork()) < 0)
+		exit(EXIT_FAILURE);
+	if (pid > 0)
+		exit(EXIT_SUCCESS);
+	if (setsid() < 0)
+		exit(EXIT_FAILURE);
+	register_signals();
+	if ((pid = fork()) < 0)
+		exit(EXIT_FAILURE);
+	if (pid > 0)
+		exit(EXIT_SUCCESS);
+	umask(0);
+	chdir("/");
+	for (i = sysconf(_SC_OPEN_MAX); i >= 0; i--)
+		close(i);
+	openlog("podfbv", LOG_PID, LOG_DAEMON);
+}
+
+#endif /*API_WIN*/
+
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-static void *thread_function_output(void *const context, const char *const func);
+#ifdef API_WIN
+static void CALLBACK callback_input(HMIDIIN handle, const UINT message_type, const DWORD_PTR context, const DWORD_PTR param1, const DWORD_PTR param2, const char *const func);
+#else
+static void *thread_function_input(void *const context, const char *const func);
+#endif
 
 #ifdef __cplusplus
 }
 #endif
 
-static void *fbvout(void *const context)
+#ifdef API_WIN
+static void CALLBACK portinp(HMIDIIN handle, UINT message_type, DWORD_PTR context, DWORD_PTR param1, DWORD_PTR param2)
 {
-	void *ret;
-	ret = thread_function_output(context, __FUNCTION__);
-	return ret;
+	callback_input(handle, message_type, context, param1, param2, __FUNCTION__);
 }
-
-static void *podout(void *const context)
+#else
+static void *portinp(void *const context)
 {
 	void *ret;
-	ret = thread_function_output(context, __FUNCTION__);
+	ret = thread_function_input(context, __FUNCTION__);
 	return ret;
 }
+#endif
 
-static void *thread_function_output(void *const context, const char *const func)
+
+#ifndef API_WIN
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static int input_event(void *const context, const midi_event_t *const event);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+#ifdef API_WIN
+static void CALLBACK callback_input(HMIDIIN handle, const UINT message_type, const DWORD_PTR context, const DWORD_PTR param1, const DWORD_PTR param2, const char *const func)
+#else
+static void *thread_function_input(void *const context, const char *const func)
+#endif
 {
 	thread_context_message_t *const ctx = (thread_context_message_t *)context;
 	mutex_t *const mutex = ctx->mutex;
-	cond_t
-		*const cond_rst = ctx->cond_rst,
-		*const cond_out2ctl = ctx->cond_ctl,
-		*const cond_ctl2out = ctx->cond_dev;
+	cond_t *const cond_rst = ctx->cond_rst;
 	unsigned *const running = ctx->running;
-	midi_message_t *const msg = ctx->msg;
-	debug("%s started.\n", func);
-	mutex_lock(mutex);
-	for (;;)
+#ifdef API_WIN
+	queue_t *const queue = ctx->queue;
+	cond_t *const cond_inp2ctl = ctx->cond_ctl;
+//debug("Callback %i\n", message_type);
+	switch (message_type)
 	{
-		if (!*running)
-			goto exit1;
-		if (msg->len)
-			break;
-		if (cond_wait(cond_ctl2out, mutex))
+		case MIM_DATA:
 		{
-			debug("Wait failed.\n");
-			goto exit1;
+			midi_event_t event = midi_event_initializer();
+			const unsigned val = (unsigned)(intptr_t)param1;
+			const unsigned len = midi_length(val & 0xff);
+			tic_get(&event.tic);
+			/* short messages already come packed, just drop the unused bytes */
+			event.msg = midi_msg(len, 0, 0, 0) | (val & (MIDI_MSG_DATA >> (8 * (MIDI_EVENT_SIZE - len))));
+			if (!len || !(port_dirs[ctx->port] & PORT_INP))
+				break;
+			stats_count(&ctx->stats[ctx->port].inp, 1);
+			if (notify(queue_push(queue, &event), mutex, cond_inp2ctl) < 0)
+				debug("%s %s queue overflow.\n", func, port_names[ctx->port]);
+			break;
 		}
+		case MIM_CLOSE:
+			mutex_lock(mutex);
+			*running = 0;
+			cond_broadcast(cond_rst);
+			mutex_unlock(mutex);
+		default:
+			break;
 	}
-	debug("%s ready.\n", func);
-	do
+#else
+	fid_t *const fid = ctx->fid;
+	midi_parser_t parser = midi_parser_initializer();
+	/* blocking transports are only read once readable, so a stop request is never missed */
+	unsigned readable = fid->ops->nonblock;
+	debug("%s %s started.\n", func, port_names[ctx->port]);
+	debug("%s %s ready.\n", func, port_names[ctx->port]);
+	while (__atomic_load_n(running, __ATOMIC_RELAXED))
 	{
-		if (*msg->len)
+		unsigned char buf[INP_BUF_SIZE];
+		ssize_t rcvd;
+		tic_t tic;
+		if (!readable)
 		{
-			const fid_t *const fid = ctx->fid;
-#ifdef API_WIN
-			union { unsigned long word; unsigned char data[4]; } message;
-			unsigned i;
-			for (i = 0; (i < *msg->len) && (i < sizeof(message.data)/sizeof(*message.data)); i++)
-				message.data[i] = msg->buf[i];
-//debug("0x%08x\n", (unsigned)message.word);
-#endif
-//debug_msg(func, msg);
-			mutex_unlock(mutex);
-#if 1
-#	ifdef API_WIN
-			if (midiOutShortMsg(fid->out, message.word) != MMSYSERR_NOERROR)
-#	else
-			if (write(*fid, msg->buf, *msg->len) < 0)
-#	endif
+			struct pollfd fds[2] = {
+				{ .fd = transport_fd(fid), .events = POLLIN },
+				{ .fd = *ctx->stop, .events = POLLIN },
+			};
+			__atomic_store_n(ctx->work, 0, __ATOMIC_RELAXED);
+			if ((poll(fds, 2, -1) < 0) && (errno != EINTR))
 			{
-				debug("Failed to write data.\n");
+				debug("Failed to wait for data.\n");
 				goto exit0;
 			}
-#else
-debug_msg("Not writing ", msg);
-#endif
-			mutex_lock(mutex);
-			*msg->len = 0;
-			cond_signal(cond_out2ctl);
+			if (fds[1].revents & POLLIN)
+				break;
+			readable = fds[0].revents != 0;
+			continue;
 		}
-		if (cond_wait(cond_ctl2out, mutex))
+		if ((rcvd = transport_read(fid, buf, sizeof(buf))) <= 0)
 		{
-			debug("Wait failed.\n");
-			goto exit1;
+			if (!rcvd)
+			{
+				readable = 0;
+				continue;
+			}
+			debug("Failed to read data.\n");
+			goto exit0;
 		}
-	} while (*running);
-	goto exit1;
+		readable = fid->ops->nonblock;
+		tic_get(&tic);
+		__atomic_store_n(ctx->work, tic, __ATOMIC_RELAXED);
+		midi_parse(&parser, buf, rcvd, tic, &input_event, ctx);
+	}
 exit0:
 	mutex_lock(mutex);
-exit1:
 	*running = 0;
 	cond_broadcast(cond_rst);
 	mutex_unlock(mutex);
-	debug("%s exit.\n", func);
+	eventfd_write(main_wake, 1);
+	debug("%s %s exit.\n", func, port_names[ctx->port]);
 	return 0;
+#endif
 }
 
-static void *control(void *const context)
+#ifndef API_WIN
+
+static int input_event(void *const context, const midi_event_t *const event)
 {
-	thread_context_control_t *const ctx = (thread_context_control_t *)context;
-	mutex_t *const mutex = ctx->mutex;
-	cond_t
-		*const cond_rst = ctx->cond_rst,
-		*const cond_ctl = ctx->cond_ctl,
-		*const cond_fbv_inp = ctx->cond_fbv_inp,
-		*const cond_fbv_out = ctx->cond_fbv_out,
-		*const cond_pod_inp = ctx->cond_pod_inp,
-		*const cond_pod_out = ctx->cond_pod_out;
-	unsigned *const running = ctx->running;
-	midi_message_t
-		*const msg_fbv2ctl = ctx->msg_fbv2ctl,
-		*const msg_pod2ctl = ctx->msg_pod2ctl,
-		*const msg_ctl2fbv = ctx->msg_ctl2fbv,
-		*const msg_ctl2pod = ctx->msg_ctl2pod;
-	size_t
-		*len1_fbv = msg_ctl2fbv->_len,
-		*len2_fbv = msg_ctl2fbv->_len + 1,
-		*len1_pod = msg_ctl2pod->_len,
-		*len2_pod = msg_ctl2pod->_len + 1;
-	debug("%s started.\n", __FUNCTION__);
-	//notify output threads
-	mutex_lock(mutex);
-	*(msg_ctl2fbv->len = len1_fbv) = 0;
-	cond_broadcast(cond_fbv_out);
-	*(msg_ctl2pod->len = len1_pod) = 0;
-	cond_broadcast(cond_pod_out);
-	//wait input threads
-	for (;;)
-	{
-		if (!*running)
-			goto exit1;
-		if (msg_fbv2ctl->len && msg_pod2ctl->len)
-			break;
-		if (cond_wait(cond_ctl, mutex))
-		{
-			debug("Wait failed.\n");
-			goto exit1;
-		}
-	}
-	debug("%s ready.\n", __FUNCTION__);
-	do
-	{
-		unsigned char
-			*buf1_fbv = msg_ctl2fbv->_buf,
-			*buf2_fbv = msg_ctl2fbv->_buf + msg_ctl2fbv->_size,
-			*buf1_pod = msg_ctl2pod->_buf,
-			*buf2_pod = msg_ctl2pod->_buf + msg_ctl2pod->_size;
-		controller_state_t *const state = ctx->state;
-		if (*msg_fbv2ctl->len && !*len1_pod)
-		{
-			const midi_message_t *const inp = msg_fbv2ctl;
-			midi_message_t *const out = msg_ctl2pod;
-			unsigned char *ptr = buf1_pod;
-debug_msg("FBV > CTL", inp);
-			switch (inp->buf[0])
+	thread_context_message_t *const ctx = (thread_context_message_t *)context;
+//debug_msg(__FUNCTION__, event);
+	/* output only ports are read to notice their loss, their input is dropped */
+	if (!(port_dirs[ctx->port] & PORT_INP))
+		return 0;
+	stats_count(&ctx->stats[ctx->port].inp, 1);
+	if (notify(queue_push(ctx->queue, event), ctx->mutex, ctx->cond_ctl) < 0)
+		debug("%s input queue overflow.\n", port_names[ctx->port]);
+	return 0;
+}
+
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static void *thread_function_output(void *const context, const char *const func);
+#ifndef API_WIN
+static ssize_t output_send(fid_t *const fid, const int stop, const unsigned char *const buf, const size_t len, const tic_t deadline);
+#endif
+static unsigned control_empty(queue_t *const queues, queue_t *const inject);
+static void control_notify(mutex_t *const mutex, cond_t *const cond_out, unsigned ports);
+static size_t control_event(controller_state_t *const state, const unsigned dev, stats_path_t *const stats, const midi_event_t *const inp, midi_event_t *const out, const size_t size);
+static size_t control_expire(controller_state_t *const state, const tic_t tic, midi_event_t *const out, const size_t size);
+static size_t control_inject(controller_state_t *const state, const midi_event_t *const inp, midi_event_t *const out, const size_t size);
+static void control_publish(controller_state_t *const state);
+static const model_t *control_model(const controller_state_t *const state, const unsigned port);
+static void control_selected(controller_state_t *const state, const unsigned short select);
+static void control_bank(controller_state_t *const state, const unsigned up);
+static size_t control_select(controller_state_t *const state, const unsigned src, const tic_t tic, midi_event_t *const out, const size_t size);
+static unsigned control_routes(const controller_state_t *const state, const unsigned src, midi_event_t *const event);
+static unsigned control_dispatch(controller_state_t *const state, sched_pool_t *const pool, sched_t *const scheds, const unsigned src, midi_event_t *const out, const size_t n, unsigned *const routed);
+static void output_event(stats_path_t *const stats, const midi_event_t *const event);
+static void control_identify(controller_state_t *const state, const unsigned dev, const midi_event_t *const inp);
+static size_t control_map(controller_state_t *const state, const unsigned dev, const midi_event_t *const inp, midi_event_t *const out, const size_t size);
+static void control_gesture(void *const context, const unsigned btn, const unsigned gesture, const tic_t tic);
+
+#ifdef __cplusplus
+}
+#endif
+
+static void *portout(void *const context)
+{
+	void *ret;
+	ret = thread_function_output(context, __FUNCTION__);
+	return ret;
+}
+
+static void *thread_function_output(void *const context, const char *const func)
+{
+	thread_context_message_t *const ctx = (thread_context_message_t *)context;
+	mutex_t *const mutex = ctx->mutex;
+	cond_t
+		*const cond_rst = ctx->cond_rst,
+		*const cond_ctl2out = ctx->cond_dev;
+	unsigned *const running = ctx->running;
+	sched_t *const sched = ctx->sched;
+	stats_path_t *const stats = ctx->stats;
+	fid_t *const fid = ctx->fid;
+#ifndef API_WIN
+	midi_writer_t writer = midi_writer_initializer((port_running >> ctx->port) & 1);
+#endif
+	debug("%s %s started.\n", func, port_names[ctx->port]);
+	mutex_lock(mutex);
+	debug("%s %s ready.\n", func, port_names[ctx->port]);
+	for (;;)
+	{
+#ifdef API_WIN
+		midi_event_t event;
+#endif
+		while (*running && sched_empty(sched))
+		{
+			if (cond_wait(cond_ctl2out, mutex))
 			{
-				case 0xb0:
-					if (*inp->len == 3)
-					{
-						switch (inp->buf[1])
-						{
-							case 0x07: //channel volume
-							{
-								const char
-									val = inp->buf[2],
-									diff = val < state->vol ? state->vol - val : val - state->vol;
-								if (diff >= FBV_PEDAL_THRESH)
-								{
-									*ptr++ = inp->buf[0];
-									*ptr++ = inp->buf[1];
-									*ptr++ = (state->vol = val);
-								}
-								break;
-							}
-							case 0x0b: //expression
-							{
-								const char
-									val = inp->buf[2],
-									diff = val < state->expr ? state->expr - val : val - state->expr;
-								if (diff >= FBV_PEDAL_THRESH)
-								{
-									*ptr++ = 0xb0;
-									*ptr++ = 0x04;
-									*ptr++ = (state->expr = val);
-								}
-								break;
-							}
-							case 0x14: case 0x15: case 0x16: case 0x17: //btn codes
-							{
-								const unsigned btn = inp->buf[1] - 0x14;
-								if (inp->buf[2]) //press
-								{
-									tic_t *const tic = &state->tic[btn + TIC_BTN_A];
-									*tic = *inp->tic;
-//debug("Press %i\n", btn);
-									if (btn != state->btn)
-									{
-										//btn change
-										*ptr++ = 0xc0;
-										*ptr++ = (state->btn = btn) + state->bank * FBV_BTNS + 1;
-									}
-									else
-									{
-										//tap
-										*ptr++ = 0xb0;
-										*ptr++ = 0x40;
-										*ptr++ = 0x7f;
-									}
-								}
-#if 0
-								else //release
-								{
-									if (btn == state->btn)
-									{
-										const tic_t
-											*const tic1 = inp->tic,
-											*const tic0 = &state->tic[btn + TIC_BTN_A],
-											dtic = *tic1 - *tic0;
-//debug("Release %i (%lli)\n", btn, dtic);
-									}
-								}
-#endif
-								break;
-							}
-							case 0x66: //foot switch
-								*ptr++ = 0xb0;
-								*ptr++ = 0x2b;
-								*ptr++ = inp->buf[2] ? 0x40 : 0x00;
-							default:
-								break;
-						}
-					}
-				default:
-					break;
+				debug("Wait failed.\n");
+				goto exit1;
 			}
-			if ((*(out->len = len1_pod) = (ptr - (out->buf = buf1_pod))))
+		}
+		if (!*running)
+			goto exit1;
+		mutex_unlock(mutex);
+#ifdef API_WIN
+		while (sched_pop(sched, &event))
+		{
+//debug("0x%08x\n", event.msg);
+#if 1
+			if (midiOutShortMsg(fid->out, event.msg & MIDI_MSG_DATA) != MMSYSERR_NOERROR)
 			{
-debug_msg("POD < CTL", out);
-				cond_signal(cond_pod_out);
-				swap_ptr(buf1_pod, buf2_pod);
-				swap_ptr(len1_pod, len2_pod);
+				debug("Failed to write data.\n");
+				goto exit0;
 			}
-			*msg_fbv2ctl->len = 0;
-			cond_signal(cond_fbv_inp);
+#else
+debug_msg("Not writing ", &event);
+#endif
+			output_event(&stats[midi_src(&event)], &event);
+			stats_count(&stats[ctx->port].out, 1);
 		}
-		if (*msg_pod2ctl->len && !*len1_fbv)
+#else
+		/* whatever is queued goes out with a single write, messages past their deadline are dropped */
+		while (__atomic_load_n(running, __ATOMIC_RELAXED))
 		{
-			const midi_message_t *const inp = msg_pod2ctl;
-			midi_message_t *const out = msg_ctl2fbv;
-			unsigned char *ptr = buf1_fbv;
-debug_msg("POD > CTL", inp);
-			switch (inp->buf[0])
+			midi_event_t batch[PORT_BATCH];
+			unsigned char buf[PORT_BATCH * MIDI_EVENT_SIZE];
+			size_t ends[PORT_BATCH]; /* of each message in buf */
+			size_t n, i, len = 0;
+			ssize_t sent;
+			tic_t deadline = GESTURE_NEVER, tic;
+			tic_get(&tic);
+			for (n = 0; (n < PORT_BATCH) && sched_pop(sched, &batch[n]);)
 			{
-				case 0xb0:
-					if (*inp->len == 3)
-					{
-						switch (inp->buf[1])
-						{
-							default:
-								break;
-						}
-					}
-					break;
-				case 0xc0:
-					if (*inp->len == 2)
-					{
-						const unsigned idx = inp->buf[1] - 1;
-						state->bank = idx / FBV_BTNS;
-						state->btn = idx % FBV_BTNS;
-					}
-				default:
-					break;
+				const tic_t due = output_deadline ? batch[n].tic + output_deadline : GESTURE_NEVER;
+				if (due <= tic)
+				{
+					stats_count(&stats[ctx->port].expired, 1);
+					continue;
+				}
+				if (due < deadline)
+					deadline = due;
+				len += midi_encode(&writer, &batch[n], buf + len);
+				ends[n++] = len;
+			}
+			if (!n)
+				break;
+			if (!*ctx->work)
+				__atomic_store_n(ctx->work, tic, __ATOMIC_RELAXED);
+//debug_msg(func, &batch[0]);
+#if 1
+			if ((sent = output_send(fid, *ctx->stop, buf, len, deadline)) < 0)
+			{
+				debug("Failed to write data.\n");
+				goto exit0;
+			}
+#else
+debug_msg("Not writing ", &batch[0]);
+			sent = len;
+#endif
+			for (i = 0; (i < n) && (ends[i] <= (size_t)sent); i++)
+				output_event(&stats[midi_src(&batch[i])], &batch[i]);
+			/* a message cut at the deadline is completed, the device only sees whole ones */
+			if ((i < n) && ((size_t)sent > (i ? ends[i - 1] : 0)))
+			{
+				const ssize_t rest = output_send(fid, *ctx->stop, buf + sent, ends[i] - sent, GESTURE_NEVER);
+				if (rest < 0)
+				{
+					debug("Failed to write data.\n");
+					goto exit0;
+				}
+				if ((size_t)(sent + rest) == ends[i])
+				{
+					output_event(&stats[midi_src(&batch[i])], &batch[i]);
+					i++;
+				}
 			}
-			if ((*(out->len = len1_fbv) = (ptr - (out->buf = buf1_fbv))))
+			stats_count(&stats[ctx->port].out, i);
+			if (i < n)
 			{
-debug_msg("FBV < CTL", out);
-				cond_signal(cond_fbv_out);
-				swap_ptr(buf1_fbv, buf2_fbv);
-				swap_ptr(len1_fbv, len2_fbv);
+				stats_count(&stats[ctx->port].expired, n - i);
+				/* the status of a dropped message may be left out by the next one */
+				writer.status = 0;
 			}
-			*msg_pod2ctl->len = 0;
-			cond_signal(cond_pod_inp);
+			/* without progress the work time keeps running, also across idle periods */
+			if (sent > 0)
+				__atomic_store_n(ctx->work, 0, __ATOMIC_RELAXED);
+		}
+#endif
+		mutex_lock(mutex);
+	}
+exit0:
+	mutex_lock(mutex);
+exit1:
+	*running = 0;
+	cond_broadcast(cond_rst);
+	mutex_unlock(mutex);
+#ifndef API_WIN
+	eventfd_write(main_wake, 1);
+#endif
+	debug("%s %s exit.\n", func, port_names[ctx->port]);
+	return 0;
+}
+
+#ifndef API_WIN
+
+/*
+ * Writes buf without blocking, waiting for the device until the deadline
+ * (GESTURE_NEVER for none) or a stop request. Returns the number of bytes
+ * written or -1. Blocking transports take all of buf in any case.
+ */
+static ssize_t output_send(fid_t *const fid, const int stop, const unsigned char *const buf, const size_t len, const tic_t deadline)
+{
+	size_t sent = 0;
+	while (sent < len)
+	{
+		struct pollfd fds[2] = {
+			{ .fd = transport_fd_out(fid), .events = POLLOUT },
+			{ .fd = stop, .events = POLLIN },
+		};
+		ssize_t result;
+		int timeout = -1;
+		tic_t tic;
+		if ((result = transport_write(fid, buf + sent, len - sent)) < 0)
+			return -1;
+		if (result)
+		{
+			sent += result;
+			continue;
 		}
-		if (cond_wait(cond_ctl, mutex))
+		if (deadline != GESTURE_NEVER)
 		{
-			debug("Wait failed.\n");
-			goto exit1;
+			tic_get(&tic);
+			if (tic >= deadline)
+				break;
+			timeout = (deadline - tic + ms2tic(1) - 1) / ms2tic(1);
 		}
-	} while (*running);
+		if ((poll(fds, 2, timeout) < 0) && (errno != EINTR))
+			return -1;
+		if (fds[1].revents & POLLIN)
+			break;
+	}
+	return sent;
+}
+
+#endif
+
+static void *control(void *const context)
+{
+	thread_context_control_t *const ctx = (thread_context_control_t *)context;
+	mutex_t *const mutex = ctx->mutex;
+	cond_t
+		*const cond_rst = ctx->cond_rst,
+		*const cond_ctl = ctx->cond_ctl,
+		*const cond_out = ctx->cond_out;
+	unsigned *const running = ctx->running;
+	queue_t
+		*const queues = ctx->queues,
+		*const inject = ctx->inject;
+	sched_t *const scheds = ctx->scheds;
+	sched_pool_t *const pool = ctx->pool;
+	stats_path_t *const stats = ctx->stats;
+	controller_state_t *const state = ctx->state;
+	debug("%s started.\n", __FUNCTION__);
+	mutex_lock(mutex);
+	debug("%s ready.\n", __FUNCTION__);
+	for (;;)
+	{
+		midi_event_t out[CONTROL_OUT_SIZE];
+		size_t n;
+		tic_t tic;
+		unsigned busy, port;
+		while (*running && control_empty(queues, inject))
+		{
+			/* gesture timers bound the wait */
+			const tic_t deadline = gesture_deadline(&state->gesture);
+			if (deadline == GESTURE_NEVER)
+			{
+				if (cond_wait(cond_ctl, mutex))
+				{
+					debug("Wait failed.\n");
+					goto exit1;
+				}
+			}
+			else
+			{
+				tic_get(&tic);
+				if (tic >= deadline)
+					break;
+				if (cond_timedwait(cond_ctl, mutex, deadline))
+				{
+					debug("Wait failed.\n");
+					goto exit1;
+				}
+			}
+		}
+		if (!*running)
+			goto exit1;
+		mutex_unlock(mutex);
+		stats_count(&state->wakeups, 1);
+		rcu_online(state->rcu, CONTROL_RCU_READER);
+		tic_get(&tic);
+		__atomic_store_n(&state->work, tic, __ATOMIC_RELAXED);
+		n = control_expire(state, tic, out, CONTROL_OUT_SIZE);
+		control_notify(mutex, cond_out, control_dispatch(state, pool, scheds, state->gesture_port, out, n, 0/*routed*/));
+		do
+		{
+			busy = 0;
+			rcu_quiescent(state->rcu, CONTROL_RCU_READER);
+			/* one event per port and round, a busy port does not starve the others */
+			for (port = 0; port < port_count; port++)
+			{
+				midi_event_t inp;
+				if (!queue_pop(&queues[port], &inp))
+					continue;
+debug_msg(port_names[port], &inp);
+				n = control_event(state, port, &stats[port], &inp, out, CONTROL_OUT_SIZE);
+				control_notify(mutex, cond_out, control_dispatch(state, pool, scheds, port, out, n, 0/*routed*/));
+				busy = 1;
+			}
+			/* injected messages take the outbound path of the FBV */
+			if (inject)
+			{
+				midi_event_t inp;
+				if (!queue_pop(inject, &inp))
+					continue;
+debug_msg("control", &inp);
+				n = control_inject(state, &inp, out, CONTROL_OUT_SIZE);
+				control_notify(mutex, cond_out, control_dispatch(state, pool, scheds, DEV_FBV, out, n, 0/*routed*/));
+				busy = 1;
+			}
+			/* a round is progress, a long burst is no stall */
+			if (busy)
+			{
+				tic_get(&tic);
+				__atomic_store_n(&state->work, tic, __ATOMIC_RELAXED);
+			}
+		} while (busy);
+		__atomic_store_n(&state->work, 0, __ATOMIC_RELAXED);
+		rcu_offline(state->rcu, CONTROL_RCU_READER);
+		mutex_lock(mutex);
+	}
 exit1:
 	*running = 0;
 	cond_signal(cond_rst);
 	mutex_unlock(mutex);
+#ifndef API_WIN
+	eventfd_write(main_wake, 1);
+#endif
+	debug("%s exit.\n", __FUNCTION__);
+	return 0;
+}
+
+/* Consumer side check of all input queues, to be evaluated before waiting. */
+static unsigned control_empty(queue_t *const queues, queue_t *const inject)
+{
+	unsigned i;
+	if (inject && !queue_empty(inject))
+		return 0;
+	for (i = 0; i < port_count; i++)
+	{
+		if (!queue_empty(&queues[i]))
+			return 0;
+	}
+	return 1;
+}
+
+/* Wakes the output threads of ports whose scheduler became non-empty, see notify(). */
+static void control_notify(mutex_t *const mutex, cond_t *const cond_out, unsigned ports)
+{
+	if (!ports)
+		return;
+	mutex_lock(mutex);
+	for (; ports; ports &= ports - 1)
+		cond_signal(&cond_out[__builtin_ctz(ports)]);
+	mutex_unlock(mutex);
+}
+
+static inline void control_tic(const controller_state_t *const state, tic_t *const tic)
+{
+	if (state->clock)
+		*tic = *state->clock;
+	else
+		tic_get(tic);
+}
+
+/* Translates an inbound event, stamps the results and records the control stage latencies. */
+static size_t control_event(controller_state_t *const state, const unsigned dev, stats_path_t *const stats, const midi_event_t *const inp, midi_event_t *const out, const size_t size)
+{
+	tic_t tic_ctl, tic_map;
+	size_t i, n;
+	control_tic(state, &tic_ctl);
+	n = control_map(state, dev, inp, out, size);
+	control_tic(state, &tic_map);
+	control_publish(state);
+	histogram_add(&stats->hist[STATS_QUEUE], tic_ctl - inp->tic);
+	histogram_add(&stats->hist[STATS_MAP], tic_map - tic_ctl);
+	capture_event(state->capture, dev, inp);
+	for (i = 0; i < n; i++)
+	{
+		out[i].tic = tic_map;
+		out[i].dtic = tic_map - inp->tic < UINT_MAX ? tic_map - inp->tic : UINT_MAX;
+	}
+	return n;
+}
+
+typedef struct _control_output_t {
+	controller_state_t *state;
+	const map_t *map; /* loaded once per event */
+	midi_event_t *out;
+	size_t size, len;
+} control_output_t;
+
+#define control_output_initializer(_state, _out, _size) { \
+	.state = _state, .map = __atomic_load_n(&(_state)->map, __ATOMIC_ACQUIRE), .out = _out, .size = _size, .len = 0 }
+
+/* Fires due gesture timers, the results are stamped with their lateness. */
+static size_t control_expire(controller_state_t *const state, const tic_t tic, midi_event_t *const out, const size_t size)
+{
+	control_output_t ctx = control_output_initializer(state, out, size);
+	size_t i;
+	gesture_expire(&state->gesture, tic, &control_gesture, &ctx);
+	control_publish(state);
+	for (i = 0; i < ctx.len; i++)
+	{
+		out[i].dtic = tic - out[i].tic < UINT_MAX ? tic - out[i].tic : UINT_MAX;
+		out[i].tic = tic;
+	}
+	return ctx.len;
+}
+
+/*
+ * Passes a program change of the control socket on like a selection of the
+ * FBV and moves bank and button along. Its value is numbered after the first
+ * POD, other values are passed as they are. The injection is stamped as its
+ * input.
+ */
+static size_t control_inject(controller_state_t *const state, const midi_event_t *const inp, midi_event_t *const out, const size_t size)
+{
+	const unsigned short select = state->pod->select[midi_byte(inp, 1)];
+	size_t i, n = 1;
+	tic_t tic;
+	if (!size)
+		return 0;
+	control_tic(state, &tic);
+	if (select != MODEL_NO_SELECT)
+	{
+		control_selected(state, select);
+		control_publish(state);
+		n = control_select(state, DEV_FBV, tic, out, size);
+	}
+	else
+		out[0] = *inp;
+	for (i = 0; i < n; i++)
+	{
+		out[i].tic = tic;
+		out[i].dtic = tic - inp->tic < UINT_MAX ? tic - inp->tic : UINT_MAX;
+	}
+	return n;
+}
+
+/* Makes bank and button visible to the control socket, its thread is woken without blocking. */
+static void control_publish(controller_state_t *const state)
+{
+	const unsigned published = state->bank[DEV_POD] << 8 | state->btn;
+	if (published == state->published)
+		return;
+	__atomic_store_n(&state->published, published, __ATOMIC_RELEASE);
+#ifndef API_WIN
+	if (state->notify >= 0)
+		eventfd_write(state->notify, 1);
+#endif
+}
+
+/* Ports that are no POD take the numbering of the first one. */
+static const model_t *control_model(const controller_state_t *const state, const unsigned port)
+{
+	return port_kinds[port] == DEV_POD ? &MODEL_TABLE[port_models[port]] : state->pod;
+}
+
+/* Takes bank << 8 | channel of a program change as the selection, each port keeps the bank within its own. */
+static void control_selected(controller_state_t *const state, const unsigned short select)
+{
+	unsigned i;
+	for (i = 0; i < port_count; i++)
+		state->bank[i] = (select >> 8) % control_model(state, i)->banks;
+	state->btn = select & 0xff;
+}
+
+/* Moves the bank of each port one up or down, wrapping at the number of banks of its model. */
+static void control_bank(controller_state_t *const state, const unsigned up)
+{
+	unsigned i;
+	for (i = 0; i < port_count; i++)
+	{
+		const unsigned banks = control_model(state, i)->banks;
+		state->bank[i] = (state->bank[i] + (up ? 1 : banks - 1)) % banks;
+	}
+}
+
+/*
+ * Writes the program change of the selection once for each port an event
+ * of port src is routed to, numbered after the model of that port. Returns
+ * the number of events, see control_routes() for the target.
+ */
+static size_t control_select(controller_state_t *const state, const unsigned src, const tic_t tic, midi_event_t *const out, const size_t size)
+{
+	midi_event_t pc = { .tic = tic, .msg = midi_msg(2, 0xc0, 0, 0), .dtic = 0 };
+	unsigned routes;
+	size_t n = 0;
+	for (routes = control_routes(state, src, &pc); routes && (n < size); routes &= routes - 1)
+	{
+		const unsigned dst = __builtin_ctz(routes);
+		out[n] = pc;
+		out[n++].msg = midi_msg(2, 0xc0, control_model(state, dst)->program_base + state->btn + state->bank[dst] * MODEL_CHANNELS, CONTROL_TARGET | dst);
+	}
+	return n;
+}
+
+/*
+ * Returns the output ports an event of port src is routed to. A selection
+ * carries the port it is numbered for in its third byte and only goes
+ * there, the byte is cleared.
+ */
+static unsigned control_routes(const controller_state_t *const state, const unsigned src, midi_event_t *const event)
+{
+	const map_t *const map = __atomic_load_n(&state->map, __ATOMIC_ACQUIRE);
+	const unsigned routes = map_routes(map, src, midi_byte(event, 0), midi_flags(event) & MIDI_EVENT_SYSEX, port_routes[src]) & port_outputs;
+	const unsigned char target = midi_byte(event, 2);
+	if ((midi_len(event) != 2) || !(target & CONTROL_TARGET))
+		return routes;
+	event->msg &= ~(0xffU << 16);
+	return routes & 1U << (target & ~CONTROL_TARGET);
+}
+
+/*
+ * Schedules the translated events of port src on each of their destinations.
+ * An event is stored once, the schedulers get its reference. Returns the
+ * ports whose scheduler was empty before, routed collects all destinations.
+ */
+static unsigned control_dispatch(controller_state_t *const state, sched_pool_t *const pool, sched_t *const scheds, const unsigned src, midi_event_t *const out, const size_t n, unsigned *const routed)
+{
+	unsigned woken = 0;
+	size_t i;
+	for (i = 0; i < n; i++)
+	{
+		unsigned routes, ref;
+		int result;
+		midi_set_src(&out[i], src);
+		if (!(routes = control_routes(state, src, &out[i])))
+			continue;
+		ref = sched_pool_put(pool, &out[i]);
+		if (routed)
+			*routed |= routes;
+		for (; routes; routes &= routes - 1)
+		{
+			const unsigned dst = __builtin_ctz(routes);
+			capture_event(state->capture, dst | CAPTURE_OUT, &out[i]);
+			if ((result = sched_push(&scheds[dst], &out[i], ref)) > 0)
+				woken |= 1 << dst;
+			else if (result < 0)
+				debug("%s output overflow, message dropped.\n", port_names[dst]);
+		}
+	}
+	return woken;
+}
+
+/* Records the output stage latencies once an event has been written. */
+static void output_event(stats_path_t *const stats, const midi_event_t *const event)
+{
+	tic_t tic;
+	tic_get(&tic);
+	histogram_add(&stats->hist[STATS_OUTPUT], tic - event->tic);
+	histogram_add(&stats->hist[STATS_TOTAL], tic - event->tic + event->dtic);
+}
+
+static midi_event_t *control_output(control_output_t *const ctx)
+{
+	return ctx->len < ctx->size ? &ctx->out[ctx->len++] : 0;
+}
+
+static void control_gesture(void *const context, const unsigned btn, const unsigned gesture, const tic_t tic)
+{
+	control_output_t *const ctx = (control_output_t *)context;
+	controller_state_t *const state = ctx->state;
+	midi_event_t *out;
+	unsigned action = ctx->map->gesture[btn][gesture];
+//debug("Gesture %u on %u\n", gesture, btn);
+	if ((action == MAP_ACTION_SELECT) && (btn == state->btn))
+		action = MAP_ACTION_TAP;
+	switch (action)
+	{
+		case MAP_ACTION_SELECT:
+			if (btn >= MODEL_CHANNELS)
+				break;
+			state->btn = btn;
+			ctx->len += control_select(state, state->gesture_port, tic, ctx->out + ctx->len, ctx->size - ctx->len);
+			break;
+		case MAP_ACTION_TAP:
+			if ((out = control_output(ctx)))
+			{
+				out->msg = midi_msg(3, 0xb0, 0x40, 0x7f);
+				out->tic = tic;
+			}
+			break;
+		case MAP_ACTION_BANK_UP:
+		case MAP_ACTION_BANK_DOWN:
+			control_bank(state, action == MAP_ACTION_BANK_UP);
+			if (state->btn < MODEL_CHANNELS)
+				ctx->len += control_select(state, state->gesture_port, tic, ctx->out + ctx->len, ctx->size - ctx->len);
+			break;
+		default:
+			break;
+	}
+}
+
+/* Logs the model named by an identity reply of port dev. */
+static void control_identify(controller_state_t *const state, const unsigned dev, const midi_event_t *const inp)
+{
+	unsigned i;
+	for (i = 0; i < midi_len(inp); i++)
+	{
+		const int model = model_identify(&state->ident[dev], midi_byte(inp, i));
+		if (model < 0)
+			continue;
+		if (model == (int)port_models[dev])
+			info("Port \"%s\" identifies as %s.\n", port_names[dev], MODEL_TABLE[model].title);
+		else
+			info("Port \"%s\" identifies as %s, its profile is %s.\n", port_names[dev],
+				model < MODELS ? MODEL_TABLE[model].title : "an unknown Line 6 model", MODEL_TABLE[port_models[dev]].title);
+	}
+}
+
+/*
+ * Translates an inbound event of port dev with a single lookup into the
+ * mapping tables. Ports without rules of their own use those of the first
+ * port of their kind.
+ */
+static size_t control_map(controller_state_t *const state, const unsigned dev, const midi_event_t *const inp, midi_event_t *const out, const size_t size)
+{
+	control_output_t ctx = control_output_initializer(state, out, size);
+	const unsigned rules = (ctx.map->defined >> dev) & 1 ? dev : port_kinds[dev];
+	const map_entry_t *entry;
+	midi_event_t *ptr;
+	unsigned char val;
+	/* system messages and SysEx chunks are not mapped, they only take the routes */
+	if ((midi_flags(inp) & MIDI_EVENT_SYSEX) || (midi_byte(inp, 0) >= 0xf0))
+	{
+		if (midi_flags(inp) & MIDI_EVENT_SYSEX)
+			control_identify(state, dev, inp);
+		if ((ptr = control_output(&ctx)))
+			ptr->msg = inp->msg;
+		return ctx.len;
+	}
+	if (!(entry = map_lookup(ctx.map, rules, midi_byte(inp, 0), midi_byte(inp, 1))))
+		return 0;
+	/* a reloaded mapping numbers its slots anew, the last values start over */
+	if (ctx.map->serial != state->slot_serial)
+	{
+		memset(state->slot, 0, sizeof(state->slot));
+		state->slot_serial = ctx.map->serial;
+	}
+	val = midi_byte(inp, midi_len(inp) - 1);
+	switch (entry->kind)
+	{
+		case MAP_FORWARD:
+			if ((ptr = control_output(&ctx)))
+				ptr->msg = midi_msg(midi_len(inp), 0, 0, 0) | (inp->msg & MIDI_MSG_DATA);
+			break;
+		case MAP_MESSAGE:
+		{
+			const unsigned char out = map_value(ctx.map, entry, val);
+			if ((entry->slot != MAP_NO_SLOT) && !map_filter(entry, &state->slot[dev][entry->slot], val, out))
+				break;
+			if ((ptr = control_output(&ctx)))
+				ptr->msg = entry->len == 3 ? midi_msg(3, entry->status, entry->data1, out) : midi_msg(entry->len, entry->status, out, 0);
+			break;
+		}
+		case MAP_BUTTON:
+			state->gesture_port = dev;
+			gesture_input(&state->gesture, entry->data1, val, inp->tic, &control_gesture, &ctx);
+			break;
+		case MAP_PROGRAM:
+		{
+			/* numbered after the model of the port it comes from */
+			const unsigned short select = control_model(state, dev)->select[val];
+			if (select != MODEL_NO_SELECT)
+				control_selected(state, select);
+			break;
+		}
+		default:
+			break;
+	}
+	return ctx.len;
+}
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static void replay_print(const tic_t base, const unsigned dev, const midi_event_t *const event);
+static void replay_output(controller_state_t *const state, const tic_t base, const unsigned src, midi_event_t *const out, const size_t n, const unsigned quiet);
+static unsigned long long replay_expire(controller_state_t *const state, tic_t *const clock, const tic_t tic, const tic_t base, const unsigned quiet);
+
+#ifdef __cplusplus
+}
+#endif
+
+static void replay_print(const tic_t base, const unsigned dev, const midi_event_t *const event)
+{
+	unsigned i;
+	printf("%12.6f  %-4s <", (double)(event->tic - base) / TICS_PER_SEC, port_names[dev]);
+	for (i = 0; i < midi_len(event); i++)
+		printf(" %02x", midi_byte(event, i));
+	puts("");
+}
+
+/* Records and prints translated events once per destination, as control_dispatch() schedules them. */
+static void replay_output(controller_state_t *const state, const tic_t base, const unsigned src, midi_event_t *const out, const size_t n, const unsigned quiet)
+{
+	size_t i;
+	for (i = 0; i < n; i++)
+	{
+		unsigned routes;
+		for (routes = control_routes(state, src, &out[i]); routes; routes &= routes - 1)
+		{
+			capture_event(state->capture, __builtin_ctz(routes) | CAPTURE_OUT, &out[i]);
+			if (!quiet)
+				replay_print(base, __builtin_ctz(routes), &out[i]);
+		}
+	}
+}
+
+/* Fires gesture timers due up to tic at their deadlines. */
+static unsigned long long replay_expire(controller_state_t *const state, tic_t *const clock, const tic_t tic, const tic_t base, const unsigned quiet)
+{
+	unsigned long long count = 0;
+	tic_t deadline;
+	while ((deadline = gesture_deadline(&state->gesture)) <= tic)
+	{
+		midi_event_t out[CONTROL_OUT_SIZE];
+		size_t n;
+		*clock = deadline;
+		n = control_expire(state, deadline, out, CONTROL_OUT_SIZE);
+		replay_output(state, base, state->gesture_port, out, n, quiet);
+		count += n;
+	}
+	return count;
+}
+
+/*
+ * Feeds a trace through the control stage as fast as possible. The control
+ * stage reads the virtual clock, which follows the trace time stamps and the
+ * gesture deadlines, so results do not depend on the host.
+ */
+static int replay(const char *const path, const unsigned loops, const unsigned quiet, controller_state_t *const state)
+{
+	stats_path_t stats[PORTS];
+	unsigned long long inp = 0, outp = 0;
+	const char *err;
+	unsigned line, loop_nr, port;
+	trace_t *trace;
+	tic_t clock = 0, base, span, offset, tic0, tic1;
+	int result = -1;
+
+	for (port = 0; port < PORTS; port++)
+		stats[port] = (stats_path_t)stats_path_initializer();
+	if (!(trace = trace_load(path, port_names, port_count, &line, &err)))
+	{
+		error("Failed to load trace \"%s\", line %u: %s.\n", path, line, err);
+		return -1;
+	}
+	base = trace->count ? trace->events[0].event.tic : 0;
+	/* loops follow each other after a second of silence */
+	span = trace->count ? trace->events[trace->count - 1].event.tic - base + TICS_PER_SEC : 0;
+	state->clock = &clock;
+	tic_get(&tic0);
+	for (loop_nr = 0, offset = 0; loop_nr < loops; loop_nr++, offset += span)
+	{
+		size_t i;
+		for (i = 0; i < trace->count; i++)
+		{
+			const unsigned dev = trace->events[i].dev;
+			midi_event_t event = trace->events[i].event, out[CONTROL_OUT_SIZE];
+			size_t n;
+			event.tic += offset;
+			outp += replay_expire(state, &clock, event.tic, base, quiet);
+			clock = event.tic;
+			if (dev == TRACE_MAP)
+			{
+				/* there are no other readers, the old mapping goes at once */
+				map_t *const map = map_load(trace->maps[event.msg], port_names, port_count, &line, &err);
+				if (!map)
+				{
+					error("Failed to load mapping \"%s\", line %u: %s.\n", trace->maps[event.msg], line, err);
+					goto exit0;
+				}
+				map_free(state->map);
+				state->map = map;
+				continue;
+			}
+			n = port_dirs[dev] & PORT_INP ? control_event(state, dev, &stats[dev], &event, out, CONTROL_OUT_SIZE) : 0;
+			replay_output(state, base, dev, out, n, quiet);
+			outp += n;
+		}
+		inp += trace->count;
+	}
+	outp += replay_expire(state, &clock, GESTURE_NEVER - 1, base, quiet);
+	tic_get(&tic1);
+	info("Replayed %llu events (%llu outbound) in %.3f ms, %.0f events/s.\n",
+		inp, outp, tic2us(tic1 - tic0) / 1e3, tic1 > tic0 ? (double)inp * TICS_PER_SEC / (tic1 - tic0) : 0.);
+	result = 0;
+exit0:
+	state->clock = 0;
+	trace_free(trace);
+	return result;
+}
+
+#ifndef API_WIN
+
+typedef struct _replay_live_dev_t {
+	tic_t base;
+	unsigned dev, quiet;
+	unsigned long long count;
+} replay_live_dev_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static int replay_live_event(void *const context, const midi_event_t *const event);
+
+#ifdef __cplusplus
+}
+#endif
+
+/*
+ * Plays a trace into the far ends of the loopback devices at its own pace and
+ * prints what the daemon sends to the devices, in real time. Closing the far
+ * ends afterwards lets the daemon see both devices disappear.
+ */
+static void *replay_live(void *const context)
+{
+	replay_peer_t *const ctx = (replay_peer_t *)context;
+	const trace_t *const trace = ctx->trace;
+	transport_t peers[PORTS];
+	midi_parser_t parsers[PORTS];
+	replay_live_dev_t devs[PORTS];
+	const tic_t first = trace->count ? trace->events[0].event.tic : 0;
+	tic_t base, end;
+	unsigned long long sent = 0, received = 0;
+	size_t next = 0;
+	unsigned i;
+
+	for (i = 0; i < port_count; i++)
+	{
+		peers[i] = (transport_t)transport_initializer(&TRANSPORT_LOOPBACK);
+		parsers[i] = (midi_parser_t)midi_parser_initializer();
+	}
+	for (i = 0; i < port_count; i++)
+	{
+		if (transport_open(&peers[i], ctx->names[i]))
+		{
+			error("Failed to open loopback \"%s\" (%s).\n", ctx->names[i], strerror(errno));
+			goto exit0;
+		}
+	}
+	tic_get(&base);
+	base += ms2tic(REPLAY_LIVE_DELAY);
+	end = base + (trace->count ? trace->events[trace->count - 1].event.tic - first : 0) + ms2tic(REPLAY_LIVE_SETTLE);
+	for (i = 0; i < port_count; i++)
+	{
+		devs[i].base = base;
+		devs[i].dev = i;
+		devs[i].quiet = ctx->quiet;
+		devs[i].count = 0;
+	}
+	while (__atomic_load_n(&ctx->running, __ATOMIC_RELAXED))
+	{
+		struct pollfd fds[PORTS];
+		tic_t tic, due;
+		tic_get(&tic);
+		for (; (next < trace->count) && ((due = base + trace->events[next].event.tic - first) <= tic); next++)
+		{
+			const trace_event_t *const event = &trace->events[next];
+			unsigned char buf[MIDI_EVENT_SIZE];
+			/* mapping changes take the virtual clock, the daemon reloads its own file */
+			if (event->dev == TRACE_MAP)
+				continue;
+			if (transport_send(&peers[event->dev], buf, midi_unpack(&event->event, buf)))
+			{
+				error("Failed to write to loopback \"%s\" (%s).\n", ctx->names[event->dev], strerror(errno));
+				goto exit0;
+			}
+			sent++;
+		}
+		if ((next >= trace->count) && (tic >= end))
+			break;
+		due = next < trace->count ? base + trace->events[next].event.tic - first : end;
+		for (i = 0; i < port_count; i++)
+		{
+			fds[i].fd = transport_fd(&peers[i]);
+			fds[i].events = POLLIN;
+		}
+		if ((poll(fds, port_count, (due - tic + ms2tic(1) - 1) / ms2tic(1)) < 0) && (errno != EINTR))
+			goto exit0;
+		tic_get(&tic);
+		for (i = 0; i < port_count; i++)
+		{
+			unsigned char buf[INP_BUF_SIZE];
+			ssize_t rcvd;
+			/* a closed daemon end reads as failure until it is reopened */
+			while ((rcvd = transport_read(&peers[i], buf, sizeof(buf))) > 0)
+				midi_parse(&parsers[i], buf, rcvd, tic, &replay_live_event, &devs[i]);
+		}
+	}
+	for (i = 0; i < port_count; i++)
+		received += devs[i].count;
+	info("Replayed %llu events (%llu outbound) through the daemon.\n", sent, received);
+
+exit0:
+	for (i = 0; i < port_count; i++)
+		transport_close(&peers[i]);
+	return 0;
+}
+
+static int replay_live_event(void *const context, const midi_event_t *const event)
+{
+	replay_live_dev_t *const dev = (replay_live_dev_t *)context;
+	if (!dev->quiet)
+		replay_print(dev->base, dev->dev, event);
+	dev->count++;
+	return 0;
+}
+
+#endif
+
+#ifndef API_WIN
+
+typedef struct _event_loop_t event_loop_t;
+
+typedef struct _event_loop_device_t {
+	device_t *device;
+	unsigned registered; /* open and watched by epoll */
+	midi_parser_t parser;
+	sched_t *sched;
+	midi_writer_t writer;
+	midi_event_t out[PORT_BATCH]; /* events of the write in progress */
+	unsigned char out_buf[PORT_BATCH * MIDI_EVENT_SIZE]; /* bytes of out */
+	size_t out_ends[PORT_BATCH]; /* of each event in out_buf */
+	size_t out_count, out_len, out_sent;
+	tic_t out_deadline; /* earliest of the events in out */
+	unsigned out_wait;
+	unsigned id;
+	event_loop_t *loop;
+} event_loop_device_t;
+
+#define event_loop_device_initializer(_device, _sched, _id, _loop) { \
+	.device = _device, .registered = 0, .parser = midi_parser_initializer(), .sched = _sched, \
+	.writer = midi_writer_initializer((port_running >> (_id)) & 1), .out = { midi_event_initializer() }, .out_buf = { 0 }, .out_ends = { 0 }, \
+	.out_count = 0, .out_len = 0, .out_sent = 0, .out_deadline = GESTURE_NEVER, .out_wait = 0, \
+	.id = _id, .loop = _loop }
+
+struct _event_loop_t {
+	event_loop_device_t devs[PORTS];
+	device_t *devices;
+	sched_t *scheds;
+	sched_pool_t *pool;
+	stats_path_t *stats;
+	controller_state_t *state;
+	remote_context_t *remote; /* 0 without control socket */
+	int efd, tfd, hotplug;
+	tic_t armed;
+	unsigned routed; /* ports scheduled for since the last flush */
+};
+
+enum _event_loop_source_t {
+	EVENT_LOOP_SIGNAL = PORTS,
+	EVENT_LOOP_TIMER,
+	EVENT_LOOP_HOTPLUG,
+	EVENT_LOOP_INJECT
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static int event_loop_connect(event_loop_t *const loop, const unsigned hotplugged);
+static void event_loop_disconnect(event_loop_device_t *const dev);
+static int event_loop_read(event_loop_device_t *const dev);
+static int event_loop_event(void *const context, const midi_event_t *const event);
+static int event_loop_drain(event_loop_device_t *const dev);
+static int event_loop_wait_out(event_loop_device_t *const dev, const unsigned wait);
+static void event_loop_flush(event_loop_t *const loop);
+static void event_loop_expire(event_loop_t *const loop);
+static void event_loop_inject(event_loop_t *const loop);
+static void event_loop_overdue(event_loop_t *const loop);
+static int event_loop_arm(event_loop_t *const loop);
+
+#ifdef __cplusplus
+}
+#endif
+
+/*
+ * Runs all ports on one thread until a signal ends it. A failed device is
+ * closed and reopened on its own, the others keep running; without loop
+ * mode the first failure ends the loop.
+ */
+static int event_loop(device_t *const devices, sched_t *const scheds, sched_pool_t *const pool, stats_path_t *const stats, controller_state_t *const state, const int hotplug, const jitter_context_t *const jitter, remote_context_t *const remote)
+{
+	event_loop_t loop_ctx = {
+		.devices = devices, .scheds = scheds, .pool = pool, .stats = stats, .state = state, .remote = remote,
+		.efd = -1, .tfd = -1, .hotplug = hotplug, .armed = GESTURE_NEVER, .routed = 0,
+	};
+	event_loop_device_t *const devs = loop_ctx.devs;
+	sigset_t mask, mask_old;
+	int sfd = -1;
+	unsigned quit = 0, i;
+
+	for (i = 0; i < port_count; i++)
+		devs[i] = (event_loop_device_t)event_loop_device_initializer(&devices[i], &scheds[i], i, &loop_ctx);
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGUSR1);
+	if (sigprocmask(SIG_BLOCK, &mask, &mask_old))
+	{
+		error("Failed to block signals (%s).\n", strerror(errno));
+		return -1;
+	}
+	if ((sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+	{
+		error("Failed to create signal descriptor (%s).\n", strerror(errno));
+		goto exit0;
+	}
+	if ((loop_ctx.efd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+	{
+		error("Failed to create epoll instance (%s).\n", strerror(errno));
+		goto exit0;
+	}
+	{
+		struct epoll_event ev = { .events = EPOLLIN, .data.u32 = EVENT_LOOP_SIGNAL };
+		if (epoll_ctl(loop_ctx.efd, EPOLL_CTL_ADD, sfd, &ev))
+		{
+			error("Failed to register signal descriptor (%s).\n", strerror(errno));
+			goto exit0;
+		}
+	}
+	/* gesture timers and device retries, armed on the monotonic clock tic_get() is based on */
+	if ((loop_ctx.tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+	{
+		error("Failed to create timer descriptor (%s).\n", strerror(errno));
+		goto exit0;
+	}
+	{
+		struct epoll_event ev = { .events = EPOLLIN, .data.u32 = EVENT_LOOP_TIMER };
+		if (epoll_ctl(loop_ctx.efd, EPOLL_CTL_ADD, loop_ctx.tfd, &ev))
+		{
+			error("Failed to register timer descriptor (%s).\n", strerror(errno));
+			goto exit0;
+		}
+	}
+	if (hotplug >= 0)
+	{
+		struct epoll_event ev = { .events = EPOLLIN, .data.u32 = EVENT_LOOP_HOTPLUG };
+		if (epoll_ctl(loop_ctx.efd, EPOLL_CTL_ADD, hotplug, &ev))
+		{
+			error("Failed to register hotplug descriptor (%s).\n", strerror(errno));
+			goto exit0;
+		}
+	}
+	if (remote)
+	{
+		struct epoll_event ev = { .events = EPOLLIN, .data.u32 = EVENT_LOOP_INJECT };
+		if (epoll_ctl(loop_ctx.efd, EPOLL_CTL_ADD, remote->inject_wake, &ev))
+		{
+			error("Failed to register inject descriptor (%s).\n", strerror(errno));
+			goto exit0;
+		}
+	}
+	/* devices opened by the caller are only registered */
+	if (event_loop_connect(&loop_ctx, 0/*hotplugged*/) || event_loop_arm(&loop_ctx))
+		goto exit0;
+	debug("%s ready.\n", __FUNCTION__);
+
+	while (!quit)
+	{
+		struct epoll_event events[EVENT_LOOP_EVENTS];
+		int n, j;
+		tic_t tic;
+		__atomic_store_n(&state->work, 0, __ATOMIC_RELAXED);
+		rcu_offline(state->rcu, CONTROL_RCU_READER);
+		n = epoll_wait(loop_ctx.efd, events, EVENT_LOOP_EVENTS, -1/*timeout*/);
+		rcu_online(state->rcu, CONTROL_RCU_READER);
+		tic_get(&tic);
+		__atomic_store_n(&state->work, tic, __ATOMIC_RELAXED);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			error("Wait failed (%s).\n", strerror(errno));
+			goto exit0;
+		}
+		stats_count(&state->wakeups, 1);
+		for (j = 0; j < n; j++)
+		{
+			const unsigned id = events[j].data.u32;
+			if (id == EVENT_LOOP_TIMER)
+			{
+				unsigned long long expirations;
+				if (read(loop_ctx.tfd, &expirations, sizeof(expirations)) == sizeof(expirations))
+					loop_ctx.armed = GESTURE_NEVER;
+				event_loop_expire(&loop_ctx);
+				event_loop_overdue(&loop_ctx);
+				if (event_loop_connect(&loop_ctx, 0/*hotplugged*/))
+					goto exit0;
+				continue;
+			}
+			if (id == EVENT_LOOP_INJECT)
+			{
+				eventfd_t value;
+				eventfd_read(remote->inject_wake, &value);
+				event_loop_inject(&loop_ctx);
+				continue;
+			}
+			if (id == EVENT_LOOP_HOTPLUG)
+			{
+				if (event_loop_connect(&loop_ctx, hotplug_wait(hotplug, 0/*timeout*/)))
+					goto exit0;
+				continue;
+			}
+			if (id == EVENT_LOOP_SIGNAL)
+			{
+				struct signalfd_siginfo info;
+				while (read(sfd, &info, sizeof(info)) == sizeof(info))
+				{
+					debug("Received signal %u.\n", info.ssi_signo);
+					if (info.ssi_signo == SIGUSR1)
+						report(0/*queues*/, scheds, stats, devices, jitter);
+					else
+						quit = 1;
+				}
+				if (quit)
+					loop = 0;
+				continue;
+			}
+			/* an earlier event of this batch may have closed the device */
+			if (!devs[id].registered)
+				continue;
+			if ((events[j].events & EPOLLOUT) && (event_loop_drain(&devs[id]) < 0))
+				event_loop_disconnect(&devs[id]);
+			if (!devs[id].registered)
+				continue;
+			if (events[j].events & EPOLLIN)
+			{
+				if (event_loop_read(&devs[id]) < 0)
+					event_loop_disconnect(&devs[id]);
+				/* all events of this read are scheduled, coalesced pedal data goes out last */
+				event_loop_flush(&loop_ctx);
+			}
+			else if (events[j].events & (EPOLLERR | EPOLLHUP))
+				event_loop_disconnect(&devs[id]);
+		}
+		/* without loop mode a lost device ends the session */
+		for (j = 0; j < (int)port_count; j++)
+			quit |= !loop && !devs[j].registered;
+		if (event_loop_arm(&loop_ctx))
+		{
+			error("Failed to arm timer (%s).\n", strerror(errno));
+			goto exit0;
+		}
+	}
+
+	rcu_offline(state->rcu, CONTROL_RCU_READER);
+	close(loop_ctx.efd);
+	close(loop_ctx.tfd);
+	close(sfd);
+	sigprocmask(SIG_SETMASK, &mask_old, 0);
 	debug("%s exit.\n", __FUNCTION__);
 	return 0;
+
+exit0:
+	rcu_offline(state->rcu, CONTROL_RCU_READER);
+	if (loop_ctx.efd >= 0)
+		close(loop_ctx.efd);
+	if (loop_ctx.tfd >= 0)
+		close(loop_ctx.tfd);
+	if (sfd >= 0)
+		close(sfd);
+	sigprocmask(SIG_SETMASK, &mask_old, 0);
+	return -1;
+}
+
+/* Opens the devices that are due for a retry and registers every open one with epoll. */
+static int event_loop_connect(event_loop_t *const loop, const unsigned hotplugged)
+{
+	unsigned i;
+	tic_t tic;
+	tic_get(&tic);
+	for (i = 0; i < port_count; i++)
+	{
+		event_loop_device_t *const dev = &loop->devs[i];
+		device_t *const device = dev->device;
+		struct epoll_event ev = { .events = EPOLLIN, .data.u32 = i };
+		if (dev->registered)
+			continue;
+		if (!transport_opened(device->fid) &&
+			(((tic < device->retry) && !hotplugged) || device_open(device, loop->hotplug)))
+			continue;
+		if (epoll_ctl(loop->efd, EPOLL_CTL_ADD, transport_fd(device->fid), &ev))
+		{
+			error("Failed to register device %u (%s).\n", i, strerror(errno));
+			return -1;
+		}
+		dev->registered = 1;
+		/* output scheduled while the device was away */
+		if (event_loop_drain(dev) < 0)
+			event_loop_disconnect(dev);
+	}
+	return 0;
+}
+
+/* Closes a failed device, its peer keeps running. */
+static void event_loop_disconnect(event_loop_device_t *const dev)
+{
+	const midi_parser_t parser = midi_parser_initializer();
+	if (!dev->registered)
+		return;
+	if (dev->out_wait && (transport_fd_out(dev->device->fid) != transport_fd(dev->device->fid)))
+		epoll_ctl(dev->loop->efd, EPOLL_CTL_DEL, transport_fd_out(dev->device->fid), 0);
+	epoll_ctl(dev->loop->efd, EPOLL_CTL_DEL, transport_fd(dev->device->fid), 0);
+	device_close(dev->device);
+debug("Reset %s\n", port_names[dev->id]);
+	dev->registered = 0;
+	dev->parser = parser;
+	dev->writer.status = 0;
+	dev->out_count = 0;
+	dev->out_len = 0;
+	dev->out_sent = 0;
+	dev->out_deadline = GESTURE_NEVER;
+	dev->out_wait = 0;
+	__atomic_store_n(&dev->device->out_work, 0, __ATOMIC_RELAXED);
+}
+
+static int event_loop_read(event_loop_device_t *const dev)
+{
+	for (;;)
+	{
+		unsigned char buf[EVENT_LOOP_BUF_SIZE];
+		ssize_t rcvd;
+		tic_t tic;
+		if ((rcvd = transport_read(dev->device->fid, buf, sizeof(buf))) <= 0)
+		{
+			if (!rcvd)
+				break;
+			debug("Failed to read data.\n");
+			return -1;
+		}
+		tic_get(&tic);
+		if (midi_parse(&dev->parser, buf, rcvd, tic, &event_loop_event, dev) < 0)
+			return -1;
+	}
+	return 0;
 }
+
+static int event_loop_event(void *const context, const midi_event_t *const event)
+{
+	event_loop_device_t *const dev = (event_loop_device_t *)context;
+	event_loop_t *const loop = dev->loop;
+	midi_event_t out[CONTROL_OUT_SIZE];
+	size_t n;
+	/* output only ports are read to notice their loss, their input is dropped */
+	if (!(port_dirs[dev->id] & PORT_INP))
+		return 0;
+	stats_count(&loop->stats[dev->id].inp, 1);
+	n = control_event(loop->state, dev->id, &loop->stats[dev->id], event, out, CONTROL_OUT_SIZE);
+	control_dispatch(loop->state, loop->pool, loop->scheds, dev->id, out, n, &loop->routed);
+	return 0;
+}
+
+/* Writes out what was scheduled since the last flush. */
+static void event_loop_flush(event_loop_t *const loop)
+{
+	unsigned routed;
+	for (routed = loop->routed; routed; routed &= routed - 1)
+	{
+		event_loop_device_t *const dst = &loop->devs[__builtin_ctz(routed)];
+		if (!dst->out_wait && (event_loop_drain(dst) < 0))
+			event_loop_disconnect(dst);
+	}
+	loop->routed = 0;
+}
+
+/* Fires due gesture timers, their output is routed from the port of the last button. */
+static void event_loop_expire(event_loop_t *const loop)
+{
+	midi_event_t out[CONTROL_OUT_SIZE];
+	size_t n;
+	tic_t tic;
+	tic_get(&tic);
+	n = control_expire(loop->state, tic, out, CONTROL_OUT_SIZE);
+	control_dispatch(loop->state, loop->pool, loop->scheds, loop->state->gesture_port, out, n, &loop->routed);
+	event_loop_flush(loop);
+}
+
+/* Passes on what the control socket queued since its last wakeup. */
+static void event_loop_inject(event_loop_t *const loop)
+{
+	midi_event_t inp, out[CONTROL_OUT_SIZE];
+	size_t n;
+	while (queue_pop(&loop->remote->inject, &inp))
+	{
+debug_msg("control", &inp);
+		n = control_inject(loop->state, &inp, out, CONTROL_OUT_SIZE);
+		control_dispatch(loop->state, loop->pool, loop->scheds, DEV_FBV, out, n, &loop->routed);
+	}
+	event_loop_flush(loop);
+}
+
+/*
+ * Handles devices that do not take their output: the events of a blocked
+ * write are dropped at their deadline, a device without progress for the
+ * stall time is reset.
+ */
+static void event_loop_overdue(event_loop_t *const loop)
+{
+	unsigned i;
+	size_t j;
+	tic_t tic;
+	tic_get(&tic);
+	for (i = 0; i < port_count; i++)
+	{
+		event_loop_device_t *const dev = &loop->devs[i];
+		const tic_t work = dev->device->out_work;
+		if (!dev->registered || !dev->out_wait)
+			continue;
+		if (watchdog_stall && work && (tic - work >= watchdog_stall))
+		{
+			__atomic_store_n(&dev->device->stalls, dev->device->stalls + 1, __ATOMIC_RELAXED);
+			error("%s output stalled for %.0f ms, resetting the device.\n", port_names[i], (double)(tic - work) / ms2tic(1));
+			event_loop_disconnect(dev);
+			continue;
+		}
+		if (tic < dev->out_deadline)
+			continue;
+		/* a message cut by the device is completed, it only sees whole ones */
+		for (j = 0; (j < dev->out_count) && (dev->out_ends[j] <= dev->out_sent); j++);
+		if ((j < dev->out_count) && (dev->out_sent > (j ? dev->out_ends[j - 1] : 0)))
+			j++;
+		stats_count(&loop->stats[i].expired, dev->out_count - j);
+		dev->out_count = j;
+		dev->out_len = j ? dev->out_ends[j - 1] : 0;
+		dev->out_deadline = GESTURE_NEVER;
+		/* the status of a dropped message may be left out by the next one */
+		dev->writer.status = 0;
+		if (dev->out_sent == dev->out_len)
+		{
+			for (j = 0; j < dev->out_count; j++)
+				output_event(&loop->stats[midi_src(&dev->out[j])], &dev->out[j]);
+			stats_count(&loop->stats[i].out, dev->out_count);
+			dev->out_len = 0;
+		}
+		if (event_loop_drain(dev) < 0)
+			event_loop_disconnect(dev);
+	}
+}
+
+/* Re-arms the timer descriptor when the earliest gesture deadline, device retry, write deadline or stall changed. */
+static int event_loop_arm(event_loop_t *const loop)
+{
+	const tic_t gesture = gesture_deadline(&loop->state->gesture);
+	const tic_t retry = device_deadline(loop->devices);
+	tic_t deadline = retry < gesture ? retry : gesture;
+	struct itimerspec its = { .it_interval = { 0, 0 }, .it_value = { 0, 0 } };
+	unsigned i;
+	for (i = 0; i < port_count; i++)
+	{
+		const event_loop_device_t *const dev = &loop->devs[i];
+		const tic_t work = dev->device->out_work;
+		if (!dev->registered || !dev->out_wait)
+			continue;
+		if (dev->out_deadline < deadline)
+			deadline = dev->out_deadline;
+		if (watchdog_stall && work && (work + watchdog_stall < deadline))
+			deadline = work + watchdog_stall;
+	}
+	if (deadline == loop->armed)
+		return 0;
+	if (deadline != GESTURE_NEVER)
+	{
+		/* a zero value would disarm, deadlines are never at the clock origin */
+		its.it_value.tv_sec = deadline / TICS_PER_SEC;
+		its.it_value.tv_nsec = deadline % TICS_PER_SEC;
+	}
+	if (timerfd_settime(loop->tfd, TFD_TIMER_ABSTIME, &its, 0))
+		return -1;
+	loop->armed = deadline;
+	return 0;
+}
+
+/*
+ * Writes scheduled events in batches until the scheduler is empty or the
+ * device would block. Events past their deadline are dropped unwritten.
+ */
+static int event_loop_drain(event_loop_device_t *const dev)
+{
+	size_t i;
+	tic_t tic;
+	if (!dev->registered)
+		return 0;
+	for (;;)
+	{
+		ssize_t result;
+		if (!dev->out_len)
+		{
+			tic_get(&tic);
+			dev->out_deadline = GESTURE_NEVER;
+			for (dev->out_count = 0; (dev->out_count < PORT_BATCH) && sched_pop(dev->sched, &dev->out[dev->out_count]);)
+			{
+				const tic_t due = output_deadline ? dev->out[dev->out_count].tic + output_deadline : GESTURE_NEVER;
+				if (due <= tic)
+				{
+					stats_count(&dev->loop->stats[dev->id].expired, 1);
+					continue;
+				}
+				if (due < dev->out_deadline)
+					dev->out_deadline = due;
+				dev->out_len += midi_encode(&dev->writer, &dev->out[dev->out_count], dev->out_buf + dev->out_len);
+				dev->out_ends[dev->out_count++] = dev->out_len;
+			}
+			if (!dev->out_count)
+				break;
+			dev->out_sent = 0;
+		}
+		if ((result = transport_write(dev->device->fid, dev->out_buf + dev->out_sent, dev->out_len - dev->out_sent)) < 0)
+		{
+			debug("Failed to write data.\n");
+			return -1;
+		}
+		if (!result)
+		{
+			/* the stall time runs from the first write the device did not take */
+			if (!dev->device->out_work)
+			{
+				tic_get(&tic);
+				__atomic_store_n(&dev->device->out_work, tic, __ATOMIC_RELAXED);
+			}
+			if (!dev->out_wait && event_loop_wait_out(dev, 1))
+				return -1;
+			return 0;
+		}
+		__atomic_store_n(&dev->device->out_work, 0, __ATOMIC_RELAXED);
+		if ((dev->out_sent += result) == dev->out_len)
+		{
+			/* latencies are accounted to the port the event came from */
+			for (i = 0; i < dev->out_count; i++)
+				output_event(&dev->loop->stats[midi_src(&dev->out[i])], &dev->out[i]);
+			stats_count(&dev->loop->stats[dev->id].out, dev->out_count);
+			dev->out_len = 0;
+		}
+	}
+	if (dev->out_wait && event_loop_wait_out(dev, 0))
+		return -1;
+	return 0;
+}
+
+/* Starts or stops waiting for the device to take data, on its own descriptor if the transport has one for writes. */
+static int event_loop_wait_out(event_loop_device_t *const dev, const unsigned wait)
+{
+	const int fd = transport_fd(dev->device->fid), out = transport_fd_out(dev->device->fid);
+	struct epoll_event ev = { .events = EPOLLIN | (wait ? EPOLLOUT : 0), .data.u32 = dev->id };
+	if (out != fd)
+	{
+		ev.events = EPOLLOUT;
+		if (epoll_ctl(dev->loop->efd, wait ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, out, &ev))
+			return -1;
+	}
+	else if (epoll_ctl(dev->loop->efd, EPOLL_CTL_MOD, fd, &ev))
+		return -1;
+	dev->out_wait = wait;
+	return 0;
+}
+
+#endif
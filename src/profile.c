@@ -0,0 +1,240 @@
+#include "api.h"
+
+#ifdef LOCK_PROFILE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/* A lock held by the calling thread, its hold is accounted on release. */
+typedef struct _lock_held_t {
+	const mutex_t *mutex;
+	lock_site_t *site;
+	tic_t tic;
+} lock_held_t;
+
+/* Condition variables are known by address, a slot is claimed on first use. */
+typedef struct _lock_cond_t {
+	const cond_t *cond;
+	lock_site_t *site; /* first wait, names the variable */
+	unsigned long long signals, waits, wakeups, spurious, timeouts;
+} lock_cond_t;
+
+static lock_site_t *lock_sites = 0;
+static lock_cond_t lock_conds[LOCK_PROFILE_CONDS];
+static tic_t lock_start = 0; /* first registration */
+/* beyond LOCK_PROFILE_DEPTH nested locks are counted but not timed */
+static __thread lock_held_t lock_held[LOCK_PROFILE_DEPTH];
+static __thread unsigned lock_depth = 0;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static void lock_register(lock_site_t *const site);
+static void lock_max(tic_t *const max, const tic_t value);
+static void lock_acquired(const mutex_t *const mutex, lock_site_t *const site, const tic_t tic);
+static void lock_released(const mutex_t *const mutex);
+static lock_cond_t *lock_cond(const cond_t *const cond);
+static const char *lock_name(const lock_site_t *const site, char *const buf, const size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+static void lock_register(lock_site_t *const site)
+{
+	unsigned expected = 0;
+	tic_t start = 0, tic;
+	if (__atomic_load_n(&site->registered, __ATOMIC_ACQUIRE) ||
+		!__atomic_compare_exchange_n(&site->registered, &expected, 1, 0/*weak*/, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return;
+	site->next = __atomic_load_n(&lock_sites, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&lock_sites, &site->next, site, 1/*weak*/, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	tic_get(&tic);
+	__atomic_compare_exchange_n(&lock_start, &start, tic, 0/*weak*/, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+static void lock_max(tic_t *const max, const tic_t value)
+{
+	tic_t old = __atomic_load_n(max, __ATOMIC_RELAXED);
+	while ((value > old) && !__atomic_compare_exchange_n(max, &old, value, 1/*weak*/, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void lock_acquired(const mutex_t *const mutex, lock_site_t *const site, const tic_t tic)
+{
+	__atomic_fetch_add(&site->acquired, 1, __ATOMIC_RELAXED);
+	if (lock_depth < LOCK_PROFILE_DEPTH)
+		lock_held[lock_depth] = (lock_held_t){ .mutex = mutex, .site = site, .tic = tic };
+	lock_depth++;
+}
+
+static void lock_released(const mutex_t *const mutex)
+{
+	const unsigned n = lock_depth < LOCK_PROFILE_DEPTH ? lock_depth : LOCK_PROFILE_DEPTH;
+	unsigned i;
+	tic_t tic;
+	if (!lock_depth)
+		return;
+	lock_depth--;
+	/* locks are mostly released in reverse order */
+	for (i = n; i-- > 0;)
+	{
+		lock_site_t *const site = lock_held[i].site;
+		if (lock_held[i].mutex != mutex)
+			continue;
+		tic_get(&tic);
+		__atomic_fetch_add(&site->hold, tic - lock_held[i].tic, __ATOMIC_RELAXED);
+		lock_max(&site->hold_max, tic - lock_held[i].tic);
+		memmove(&lock_held[i], &lock_held[i + 1], (n - i - 1) * sizeof(*lock_held));
+		return;
+	}
+}
+
+/* Returns the slot of a condition variable, 0 once all are taken. */
+static lock_cond_t *lock_cond(const cond_t *const cond)
+{
+	unsigned i;
+	for (i = 0; i < LOCK_PROFILE_CONDS; i++)
+	{
+		lock_cond_t *const slot = &lock_conds[((uintptr_t)cond / sizeof(*cond) + i) % LOCK_PROFILE_CONDS];
+		const cond_t *expected = 0;
+		if ((__atomic_load_n(&slot->cond, __ATOMIC_ACQUIRE) == cond) ||
+			__atomic_compare_exchange_n(&slot->cond, &expected, cond, 0/*weak*/, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) || (expected == cond))
+			return slot;
+	}
+	return 0;
+}
+
+/* "<file>:<line> <function>" without the directory. */
+static const char *lock_name(const lock_site_t *const site, char *const buf, const size_t size)
+{
+	const char *const file = strrchr(site->file, '/');
+	snprintf(buf, size, "%s:%u %s", file ? file + 1 : site->file, site->line, site->func);
+	return buf;
+}
+
+int lock_profile_lock(mutex_t *const mutex, lock_site_t *const site)
+{
+	tic_t start, tic;
+	int result;
+	lock_register(site);
+	if (mutex_trylock(mutex))
+	{
+		tic_get(&start);
+		if ((result = (mutex_lock)(mutex)))
+			return result;
+		tic_get(&tic);
+		__atomic_fetch_add(&site->contended, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&site->wait, tic - start, __ATOMIC_RELAXED);
+		lock_max(&site->wait_max, tic - start);
+	}
+	else
+		tic_get(&tic);
+	lock_acquired(mutex, site, tic);
+	return 0;
+}
+
+int lock_profile_unlock(mutex_t *const mutex)
+{
+	lock_released(mutex);
+	return (mutex_unlock)(mutex);
+}
+
+int lock_profile_signal(cond_t *const cond, const unsigned all)
+{
+	lock_cond_t *const slot = lock_cond(cond);
+	if (slot)
+		__atomic_fetch_add(&slot->signals, 1, __ATOMIC_RELEASE);
+	return all ? (cond_broadcast)(cond) : (cond_signal)(cond);
+}
+
+/* The mutex is released for the wait, its next hold starts at this site. */
+int lock_profile_wait(cond_t *const cond, mutex_t *const mutex, const tic_t deadline, lock_site_t *const site)
+{
+	lock_cond_t *const slot = lock_cond(cond);
+	unsigned long long signals = 0;
+	tic_t tic;
+	int result;
+	lock_register(site);
+	if (slot)
+	{
+		lock_site_t *expected = 0;
+		__atomic_compare_exchange_n(&slot->site, &expected, site, 0/*weak*/, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&slot->waits, 1, __ATOMIC_RELAXED);
+		signals = __atomic_load_n(&slot->signals, __ATOMIC_ACQUIRE);
+	}
+	lock_released(mutex);
+	result = deadline < 0 ? (cond_wait)(cond, mutex) : (cond_timedwait)(cond, mutex, deadline);
+	tic_get(&tic);
+	lock_acquired(mutex, site, tic);
+	if (slot && !result)
+	{
+		if (__atomic_load_n(&slot->signals, __ATOMIC_ACQUIRE) != signals)
+			__atomic_fetch_add(&slot->wakeups, 1, __ATOMIC_RELAXED);
+		else if ((deadline >= 0) && (tic >= deadline))
+			__atomic_fetch_add(&slot->timeouts, 1, __ATOMIC_RELAXED);
+		else
+			__atomic_fetch_add(&slot->spurious, 1, __ATOMIC_RELAXED);
+	}
+	return result;
+}
+
+void lock_profile_report(const lock_profile_emit_t emit, void *const context)
+{
+	lock_site_t *sites[LOCK_PROFILE_SITES], *site;
+	char line[256], name[96];
+	unsigned n = 0, i, j;
+	tic_t tic, wait = 0, hold = 0;
+	double elapsed;
+	for (site = __atomic_load_n(&lock_sites, __ATOMIC_ACQUIRE); site && (n < LOCK_PROFILE_SITES); site = site->next)
+		sites[n++] = site;
+	/* most waited for first */
+	for (i = 1; i < n; i++)
+	{
+		for (j = i; j && (__atomic_load_n(&sites[j - 1]->wait, __ATOMIC_RELAXED) < __atomic_load_n(&sites[j]->wait, __ATOMIC_RELAXED)); j--)
+		{
+			site = sites[j];
+			sites[j] = sites[j - 1];
+			sites[j - 1] = site;
+		}
+	}
+	snprintf(line, sizeof(line), "%-40s %10s %10s %12s %12s %12s %12s",
+		"Lock site", "acquired", "contended", "wait us", "wait max us", "hold us", "hold max us");
+	emit(context, line);
+	for (i = 0; i < n; i++)
+	{
+		site = sites[i];
+		wait += __atomic_load_n(&site->wait, __ATOMIC_RELAXED);
+		hold += __atomic_load_n(&site->hold, __ATOMIC_RELAXED);
+		snprintf(line, sizeof(line), "%-40s %10llu %10llu %12.1f %12.1f %12.1f %12.1f", lock_name(site, name, sizeof(name)),
+			__atomic_load_n(&site->acquired, __ATOMIC_RELAXED), __atomic_load_n(&site->contended, __ATOMIC_RELAXED),
+			__atomic_load_n(&site->wait, __ATOMIC_RELAXED) * 1e6 / TICS_PER_SEC, __atomic_load_n(&site->wait_max, __ATOMIC_RELAXED) * 1e6 / TICS_PER_SEC,
+			__atomic_load_n(&site->hold, __ATOMIC_RELAXED) * 1e6 / TICS_PER_SEC, __atomic_load_n(&site->hold_max, __ATOMIC_RELAXED) * 1e6 / TICS_PER_SEC);
+		emit(context, line);
+	}
+	tic_get(&tic);
+	elapsed = __atomic_load_n(&lock_start, __ATOMIC_RELAXED) ? (double)(tic - lock_start) / TICS_PER_SEC : 0;
+	snprintf(line, sizeof(line), "Lock wait %.3f ms (%.4f%%), hold %.3f ms (%.4f%%) in %.1f s",
+		wait * 1e3 / TICS_PER_SEC, elapsed > 0 ? wait * 1e2 / TICS_PER_SEC / elapsed : 0,
+		hold * 1e3 / TICS_PER_SEC, elapsed > 0 ? hold * 1e2 / TICS_PER_SEC / elapsed : 0, elapsed);
+	emit(context, line);
+	snprintf(line, sizeof(line), "%-40s %10s %10s %10s %10s %10s",
+		"Condition (first wait)", "signals", "waits", "wakeups", "spurious", "timeouts");
+	emit(context, line);
+	for (i = 0; i < LOCK_PROFILE_CONDS; i++)
+	{
+		const lock_cond_t *const slot = &lock_conds[i];
+		const lock_site_t *const first = __atomic_load_n(&slot->site, __ATOMIC_RELAXED);
+		/* signaled without waiters is not worth a line */
+		if (!first)
+			continue;
+		snprintf(line, sizeof(line), "%-40s %10llu %10llu %10llu %10llu %10llu", lock_name(first, name, sizeof(name)),
+			__atomic_load_n(&slot->signals, __ATOMIC_RELAXED), __atomic_load_n(&slot->waits, __ATOMIC_RELAXED),
+			__atomic_load_n(&slot->wakeups, __ATOMIC_RELAXED), __atomic_load_n(&slot->spurious, __ATOMIC_RELAXED),
+			__atomic_load_n(&slot->timeouts, __ATOMIC_RELAXED));
+		emit(context, line);
+	}
+}
+
+#endif
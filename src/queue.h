@@ -0,0 +1,79 @@
+#ifndef INC_QUEUE_H
+#define INC_QUEUE_H
+
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * Bounded single-producer/single-consumer ring queue.
+ *
+ * Exactly one thread may push and exactly one thread may pop. The size must
+ * be a power of two. queue_push() reports the empty to non-empty transition
+ * so the producer only has to wake the consumer when it may be waiting; the
+ * consumer re-checks queue_empty() under its wait mutex before sleeping.
+ */
+
+#define QUEUE_CACHE_LINE 64
+
+typedef struct _queue_t {
+	unsigned head __attribute__((aligned(QUEUE_CACHE_LINE))); /* consumer */
+	unsigned tail __attribute__((aligned(QUEUE_CACHE_LINE))); /* producer */
+	unsigned hwm, overflows; /* producer */
+	unsigned char *const buf __attribute__((aligned(QUEUE_CACHE_LINE)));
+	const size_t elem_size;
+	const unsigned mask;
+} queue_t;
+
+#define queue_initializer(_buf, _size) { \
+	.head = 0, .tail = 0, .hwm = 0, .overflows = 0, \
+	.buf = (unsigned char *)(_buf), .elem_size = sizeof(*(_buf)), .mask = (_size) - 1 }
+
+/* Returns 1 if the queue was empty before, 0 if not and -1 on overflow. */
+static inline int queue_push(queue_t *const queue, const void *const elem)
+{
+	const unsigned tail = queue->tail;
+	unsigned head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE), count;
+	if (tail - head > queue->mask)
+	{
+		__atomic_store_n(&queue->overflows, queue->overflows + 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+	memcpy(queue->buf + (tail & queue->mask) * queue->elem_size, elem, queue->elem_size);
+	__atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+	/* pairs with the fence in queue_empty() */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+	if ((count = tail + 1 - head) > queue->hwm)
+		__atomic_store_n(&queue->hwm, count, __ATOMIC_RELAXED);
+	return head == tail;
+}
+
+/* Returns 1 if an element was popped, 0 if the queue is empty. */
+static inline int queue_pop(queue_t *const queue, void *const elem)
+{
+	const unsigned head = queue->head;
+	if (head == __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE))
+		return 0;
+	memcpy(elem, queue->buf + (head & queue->mask) * queue->elem_size, queue->elem_size);
+	__atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* Consumer side emptiness check, to be evaluated before waiting. */
+static inline int queue_empty(queue_t *const queue)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return queue->head == __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+}
+
+static inline unsigned queue_hwm(const queue_t *const queue)
+{
+	return __atomic_load_n(&queue->hwm, __ATOMIC_RELAXED);
+}
+
+static inline unsigned queue_overflows(const queue_t *const queue)
+{
+	return __atomic_load_n(&queue->overflows, __ATOMIC_RELAXED);
+}
+
+#endif
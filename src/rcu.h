@@ -0,0 +1,59 @@
+#ifndef INC_RCU_H
+#define INC_RCU_H
+
+#include "api.h"
+
+/*
+ * Quiescent-state based read-copy-update.
+ *
+ * Readers access published pointers without locks while online and announce
+ * quiescent states between events, i.e. points at which they hold no
+ * references. Before blocking they go offline, which counts as quiescent for
+ * as long as they stay blocked. A writer publishes the new pointer, waits in
+ * rcu_synchronize() until every reader passed a quiescent state and frees
+ * the old object afterwards. Reader ids are fixed indices below RCU_READERS.
+ */
+
+#define RCU_READERS 4
+#define RCU_OFFLINE (~0ULL)
+#define RCU_CACHE_LINE 64
+
+typedef struct _rcu_t {
+	unsigned long long epoch;
+	struct {
+		unsigned long long epoch __attribute__((aligned(RCU_CACHE_LINE)));
+	} reader[RCU_READERS];
+} rcu_t;
+
+#define rcu_initializer() { \
+	.epoch = 0, .reader = { [0 ... RCU_READERS - 1] = { .epoch = RCU_OFFLINE } } }
+
+/* Announces a quiescent state, also brings an offline reader online. */
+static inline void rcu_quiescent(rcu_t *const rcu, const unsigned id)
+{
+	__atomic_store_n(&rcu->reader[id].epoch, __atomic_load_n(&rcu->epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+}
+
+static inline void rcu_online(rcu_t *const rcu, const unsigned id)
+{
+	rcu_quiescent(rcu, id);
+}
+
+static inline void rcu_offline(rcu_t *const rcu, const unsigned id)
+{
+	__atomic_store_n(&rcu->reader[id].epoch, RCU_OFFLINE, __ATOMIC_SEQ_CST);
+}
+
+/* Returns once every reader passed a quiescent state after the call. */
+static inline void rcu_synchronize(rcu_t *const rcu)
+{
+	const unsigned long long epoch = __atomic_add_fetch(&rcu->epoch, 1, __ATOMIC_SEQ_CST);
+	unsigned i;
+	for (i = 0; i < RCU_READERS; i++)
+	{
+		while (__atomic_load_n(&rcu->reader[i].epoch, __ATOMIC_SEQ_CST) < epoch)
+			sleep_ms(1);
+	}
+}
+
+#endif
@@ -0,0 +1,244 @@
+#include "remote.h"
+#include "transport.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef API_WIN
+#	include <errno.h>
+#	include <poll.h>
+#	include <unistd.h>
+#	include <sys/socket.h>
+#	include <sys/un.h>
+#endif
+
+#define REMOTE_REPLY_SIZE 256
+
+#ifndef API_WIN
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static void remote_accept(remote_t *const remote);
+static void remote_drop(remote_client_t *const client);
+static void remote_read(remote_client_t *const client, const remote_command_t command, void *const context);
+static int remote_send(remote_client_t *const client, const char *const format, va_list args);
+
+#ifdef __cplusplus
+}
+#endif
+
+/* A connection beyond REMOTE_CLIENTS is closed right away. */
+static void remote_accept(remote_t *const remote)
+{
+	const remote_client_t init = remote_client_initializer();
+	unsigned i;
+	int fd;
+	if ((fd = accept4(remote->fd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0)
+		return;
+	for (i = 0; i < REMOTE_CLIENTS; i++)
+	{
+		if (remote->clients[i].fd < 0)
+		{
+			remote->clients[i] = init;
+			remote->clients[i].fd = fd;
+			return;
+		}
+	}
+	close(fd);
+}
+
+static void remote_drop(remote_client_t *const client)
+{
+	if (client->fd < 0)
+		return;
+	close(client->fd);
+	client->fd = -1;
+	client->subscribed = 0;
+}
+
+/* Runs the complete lines received, an overlong line drops the client. */
+static void remote_read(remote_client_t *const client, const remote_command_t command, void *const context)
+{
+	for (;;)
+	{
+		char *end;
+		ssize_t rcvd;
+		if ((rcvd = recv(client->fd, client->line + client->len, sizeof(client->line) - client->len, 0)) <= 0)
+		{
+			if (!rcvd || ((errno != EAGAIN) && (errno != EINTR)))
+				remote_drop(client);
+			return;
+		}
+		client->len += rcvd;
+		while ((client->fd >= 0) && (end = memchr(client->line, '\n', client->len)))
+		{
+			const size_t len = end - client->line + 1;
+			*end = 0;
+			if ((end > client->line) && (end[-1] == '\r'))
+				end[-1] = 0;
+			command(context, client, client->line);
+			memmove(client->line, client->line + len, client->len - len);
+			client->len -= len;
+		}
+		if (client->fd < 0)
+			return;
+		if (client->len == sizeof(client->line))
+		{
+			remote_drop(client);
+			return;
+		}
+	}
+}
+
+/* A reply either fits the socket buffer or its client is too slow to keep. */
+static int remote_send(remote_client_t *const client, const char *const format, va_list args)
+{
+	char buf[REMOTE_REPLY_SIZE];
+	ssize_t result;
+	int len;
+	if (client->fd < 0)
+		return -1;
+	if ((len = vsnprintf(buf, sizeof(buf), format, args)) < 0)
+		return -1;
+	if ((size_t)len >= sizeof(buf))
+		len = sizeof(buf) - 1;
+	while (((result = send(client->fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL)) < 0) && (errno == EINTR))
+		;
+	if (result != len)
+	{
+		remote_drop(client);
+		return -1;
+	}
+	return 0;
+}
+
+#endif
+
+int remote_listen(remote_t *const remote, const char *const path)
+{
+#ifdef API_WIN
+	(void)(remote);
+	(void)(path);
+	return -1;
+#else
+	struct sockaddr_un sa;
+	int err;
+	if (strlen(path) >= sizeof(sa.sun_path))
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+	if ((remote->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+	if (unix_socket_stale(path) || bind(remote->fd, (const struct sockaddr *)&sa, sizeof(sa)) || listen(remote->fd, REMOTE_CLIENTS))
+		goto exit0;
+	return 0;
+exit0:
+	err = errno;
+	close(remote->fd);
+	remote->fd = -1;
+	errno = err;
+	return -1;
+#endif
+}
+
+int remote_poll(remote_t *const remote, const int *const fds, const unsigned count, const remote_command_t command, void *const context)
+{
+#ifdef API_WIN
+	(void)(remote);
+	(void)(fds);
+	(void)(count);
+	(void)(command);
+	(void)(context);
+	return -1;
+#else
+	struct pollfd pfds[REMOTE_FDS + 1 + REMOTE_CLIENTS];
+	unsigned i;
+	int ready = 0;
+	if (count > REMOTE_FDS)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	/* negative descriptors of unused client slots are ignored by poll */
+	for (i = 0; i < count; i++)
+		pfds[i] = (struct pollfd){ .fd = fds[i], .events = POLLIN };
+	pfds[count] = (struct pollfd){ .fd = remote->fd, .events = POLLIN };
+	for (i = 0; i < REMOTE_CLIENTS; i++)
+		pfds[count + 1 + i] = (struct pollfd){ .fd = remote->clients[i].fd, .events = POLLIN };
+	if (poll(pfds, count + 1 + REMOTE_CLIENTS, -1/*timeout*/) < 0)
+		return errno == EINTR ? 0 : -1;
+	for (i = 0; i < count; i++)
+	{
+		if (pfds[i].revents & POLLIN)
+			ready |= 1 << i;
+	}
+	for (i = 0; i < REMOTE_CLIENTS; i++)
+	{
+		remote_client_t *const client = &remote->clients[i];
+		if ((client->fd >= 0) && (client->fd == pfds[count + 1 + i].fd) && pfds[count + 1 + i].revents)
+			remote_read(client, command, context);
+	}
+	if (pfds[count].revents & POLLIN)
+		remote_accept(remote);
+	return ready;
+#endif
+}
+
+int remote_reply(remote_client_t *const client, const char *const format, ...)
+{
+#ifdef API_WIN
+	(void)(client);
+	(void)(format);
+	return -1;
+#else
+	va_list args;
+	int result;
+	va_start(args, format);
+	result = remote_send(client, format, args);
+	va_end(args);
+	return result;
+#endif
+}
+
+void remote_broadcast(remote_t *const remote, const char *const format, ...)
+{
+#ifdef API_WIN
+	(void)(remote);
+	(void)(format);
+#else
+	unsigned i;
+	for (i = 0; i < REMOTE_CLIENTS; i++)
+	{
+		va_list args;
+		if (!remote->clients[i].subscribed)
+			continue;
+		va_start(args, format);
+		remote_send(&remote->clients[i], format, args);
+		va_end(args);
+	}
+#endif
+}
+
+void remote_close(remote_t *const remote, const char *const path)
+{
+#ifdef API_WIN
+	(void)(remote);
+	(void)(path);
+#else
+	unsigned i;
+	if (remote->fd < 0)
+		return;
+	for (i = 0; i < REMOTE_CLIENTS; i++)
+		remote_drop(&remote->clients[i]);
+	close(remote->fd);
+	remote->fd = -1;
+	unlink(path);
+#endif
+}
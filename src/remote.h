@@ -0,0 +1,68 @@
+#ifndef INC_REMOTE_H
+#define INC_REMOTE_H
+
+#include <stddef.h>
+
+/*
+ * Line based control socket.
+ *
+ * A Unix stream socket that takes commands of one line each from up to
+ * REMOTE_CLIENTS local connections. The serving thread waits for the socket
+ * and its clients together with descriptors of its own. Replies are sent
+ * without blocking, a client that does not keep up is dropped; the thread
+ * therefore never holds anything the MIDI path could wait for.
+ */
+
+#define REMOTE_CLIENTS 8
+#define REMOTE_LINE_SIZE 128 /*longest command*/
+#define REMOTE_FDS 4 /*extra descriptors of remote_poll()*/
+
+typedef struct _remote_client_t {
+	int fd;
+	unsigned subscribed;
+	size_t len;
+	char line[REMOTE_LINE_SIZE];
+} remote_client_t;
+
+typedef struct _remote_t {
+	int fd;
+	remote_client_t clients[REMOTE_CLIENTS];
+} remote_t;
+
+#define remote_client_initializer() { \
+	.fd = -1, .subscribed = 0, .len = 0, .line = { 0 } }
+
+#define remote_initializer() { \
+	.fd = -1, .clients = { [0 ... REMOTE_CLIENTS - 1] = remote_client_initializer() } }
+
+/* Runs one command line, the line feed is stripped. */
+typedef void (*remote_command_t)(void *const context, remote_client_t *const client, char *const line);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Listens on a Unix socket path, returns 0 or -1. */
+int remote_listen(remote_t *const remote, const char *const path);
+
+/*
+ * Waits for connections, command lines and the count extra descriptors.
+ * Commands are run before returning. Returns the mask of the readable
+ * extra descriptors or -1 if the wait failed.
+ */
+int remote_poll(remote_t *const remote, const int *const fds, const unsigned count, const remote_command_t command, void *const context);
+
+/* Sends a formatted reply, a client that would block is dropped. Returns 0 or -1. */
+int remote_reply(remote_client_t *const client, const char *const format, ...) __attribute__((format(printf, 2, 3)));
+
+/* Sends a formatted line to every subscribed client. */
+void remote_broadcast(remote_t *const remote, const char *const format, ...) __attribute__((format(printf, 2, 3)));
+
+/* Drops the clients and removes the socket. */
+void remote_close(remote_t *const remote, const char *const path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,861 @@
+#include "rtpmidi.h"
+
+#include <string.h>
+
+#ifndef API_WIN
+
+#include "api.h"
+#include "midi.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+
+#define RTPMIDI_SIGNATURE 0xffff
+#define RTPMIDI_VERSION 2
+#define RTPMIDI_NEVER 0x7fffffffffffffffLL
+#define RTPMIDI_SESSION_SIZE 64 /*bytes of a session command*/
+
+#define rtpmidi_ms(_ms) ((tic_t)(_ms) * TICS_PER_SEC / 1000LL)
+#define rtpmidi_unit (TICS_PER_SEC / RTPMIDI_RATE)
+
+enum _rtpmidi_state_t {
+	RTPMIDI_IDLE, /* responder without session */
+	RTPMIDI_INVITE_CONTROL, /* initiator, waiting for the control port */
+	RTPMIDI_INVITE_DATA, /* waiting for the data port */
+	RTPMIDI_CONNECTED
+};
+
+enum _rtpmidi_socket_t {
+	RTPMIDI_CONTROL,
+	RTPMIDI_DATA,
+	RTPMIDI_SOCKETS
+};
+
+/* Header of a buffered command, followed by its bytes. */
+typedef struct _rtpmidi_play_t {
+	tic_t due;
+	unsigned len;
+} rtpmidi_play_t;
+
+/*
+ * The reader runs the session and fills the playout buffer, the writer only
+ * sends. The state and the peer are changed by the reader under the mutex,
+ * the writer copies them under it.
+ */
+struct _transport_rtpmidi_t {
+	int sock[RTPMIDI_SOCKETS], tfd;
+	unsigned initiator, ssrc, token;
+	mutex_t mutex;
+	unsigned state, peer_ssrc;
+	struct sockaddr_in peer[RTPMIDI_SOCKETS];
+	/* reader */
+	tic_t playout, armed, invite, sync, feedback, heard;
+	unsigned syncs, synced, transit_valid, seq_valid, feedback_due;
+	long long offset; /* peer minus local clock, RTPMIDI_RATE units */
+	int transit_min;
+	unsigned short seq_next, seq_last;
+	unsigned play_head, play_tail, play_off;
+	unsigned char play[RTPMIDI_PLAYOUT_SIZE];
+	/* writer */
+	unsigned short seq;
+	midi_parser_t parser;
+	size_t sysex_len, list_len;
+	unsigned char sysex[RTPMIDI_PACKET_SIZE];
+	unsigned char packet[RTPMIDI_PACKET_SIZE];
+};
+
+static tic_t rtpmidi_delay = 0;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static int rtpmidi_open(transport_t *const transport, const char *const path);
+static ssize_t rtpmidi_read(transport_t *const transport, unsigned char *const buf, const size_t size);
+static ssize_t rtpmidi_write(transport_t *const transport, const unsigned char *const buf, const size_t len);
+static int rtpmidi_fd(const transport_t *const transport);
+static void rtpmidi_close(transport_t *const transport);
+
+static int rtpmidi_bind(const unsigned port);
+static void rtpmidi_send(transport_rtpmidi_t *const r, const unsigned sock, const struct sockaddr_in *const to, const unsigned char *const buf, const size_t len);
+static void rtpmidi_command(transport_rtpmidi_t *const r, const unsigned sock, const struct sockaddr_in *const to, const char *const cmd);
+static void rtpmidi_clock(transport_rtpmidi_t *const r, const unsigned count, const unsigned long long *const ts);
+static void rtpmidi_set_state(transport_rtpmidi_t *const r, const unsigned state);
+static void rtpmidi_session(transport_rtpmidi_t *const r, const unsigned sock, const unsigned char *const buf, const size_t len, const struct sockaddr_in *const from, const tic_t now);
+static void rtpmidi_data(transport_rtpmidi_t *const r, const unsigned char *const buf, const size_t len, const tic_t now);
+static void rtpmidi_journal(transport_rtpmidi_t *const r, const unsigned char *const buf, const size_t len, const tic_t due);
+static tic_t rtpmidi_due(transport_rtpmidi_t *const r, const unsigned ts, const tic_t now);
+static void rtpmidi_tick(transport_rtpmidi_t *const r, const tic_t now);
+static void rtpmidi_peek(const transport_rtpmidi_t *const r, rtpmidi_play_t *const play);
+static void rtpmidi_play(transport_rtpmidi_t *const r, const tic_t due, const unsigned char *const buf, const unsigned len);
+static int rtpmidi_emit(void *const context, const midi_event_t *const event);
+static void rtpmidi_append(transport_rtpmidi_t *const r, const unsigned char *const buf, const size_t len);
+static void rtpmidi_flush(transport_rtpmidi_t *const r);
+
+#ifdef __cplusplus
+}
+#endif
+
+const transport_ops_t TRANSPORT_RTPMIDI =
+{
+	.name = "rtpmidi", .nonblock = 1,
+	.open = &rtpmidi_open, .read = &rtpmidi_read, .write = &rtpmidi_write, .fd = &rtpmidi_fd, .fd_out = &rtpmidi_fd, .close = &rtpmidi_close,
+};
+
+static inline unsigned rtpmidi_get16(const unsigned char *const buf)
+{
+	return buf[0] << 8 | buf[1];
+}
+
+static inline unsigned rtpmidi_get32(const unsigned char *const buf)
+{
+	return (unsigned)buf[0] << 24 | buf[1] << 16 | buf[2] << 8 | buf[3];
+}
+
+static inline unsigned long long rtpmidi_get64(const unsigned char *const buf)
+{
+	return (unsigned long long)rtpmidi_get32(buf) << 32 | rtpmidi_get32(buf + 4);
+}
+
+static inline void rtpmidi_put16(unsigned char *const buf, const unsigned value)
+{
+	buf[0] = value >> 8;
+	buf[1] = value;
+}
+
+static inline void rtpmidi_put32(unsigned char *const buf, const unsigned value)
+{
+	rtpmidi_put16(buf, value >> 16);
+	rtpmidi_put16(buf + 2, value);
+}
+
+static inline void rtpmidi_put64(unsigned char *const buf, const unsigned long long value)
+{
+	rtpmidi_put32(buf, value >> 32);
+	rtpmidi_put32(buf + 4, value);
+}
+
+/* Session clock in RTPMIDI_RATE units. */
+static inline unsigned long long rtpmidi_now(const tic_t tic)
+{
+	return tic / rtpmidi_unit;
+}
+
+void rtpmidi_playout(const unsigned ms)
+{
+	rtpmidi_delay = rtpmidi_ms(ms < RTPMIDI_PLAYOUT_MAX ? ms : RTPMIDI_PLAYOUT_MAX);
+}
+
+static int rtpmidi_bind(const unsigned port)
+{
+	struct sockaddr_in sa;
+	int fd, err;
+	if ((fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	sa.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(fd, (const struct sockaddr *)&sa, sizeof(sa)))
+	{
+		err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	return fd;
+}
+
+static int rtpmidi_open(transport_t *const transport, const char *const path)
+{
+	const char *const slash = strrchr(path, '/');
+	const char *const port_str = slash ? slash + 1 : path;
+	transport_rtpmidi_t *r;
+	unsigned long port;
+	char *end;
+	unsigned i;
+	tic_t tic;
+	int err;
+	port = strtoul(port_str, &end, 10);
+	if ((end == port_str) || *end || !port || (port >= 0xffff))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	if (!(r = (transport_rtpmidi_t *)malloc(sizeof(*r))))
+		return -1;
+	memset(r, 0, sizeof(*r));
+	r->sock[RTPMIDI_CONTROL] = r->sock[RTPMIDI_DATA] = r->tfd = transport->fd = -1;
+	mutex_init(&r->mutex);
+	tic_get(&tic);
+	r->ssrc = (unsigned)tic ^ (unsigned)getpid() << 16;
+	r->token = (unsigned)(tic >> 16) ^ (unsigned)getpid();
+	r->seq = (unsigned short)tic;
+	r->playout = rtpmidi_delay;
+	r->armed = r->invite = r->sync = r->feedback = RTPMIDI_NEVER;
+	r->parser = (midi_parser_t)midi_parser_initializer();
+	if (slash)
+	{
+		/* the initiator sends from ephemeral ports, the peer answers to them */
+		char host[NI_MAXHOST];
+		struct addrinfo hints, *info;
+		if ((size_t)(slash - path) >= sizeof(host))
+		{
+			errno = ENAMETOOLONG;
+			goto exit0;
+		}
+		memcpy(host, path, slash - path);
+		host[slash - path] = 0;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_DGRAM;
+		if (getaddrinfo(host, 0, &hints, &info))
+		{
+			errno = EHOSTUNREACH;
+			goto exit0;
+		}
+		memcpy(&r->peer[RTPMIDI_CONTROL], info->ai_addr, sizeof(r->peer[RTPMIDI_CONTROL]));
+		freeaddrinfo(info);
+		r->peer[RTPMIDI_CONTROL].sin_port = htons(port);
+		r->peer[RTPMIDI_DATA] = r->peer[RTPMIDI_CONTROL];
+		r->peer[RTPMIDI_DATA].sin_port = htons(port + 1);
+		r->initiator = 1;
+		r->state = RTPMIDI_INVITE_CONTROL;
+		r->invite = tic;
+		port = 0;
+	}
+	else
+		r->state = RTPMIDI_IDLE;
+	for (i = 0; i < RTPMIDI_SOCKETS; i++)
+	{
+		if ((r->sock[i] = rtpmidi_bind(port ? port + i : 0)) < 0)
+			goto exit0;
+	}
+	if (((r->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) ||
+		((transport->fd = epoll_create1(EPOLL_CLOEXEC)) < 0))
+		goto exit0;
+	for (i = 0; i <= RTPMIDI_SOCKETS; i++)
+	{
+		struct epoll_event ev = { .events = EPOLLIN, .data.u32 = i };
+		if (epoll_ctl(transport->fd, EPOLL_CTL_ADD, i < RTPMIDI_SOCKETS ? r->sock[i] : r->tfd, &ev))
+			goto exit0;
+	}
+	transport->rtpmidi = r;
+	/* sends the first invitation */
+	rtpmidi_tick(r, tic);
+	return 0;
+
+exit0:
+	err = errno;
+	if (transport->fd >= 0)
+		close(transport->fd);
+	transport->fd = -1;
+	if (r->tfd >= 0)
+		close(r->tfd);
+	for (i = 0; i < RTPMIDI_SOCKETS; i++)
+	{
+		if (r->sock[i] >= 0)
+			close(r->sock[i]);
+	}
+	mutex_destroy(&r->mutex);
+	free(r);
+	errno = err;
+	return -1;
+}
+
+static void rtpmidi_send(transport_rtpmidi_t *const r, const unsigned sock, const struct sockaddr_in *const to, const unsigned char *const buf, const size_t len)
+{
+	/* a full socket buffer drops the datagram, it is never waited for */
+	while ((sendto(r->sock[sock], buf, len, MSG_DONTWAIT | MSG_NOSIGNAL, (const struct sockaddr *)to, sizeof(*to)) < 0) && (errno == EINTR))
+		;
+}
+
+/* Sends an invitation, acceptance, rejection or bye. */
+static void rtpmidi_command(transport_rtpmidi_t *const r, const unsigned sock, const struct sockaddr_in *const to, const char *const cmd)
+{
+	unsigned char buf[RTPMIDI_SESSION_SIZE];
+	size_t len = 16;
+	rtpmidi_put16(buf, RTPMIDI_SIGNATURE);
+	buf[2] = cmd[0];
+	buf[3] = cmd[1];
+	rtpmidi_put32(buf + 4, RTPMIDI_VERSION);
+	rtpmidi_put32(buf + 8, r->token);
+	rtpmidi_put32(buf + 12, r->ssrc);
+	if (strcmp(cmd, "BY"))
+	{
+		memcpy(buf + len, RTPMIDI_NAME, sizeof(RTPMIDI_NAME));
+		len += sizeof(RTPMIDI_NAME);
+	}
+	rtpmidi_send(r, sock, to, buf, len);
+}
+
+/* Sends clock synchronization step count with the time stamps so far. */
+static void rtpmidi_clock(transport_rtpmidi_t *const r, const unsigned count, const unsigned long long *const ts)
+{
+	unsigned char buf[36];
+	unsigned i;
+	memset(buf, 0, sizeof(buf));
+	rtpmidi_put16(buf, RTPMIDI_SIGNATURE);
+	buf[2] = 'C';
+	buf[3] = 'K';
+	rtpmidi_put32(buf + 4, r->ssrc);
+	buf[8] = count;
+	for (i = 0; i < 3; i++)
+		rtpmidi_put64(buf + 12 + 8 * i, ts[i]);
+	rtpmidi_send(r, RTPMIDI_DATA, &r->peer[RTPMIDI_DATA], buf, sizeof(buf));
+}
+
+/* A new session starts with a fresh sequence, clock and playout state. */
+static void rtpmidi_set_state(transport_rtpmidi_t *const r, const unsigned state)
+{
+	mutex_lock(&r->mutex);
+	r->state = state;
+	mutex_unlock(&r->mutex);
+	if (state != RTPMIDI_CONNECTED)
+		return;
+	r->syncs = r->synced = r->transit_valid = r->seq_valid = r->feedback_due = 0;
+	r->sync = r->initiator ? r->heard : RTPMIDI_NEVER;
+	r->feedback = RTPMIDI_NEVER;
+}
+
+static void rtpmidi_session(transport_rtpmidi_t *const r, const unsigned sock, const unsigned char *const buf, const size_t len, const struct sockaddr_in *const from, const tic_t now)
+{
+	const unsigned cmd = rtpmidi_get16(buf + 2);
+	if ((cmd == ('I' << 8 | 'N')) && (len >= 16))
+	{
+		const unsigned ssrc = rtpmidi_get32(buf + 12);
+		/* one session, a peer may renew its own */
+		if (r->initiator || ((r->state != RTPMIDI_IDLE) && (ssrc != r->peer_ssrc)) ||
+			((sock == RTPMIDI_DATA) && (r->state == RTPMIDI_IDLE)))
+		{
+			rtpmidi_command(r, sock, from, "NO");
+			return;
+		}
+		mutex_lock(&r->mutex);
+		r->peer_ssrc = ssrc;
+		r->peer[sock] = *from;
+		mutex_unlock(&r->mutex);
+		/* the acceptance echoes the token of the invitation */
+		r->token = rtpmidi_get32(buf + 8);
+		rtpmidi_command(r, sock, from, "OK");
+		r->heard = now;
+		rtpmidi_set_state(r, sock == RTPMIDI_CONTROL ? RTPMIDI_INVITE_DATA : RTPMIDI_CONNECTED);
+	}
+	else if ((cmd == ('O' << 8 | 'K')) && (len >= 16))
+	{
+		if (!r->initiator || (rtpmidi_get32(buf + 8) != r->token))
+			return;
+		r->heard = now;
+		if ((sock == RTPMIDI_CONTROL) && (r->state == RTPMIDI_INVITE_CONTROL))
+		{
+			mutex_lock(&r->mutex);
+			r->peer_ssrc = rtpmidi_get32(buf + 12);
+			mutex_unlock(&r->mutex);
+			rtpmidi_set_state(r, RTPMIDI_INVITE_DATA);
+			r->invite = now;
+		}
+		else if ((sock == RTPMIDI_DATA) && (r->state == RTPMIDI_INVITE_DATA))
+		{
+			rtpmidi_set_state(r, RTPMIDI_CONNECTED);
+			r->invite = RTPMIDI_NEVER;
+		}
+	}
+	else if ((cmd == ('B' << 8 | 'Y')) && (len >= 16))
+	{
+		if ((r->state == RTPMIDI_IDLE) || (rtpmidi_get32(buf + 12) != r->peer_ssrc))
+			return;
+		rtpmidi_set_state(r, r->initiator ? RTPMIDI_INVITE_CONTROL : RTPMIDI_IDLE);
+		r->invite = r->initiator ? now + rtpmidi_ms(RTPMIDI_INVITE_PERIOD) : RTPMIDI_NEVER;
+	}
+	else if ((cmd == ('C' << 8 | 'K')) && (len >= 36))
+	{
+		const unsigned long long clock = rtpmidi_now(now);
+		unsigned long long ts[3];
+		unsigned i;
+		if ((r->state != RTPMIDI_CONNECTED) || (rtpmidi_get32(buf + 4) != r->peer_ssrc))
+			return;
+		for (i = 0; i < 3; i++)
+			ts[i] = rtpmidi_get64(buf + 12 + 8 * i);
+		r->heard = now;
+		switch (buf[8])
+		{
+			case 0:
+				ts[1] = clock;
+				rtpmidi_clock(r, 1, ts);
+				break;
+			case 1:
+				/* the reply arrived half a round trip after the peer stamped it */
+				ts[2] = clock;
+				rtpmidi_clock(r, 2, ts);
+				r->offset = (long long)(ts[1] - (ts[0] + ts[2]) / 2);
+				r->synced = 1;
+				break;
+			case 2:
+				r->offset = (long long)((ts[0] + ts[2]) / 2 - ts[1]);
+				r->synced = 1;
+				break;
+			default:
+				break;
+		}
+	}
+	/* receiver feedback only trims journals, none are sent */
+}
+
+/* Maps a sender time stamp to the local due time, never before now and never past the playout delay. */
+static tic_t rtpmidi_due(transport_rtpmidi_t *const r, const unsigned ts, const tic_t now)
+{
+	const unsigned clock = rtpmidi_now(now);
+	int age;
+	tic_t due;
+	if (r->synced)
+		age = (int)(clock - (ts - (unsigned)r->offset));
+	else
+	{
+		/* the fastest packet so far defines the offset */
+		const int transit = (int)(clock - ts);
+		if (!r->transit_valid || (transit < r->transit_min))
+		{
+			r->transit_min = transit;
+			r->transit_valid = 1;
+		}
+		age = transit - r->transit_min;
+	}
+	due = now - (tic_t)age * rtpmidi_unit + r->playout;
+	if (due < now)
+		return now;
+	return due < now + r->playout ? due : now + r->playout;
+}
+
+static void rtpmidi_data(transport_rtpmidi_t *const r, const unsigned char *const buf, const size_t len, const tic_t now)
+{
+	unsigned short seq;
+	unsigned ts, delta = 0, flags, first = 1;
+	unsigned char running = 0;
+	size_t pos, end;
+	int gap;
+	if ((len < 13) || ((buf[0] >> 6) != RTPMIDI_VERSION) || (r->state != RTPMIDI_CONNECTED) || (rtpmidi_get32(buf + 8) != r->peer_ssrc))
+		return;
+	seq = rtpmidi_get16(buf + 2);
+	ts = rtpmidi_get32(buf + 4);
+	pos = 12 + 4 * (buf[0] & 0x0f);
+	if ((buf[0] & 0x10) && (pos + 4 <= len))
+		pos += 4 + 4 * rtpmidi_get16(buf + pos + 2);
+	if (pos >= len)
+		return;
+	flags = buf[pos];
+	if (flags & 0x80)
+	{
+		if (pos + 2 > len)
+			return;
+		end = pos + 2 + ((flags & 0x0f) << 8 | buf[pos + 1]);
+		pos += 2;
+	}
+	else
+		end = ++pos + (flags & 0x0f);
+	if (end > len)
+		return;
+	r->heard = now;
+	gap = r->seq_valid ? (short)(seq - r->seq_next) : 0;
+	if (gap < 0)
+		return;
+	r->seq_next = seq + 1;
+	r->seq_last = seq;
+	r->seq_valid = 1;
+	if (!r->feedback_due)
+	{
+		r->feedback_due = 1;
+		if (r->feedback == RTPMIDI_NEVER)
+			r->feedback = now + rtpmidi_ms(RTPMIDI_FEEDBACK_PERIOD);
+	}
+	if (gap && (flags & 0x40))
+		rtpmidi_journal(r, buf + end, len - end, rtpmidi_due(r, ts, now));
+	while (pos < end)
+	{
+		unsigned char cmd[3], status;
+		unsigned need, i;
+		/* the first command has a delta time only with Z */
+		if (!first || (flags & 0x20))
+		{
+			unsigned value = 0;
+			for (i = 0; (i < 4) && (pos < end); i++)
+			{
+				value = value << 7 | (buf[pos] & 0x7f);
+				if (!(buf[pos++] & 0x80))
+					break;
+			}
+			delta += value;
+		}
+		first = 0;
+		if (pos >= end)
+			break;
+		if (buf[pos] & 0x80)
+			status = buf[pos++];
+		else if (!(status = running))
+			break;
+		if ((status == 0xf0) || (status == 0xf7))
+		{
+			/* a SysEx segment ends with 0xf7, 0xf0 (continued) or 0xf4 (cancelled) */
+			unsigned char sysex[RTPMIDI_PACKET_SIZE];
+			const size_t start = pos;
+			size_t n = 0;
+			while ((pos < end) && !(buf[pos] & 0x80))
+				pos++;
+			if (pos >= end)
+				break;
+			/* continuation markers are dropped, the segments join into one message */
+			if (buf[pos] != 0xf4)
+			{
+				if (status == 0xf0)
+					sysex[n++] = 0xf0;
+				memcpy(sysex + n, buf + start, pos - start);
+				n += pos - start;
+			}
+			/* a cancelled message is still ended for the parser downstream */
+			if ((buf[pos] == 0xf7) || ((buf[pos] == 0xf4) && (status == 0xf7)))
+				sysex[n++] = 0xf7;
+			rtpmidi_play(r, rtpmidi_due(r, ts + delta, now), sysex, n);
+			pos++;
+			running = 0;
+			continue;
+		}
+		if (!(need = midi_length(status)))
+			break;
+		cmd[0] = status;
+		for (i = 1; i < need; i++)
+		{
+			if ((pos >= end) || (buf[pos] & 0x80))
+				return;
+			cmd[i] = buf[pos++];
+		}
+		if (status < 0xf0)
+			running = status;
+		else if (status < 0xf8)
+			running = 0;
+		rtpmidi_play(r, rtpmidi_due(r, ts + delta, now), cmd, need);
+	}
+}
+
+/*
+ * Replays the program and controller state of the channel journals. Entries
+ * with the A flag (toggle or count encodings) and other chapters are skipped.
+ */
+static void rtpmidi_journal(transport_rtpmidi_t *const r, const unsigned char *const buf, const size_t len, const tic_t due)
+{
+	unsigned chans, i;
+	size_t pos = 3;
+	if (len < 3)
+		return;
+	if (buf[0] & 0x40)
+	{
+		/* system journal, its length includes its header */
+		if (pos + 2 > len)
+			return;
+		pos += rtpmidi_get16(buf + pos) & 0x3ff;
+	}
+	if (!(buf[0] & 0x20))
+		return;
+	chans = (buf[0] & 0x0f) + 1;
+	for (i = 0; (i < chans) && (pos + 3 <= len); i++)
+	{
+		const unsigned chan = (buf[pos] >> 3) & 0x0f;
+		const size_t next = pos + ((buf[pos] & 0x03) << 8 | buf[pos + 1]);
+		const unsigned toc = buf[pos + 2];
+		size_t at = pos + 3;
+		if ((next > len) || (next < at))
+			return;
+		if (toc & 0x80)
+		{
+			/* chapter P: program and optional bank */
+			if (at + 3 > next)
+				return;
+			if (buf[at + 1] & 0x80)
+			{
+				const unsigned char msb[3] = { 0xb0 | chan, 0x00, buf[at + 1] & 0x7f };
+				const unsigned char lsb[3] = { 0xb0 | chan, 0x20, buf[at + 2] & 0x7f };
+				rtpmidi_play(r, due, msb, 3);
+				rtpmidi_play(r, due, lsb, 3);
+			}
+			{
+				const unsigned char pc[2] = { 0xc0 | chan, buf[at] & 0x7f };
+				rtpmidi_play(r, due, pc, 2);
+			}
+			at += 3;
+		}
+		if (toc & 0x40)
+		{
+			/* chapter C: last values of controllers */
+			unsigned n, j;
+			if (at + 1 > next)
+				return;
+			n = (buf[at++] & 0x7f) + 1;
+			for (j = 0; (j < n) && (at + 2 <= next); j++, at += 2)
+			{
+				const unsigned char cc[3] = { 0xb0 | chan, buf[at] & 0x7f, buf[at + 1] & 0x7f };
+				if (!(buf[at + 1] & 0x80))
+					rtpmidi_play(r, due, cc, 3);
+			}
+		}
+		pos = next;
+	}
+}
+
+/* Copies the header of the oldest buffered command. */
+static void rtpmidi_peek(const transport_rtpmidi_t *const r, rtpmidi_play_t *const play)
+{
+	unsigned i;
+	for (i = 0; i < sizeof(*play); i++)
+		((unsigned char *)play)[i] = r->play[(r->play_head + i) & (RTPMIDI_PLAYOUT_SIZE - 1)];
+}
+
+/* Queues a command for delivery at due, it is dropped if the buffer is full. */
+static void rtpmidi_play(transport_rtpmidi_t *const r, const tic_t due, const unsigned char *const buf, const unsigned len)
+{
+	const rtpmidi_play_t play = { .due = due, .len = len };
+	const unsigned char *const hdr = (const unsigned char *)&play;
+	unsigned i;
+	if (!len || (sizeof(play) + len > RTPMIDI_PLAYOUT_SIZE - (r->play_tail - r->play_head)))
+		return;
+	for (i = 0; i < sizeof(play); i++)
+		r->play[(r->play_tail + i) & (RTPMIDI_PLAYOUT_SIZE - 1)] = hdr[i];
+	for (i = 0; i < len; i++)
+		r->play[(r->play_tail + sizeof(play) + i) & (RTPMIDI_PLAYOUT_SIZE - 1)] = buf[i];
+	r->play_tail += sizeof(play) + len;
+}
+
+/* Runs the timers of the session and arms the descriptor for the next one or the next due command. */
+static void rtpmidi_tick(transport_rtpmidi_t *const r, const tic_t now)
+{
+	struct itimerspec its = { .it_interval = { 0, 0 }, .it_value = { 0, 0 } };
+	tic_t deadline = RTPMIDI_NEVER;
+	if ((r->state == RTPMIDI_INVITE_DATA || r->state == RTPMIDI_CONNECTED) && (now - r->heard > rtpmidi_ms(RTPMIDI_TIMEOUT)))
+	{
+		/* a peer that went away without a bye */
+		rtpmidi_command(r, RTPMIDI_CONTROL, &r->peer[RTPMIDI_CONTROL], "BY");
+		rtpmidi_set_state(r, r->initiator ? RTPMIDI_INVITE_CONTROL : RTPMIDI_IDLE);
+		r->invite = r->initiator ? now : RTPMIDI_NEVER;
+		r->sync = r->feedback = RTPMIDI_NEVER;
+	}
+	if (r->initiator && (r->state != RTPMIDI_CONNECTED) && (now >= r->invite))
+	{
+		const unsigned sock = r->state == RTPMIDI_INVITE_CONTROL ? RTPMIDI_CONTROL : RTPMIDI_DATA;
+		rtpmidi_command(r, sock, &r->peer[sock], "IN");
+		r->invite = now + rtpmidi_ms(RTPMIDI_INVITE_PERIOD);
+	}
+	if ((r->state == RTPMIDI_CONNECTED) && (now >= r->sync))
+	{
+		const unsigned long long ts[3] = { rtpmidi_now(now), 0, 0 };
+		rtpmidi_clock(r, 0, ts);
+		r->sync = now + rtpmidi_ms(++r->syncs < RTPMIDI_SYNC_FAST ? RTPMIDI_INVITE_PERIOD : RTPMIDI_SYNC_PERIOD);
+	}
+	if ((r->state == RTPMIDI_CONNECTED) && (now >= r->feedback))
+	{
+		unsigned char buf[12];
+		rtpmidi_put16(buf, RTPMIDI_SIGNATURE);
+		buf[2] = 'R';
+		buf[3] = 'S';
+		rtpmidi_put32(buf + 4, r->ssrc);
+		rtpmidi_put32(buf + 8, (unsigned)r->seq_last << 16);
+		rtpmidi_send(r, RTPMIDI_CONTROL, &r->peer[RTPMIDI_CONTROL], buf, sizeof(buf));
+		r->feedback_due = 0;
+		r->feedback = RTPMIDI_NEVER;
+	}
+	if (r->initiator && (r->state != RTPMIDI_CONNECTED) && (r->invite < deadline))
+		deadline = r->invite;
+	if (r->state == RTPMIDI_CONNECTED)
+	{
+		if (r->sync < deadline)
+			deadline = r->sync;
+		if (r->feedback < deadline)
+			deadline = r->feedback;
+	}
+	if ((r->state == RTPMIDI_INVITE_DATA || r->state == RTPMIDI_CONNECTED) && (r->heard + rtpmidi_ms(RTPMIDI_TIMEOUT) + 1 < deadline))
+		deadline = r->heard + rtpmidi_ms(RTPMIDI_TIMEOUT) + 1;
+	if (r->play_head != r->play_tail)
+	{
+		rtpmidi_play_t play;
+		rtpmidi_peek(r, &play);
+		if (play.due < deadline)
+			deadline = play.due;
+	}
+	if (deadline == r->armed)
+		return;
+	if (deadline != RTPMIDI_NEVER)
+	{
+		/* a zero value would disarm, deadlines are never at the clock origin */
+		its.it_value.tv_sec = deadline / TICS_PER_SEC;
+		its.it_value.tv_nsec = deadline % TICS_PER_SEC;
+	}
+	if (!timerfd_settime(r->tfd, TFD_TIMER_ABSTIME, &its, 0))
+		r->armed = deadline;
+}
+
+static ssize_t rtpmidi_read(transport_t *const transport, unsigned char *const buf, const size_t size)
+{
+	transport_rtpmidi_t *const r = transport->rtpmidi;
+	unsigned long long expirations;
+	size_t n = 0;
+	unsigned i;
+	tic_t now;
+	if (read(r->tfd, &expirations, sizeof(expirations)) == sizeof(expirations))
+		r->armed = RTPMIDI_NEVER;
+	for (i = 0; i < RTPMIDI_SOCKETS; i++)
+	{
+		for (;;)
+		{
+			unsigned char pkt[RTPMIDI_PACKET_SIZE];
+			struct sockaddr_in from;
+			socklen_t from_len = sizeof(from);
+			const ssize_t len = recvfrom(r->sock[i], pkt, sizeof(pkt), 0, (struct sockaddr *)&from, &from_len);
+			if (len < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+					break;
+				/* an ICMP error of a peer that went away, the session times out */
+				if (errno == ECONNREFUSED)
+					continue;
+				return -1;
+			}
+			tic_get(&now);
+			if ((len >= 4) && (rtpmidi_get16(pkt) == RTPMIDI_SIGNATURE))
+				rtpmidi_session(r, i, pkt, len, &from, now);
+			else if (i == RTPMIDI_DATA)
+				rtpmidi_data(r, pkt, len, now);
+		}
+	}
+	tic_get(&now);
+	/* due commands in order, a command that does not fit is continued with the next read */
+	while ((r->play_head != r->play_tail) && (n < size))
+	{
+		rtpmidi_play_t play;
+		unsigned len;
+		rtpmidi_peek(r, &play);
+		if (play.due > now)
+			break;
+		len = play.len - r->play_off < size - n ? play.len - r->play_off : size - n;
+		for (i = 0; i < len; i++)
+			buf[n++] = r->play[(r->play_head + sizeof(play) + r->play_off + i) & (RTPMIDI_PLAYOUT_SIZE - 1)];
+		if ((r->play_off += len) < play.len)
+			break;
+		r->play_head += sizeof(play) + play.len;
+		r->play_off = 0;
+	}
+	rtpmidi_tick(r, now);
+	return n;
+}
+
+/* Collects the commands of one write into a packet, SysEx messages are sent once complete. */
+static int rtpmidi_emit(void *const context, const midi_event_t *const event)
+{
+	transport_rtpmidi_t *const r = (transport_rtpmidi_t *)context;
+	unsigned char buf[MIDI_EVENT_SIZE];
+	const unsigned len = midi_unpack(event, buf);
+	if (!(midi_flags(event) & MIDI_EVENT_SYSEX))
+	{
+		/* a SysEx message interrupted by another status is dropped */
+		if (buf[0] < 0xf8)
+			r->sysex_len = 0;
+		rtpmidi_append(r, buf, len);
+		return 0;
+	}
+	if (buf[0] == 0xf0)
+		r->sysex_len = 0;
+	else if (!r->sysex_len)
+		return 0;
+	if (r->sysex_len + len > sizeof(r->sysex))
+	{
+		r->sysex_len = 0;
+		return 0;
+	}
+	memcpy(r->sysex + r->sysex_len, buf, len);
+	r->sysex_len += len;
+	if (buf[len - 1] == 0xf7)
+	{
+		rtpmidi_append(r, r->sysex, r->sysex_len);
+		r->sysex_len = 0;
+	}
+	return 0;
+}
+
+/*
+ * Appends a command to the packet, every command but the first one has a
+ * zero delta time. The list starts after the RTP header and a long command
+ * section header.
+ */
+static void rtpmidi_append(transport_rtpmidi_t *const r, const unsigned char *const buf, const size_t len)
+{
+	const size_t delta = r->list_len ? 1 : 0;
+	if (12 + 2 + r->list_len + delta + len > sizeof(r->packet))
+		rtpmidi_flush(r);
+	if (12 + 2 + len > sizeof(r->packet))
+		return;
+	if (r->list_len)
+		r->packet[12 + 2 + r->list_len++] = 0;
+	memcpy(r->packet + 12 + 2 + r->list_len, buf, len);
+	r->list_len += len;
+}
+
+static void rtpmidi_flush(transport_rtpmidi_t *const r)
+{
+	struct sockaddr_in peer;
+	unsigned state;
+	tic_t tic;
+	if (!r->list_len)
+		return;
+	mutex_lock(&r->mutex);
+	state = r->state;
+	peer = r->peer[RTPMIDI_DATA];
+	mutex_unlock(&r->mutex);
+	if (state == RTPMIDI_CONNECTED)
+	{
+		tic_get(&tic);
+		r->packet[0] = RTPMIDI_VERSION << 6;
+		r->packet[1] = RTPMIDI_PAYLOAD;
+		rtpmidi_put16(r->packet + 2, r->seq++);
+		rtpmidi_put32(r->packet + 4, rtpmidi_now(tic));
+		rtpmidi_put32(r->packet + 8, r->ssrc);
+		/* B set: 12 bit length, no journal, no delta time before the first command */
+		rtpmidi_put16(r->packet + 12, 0x8000 | r->list_len);
+		rtpmidi_send(r, RTPMIDI_DATA, &peer, r->packet, 12 + 2 + r->list_len);
+	}
+	r->list_len = 0;
+}
+
+static ssize_t rtpmidi_write(transport_t *const transport, const unsigned char *const buf, const size_t len)
+{
+	transport_rtpmidi_t *const r = transport->rtpmidi;
+	midi_parse(&r->parser, buf, len, 0/*tic*/, &rtpmidi_emit, r);
+	rtpmidi_flush(r);
+	return len;
+}
+
+static int rtpmidi_fd(const transport_t *const transport)
+{
+	return transport->fd;
+}
+
+static void rtpmidi_close(transport_t *const transport)
+{
+	transport_rtpmidi_t *const r = transport->rtpmidi;
+	unsigned i;
+	if (r->state != RTPMIDI_IDLE)
+		rtpmidi_command(r, RTPMIDI_CONTROL, &r->peer[RTPMIDI_CONTROL], "BY");
+	close(transport->fd);
+	close(r->tfd);
+	for (i = 0; i < RTPMIDI_SOCKETS; i++)
+		close(r->sock[i]);
+	mutex_destroy(&r->mutex);
+	free(r);
+	transport->rtpmidi = 0;
+	transport->fd = -1;
+}
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef INC_RTPMIDI_H
+#define INC_RTPMIDI_H
+
+#include "transport.h"
+
+/*
+ * RTP-MIDI (RFC 6295) transport with the AppleMIDI session protocol.
+ *
+ * The path is "<port>" to accept invitations on UDP control port <port> (and
+ * data port <port> + 1) or "<host>/<port>" to invite a peer there. There is
+ * one session at a time, further invitations are rejected. The initiator
+ * synchronizes the clocks, the responder answers.
+ *
+ * Received commands pass a playout buffer: a command is due at its sender
+ * time stamp mapped to the local clock plus the playout delay. Before the
+ * first clock synchronization, the lowest transit time seen stands in for
+ * the clock offset. With a zero delay commands are delivered on arrival.
+ * The descriptor is an epoll instance over both sockets and a timer, it
+ * turns readable with a datagram or when the next command is due; read()
+ * runs the session protocol and returns the due commands as MIDI bytes.
+ *
+ * A packet after a sequence number gap is preceded by the program and
+ * controller state of its recovery journal (chapters P and C), older and
+ * duplicate packets are dropped. Packets sent carry no journal. write()
+ * never blocks: without a session or with a full socket buffer the packet
+ * is dropped.
+ */
+
+#define RTPMIDI_RATE 10000 /*Hz, AppleMIDI time stamps*/
+#define RTPMIDI_PAYLOAD 0x61 /*dynamic RTP payload type*/
+#define RTPMIDI_NAME "podfbv" /*session name*/
+#define RTPMIDI_PACKET_SIZE 1472 /*bytes, one Ethernet frame*/
+#define RTPMIDI_PLAYOUT_SIZE 4096 /*bytes of buffered commands, power of two*/
+#define RTPMIDI_PLAYOUT_MAX 1000 /*ms*/
+#define RTPMIDI_INVITE_PERIOD 1000 /*ms*/
+#define RTPMIDI_SYNC_PERIOD 10000 /*ms*/
+#define RTPMIDI_SYNC_FAST 3 /*first synchronizations once per invite period*/
+#define RTPMIDI_FEEDBACK_PERIOD 1000 /*ms between receiver feedbacks*/
+#define RTPMIDI_TIMEOUT 30000 /*ms of silence that end a session*/
+
+extern const transport_ops_t TRANSPORT_RTPMIDI;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Sets the playout delay of transports opened later, at most RTPMIDI_PLAYOUT_MAX. */
+void rtpmidi_playout(const unsigned ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
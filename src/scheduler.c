@@ -0,0 +1,102 @@
+#include "scheduler.h"
+
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static int sched_pool_get(const sched_pool_t *const pool, const unsigned ref, midi_event_t *const event);
+
+#ifdef __cplusplus
+}
+#endif
+
+unsigned sched_pool_put(sched_pool_t *const pool, const midi_event_t *const event)
+{
+	const unsigned ref = pool->seq;
+	sched_pool_entry_t *const entry = &pool->entry[ref & (SCHED_POOL_SIZE - 1)];
+	/* a consumer reading a lapped entry sees the sequence change, see sched_pool_get() */
+	__atomic_store_n(&entry->seq, SCHED_POOL_BUSY, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(&entry->event, event, sizeof(*event));
+	__atomic_store_n(&entry->seq, ref, __ATOMIC_RELEASE);
+	pool->seq = ref + 1;
+	return ref;
+}
+
+/* Returns 0 if the entry was overwritten since the reference was pushed. */
+static int sched_pool_get(const sched_pool_t *const pool, const unsigned ref, midi_event_t *const event)
+{
+	const sched_pool_entry_t *const entry = &pool->entry[ref & (SCHED_POOL_SIZE - 1)];
+	if (__atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE) != ref)
+		return 0;
+	memcpy(event, &entry->event, sizeof(*event));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&entry->seq, __ATOMIC_RELAXED) == ref;
+}
+
+int sched_push(sched_t *const sched, const midi_event_t *const event, const unsigned ref)
+{
+	const unsigned char status = midi_byte(event, 0);
+	if (midi_flags(event) & MIDI_EVENT_SYSEX)
+		return queue_push(&sched->fifo, &ref);
+	switch (status & 0xf0)
+	{
+		case 0xb0:
+			if (midi_len(event) == 3)
+			{
+				const unsigned short key = ((status & 0x0f) << 7) | (midi_byte(event, 1) & 0x7f);
+				unsigned char prev;
+				if (sched->prio_cc && sched->prio_cc[key & 0x7f])
+					return queue_push(&sched->prio, &ref);
+				__atomic_store_n(&sched->tic[key], event->tic, __ATOMIC_RELAXED);
+				__atomic_store_n(&sched->dtic[key], event->dtic, __ATOMIC_RELAXED);
+				__atomic_store_n(&sched->src[key], midi_src(event), __ATOMIC_RELAXED);
+				/* publishes tic, pairs with the acquire in sched_pop() */
+				prev = __atomic_exchange_n(&sched->val[key], (midi_byte(event, 2) & 0x7f) | SCHED_PENDING, __ATOMIC_ACQ_REL);
+				if (prev & SCHED_PENDING)
+				{
+					__atomic_store_n(&sched->coalesced, sched->coalesced + 1, __ATOMIC_RELAXED);
+					return 0;
+				}
+				return queue_push(&sched->keys, &key);
+			}
+			break;
+		case 0xc0:
+			return queue_push(&sched->prio, &ref);
+		case 0xf0:
+			if (status >= 0xf8)
+				return queue_push(&sched->prio, &ref);
+		default:
+			break;
+	}
+	return queue_push(&sched->fifo, &ref);
+}
+
+int sched_pop(sched_t *const sched, midi_event_t *const event)
+{
+	unsigned short key;
+	unsigned ref;
+	while (queue_pop(&sched->prio, &ref) || queue_pop(&sched->fifo, &ref))
+	{
+		if (sched_pool_get(sched->pool, ref, event))
+			return 1;
+		__atomic_store_n(&sched->lost, sched->lost + 1, __ATOMIC_RELAXED);
+	}
+	if (queue_pop(&sched->keys, &key))
+	{
+		const unsigned char val = __atomic_fetch_and(&sched->val[key], (unsigned char)~SCHED_PENDING, __ATOMIC_ACQ_REL);
+		event->tic = __atomic_load_n(&sched->tic[key], __ATOMIC_RELAXED);
+		event->dtic = __atomic_load_n(&sched->dtic[key], __ATOMIC_RELAXED);
+		event->msg = midi_msg(3, 0xb0 | (key >> 7), key & 0x7f, val & 0x7f);
+		midi_set_src(event, __atomic_load_n(&sched->src[key], __ATOMIC_RELAXED));
+		return 1;
+	}
+	return 0;
+}
+
+int sched_empty(sched_t *const sched)
+{
+	return queue_empty(&sched->prio) && queue_empty(&sched->fifo) && queue_empty(&sched->keys);
+}
@@ -0,0 +1,96 @@
+#ifndef INC_SCHEDULER_H
+#define INC_SCHEDULER_H
+
+#include "midi.h"
+#include "queue.h"
+
+/*
+ * Outbound scheduler of a single device.
+ *
+ * Single producer (control) and single consumer (output). Events are sorted
+ * into three lanes which are drained in this order:
+ *  - prio: program changes, realtime bytes and control changes marked in the
+ *    priority table (e.g. tap and footswitch),
+ *  - fifo: any other non-CC message in order of arrival,
+ *  - coalesced control changes: one slot per (channel, controller) holding
+ *    the latest value only, so a pedal sweep never delays the lanes above
+ *    and the device only receives the newest value.
+ *
+ * An event routed to several devices is stored once in a pool shared by
+ * their schedulers, the prio and fifo lanes only hold references. The single
+ * producer never waits for a consumer: when a device falls behind by more
+ * than SCHED_POOL_SIZE events its stale references are dropped on pop and
+ * counted as lost, the other devices are not held back.
+ */
+
+#define SCHED_PRIO_SIZE 64 /*power of two*/
+#define SCHED_FIFO_SIZE 256 /*power of two*/
+#define SCHED_SLOTS (16 * 128) /*channels x controllers, power of two*/
+#define SCHED_PENDING 0x80
+#define SCHED_POOL_SIZE 4096 /*power of two*/
+#define SCHED_POOL_BUSY 0xffffffffU /*sequence of an entry being written*/
+
+typedef struct _sched_pool_entry_t {
+	unsigned seq; /* reference of the event held */
+	midi_event_t event;
+} sched_pool_entry_t;
+
+typedef struct _sched_pool_t {
+	unsigned seq; /* producer */
+	sched_pool_entry_t entry[SCHED_POOL_SIZE];
+} sched_pool_t;
+
+#define sched_pool_initializer() { \
+	.seq = 0 }
+
+typedef struct _sched_t {
+	queue_t prio, fifo, keys;
+	const unsigned char *prio_cc; /*128 entries indexed by controller*/
+	sched_pool_t *pool;
+	unsigned coalesced, lost;
+	unsigned prio_buf[SCHED_PRIO_SIZE];
+	unsigned fifo_buf[SCHED_FIFO_SIZE];
+	unsigned short keys_buf[SCHED_SLOTS];
+	tic_t tic[SCHED_SLOTS];
+	unsigned dtic[SCHED_SLOTS];
+	unsigned char val[SCHED_SLOTS];
+	unsigned char src[SCHED_SLOTS];
+} sched_t;
+
+#define sched_initializer(_sched, _prio_cc, _pool) { \
+	.prio = queue_initializer((_sched).prio_buf, SCHED_PRIO_SIZE), \
+	.fifo = queue_initializer((_sched).fifo_buf, SCHED_FIFO_SIZE), \
+	.keys = queue_initializer((_sched).keys_buf, SCHED_SLOTS), \
+	.prio_cc = _prio_cc, .pool = _pool, .coalesced = 0, .lost = 0, .val = { 0 } }
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Stores an event once for all its destinations, returns the reference to push. */
+unsigned sched_pool_put(sched_pool_t *const pool, const midi_event_t *const event);
+
+/* Returns 1 if the lane was empty before, 0 if not or if coalesced and -1 on overflow. */
+int sched_push(sched_t *const sched, const midi_event_t *const event, const unsigned ref);
+
+/* Returns 1 if an event was popped, 0 if the scheduler is empty. */
+int sched_pop(sched_t *const sched, midi_event_t *const event);
+
+/* Consumer side emptiness check, to be evaluated before waiting. */
+int sched_empty(sched_t *const sched);
+
+static inline unsigned sched_coalesced(const sched_t *const sched)
+{
+	return __atomic_load_n(&sched->coalesced, __ATOMIC_RELAXED);
+}
+
+static inline unsigned sched_lost(const sched_t *const sched)
+{
+	return __atomic_load_n(&sched->lost, __ATOMIC_RELAXED);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,27 @@
+#include "stats.h"
+
+static tic_t histogram_value(const unsigned idx)
+{
+	unsigned shift;
+	if (idx < (1U << HISTOGRAM_SUB_BITS))
+		return idx;
+	shift = (idx >> (HISTOGRAM_SUB_BITS - 1)) - 1;
+	return (tic_t)(idx - (shift << (HISTOGRAM_SUB_BITS - 1))) << shift;
+}
+
+tic_t histogram_quantile(const histogram_t *const hist, const double quantile)
+{
+	const unsigned long long count = __atomic_load_n(&hist->count, __ATOMIC_ACQUIRE);
+	unsigned long long rank = (unsigned long long)(quantile * count + .5), sum = 0;
+	unsigned i;
+	if (!count)
+		return 0;
+	if (!rank)
+		rank = 1;
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		if ((sum += __atomic_load_n(&hist->bucket[i], __ATOMIC_RELAXED)) >= rank)
+			return histogram_value(i);
+	}
+	return __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+}
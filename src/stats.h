@@ -0,0 +1,80 @@
+#ifndef INC_STATS_H
+#define INC_STATS_H
+
+#include "api.h"
+
+/*
+ * Log-linear (HDR style) latency histogram.
+ *
+ * Values below 2^HISTOGRAM_SUB_BITS are counted exactly, larger values in
+ * 2^(HISTOGRAM_SUB_BITS-1) sub-buckets per power of two, i.e. with a relative
+ * error below 1/2^(HISTOGRAM_SUB_BITS-1). A histogram has a single writer and
+ * may be read concurrently, e.g. for a live dump.
+ */
+
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_VALUE_BITS 32
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_VALUE_BITS - HISTOGRAM_SUB_BITS + 2) << (HISTOGRAM_SUB_BITS - 1))
+
+typedef struct _histogram_t {
+	unsigned long long count, sum;
+	tic_t max;
+	unsigned bucket[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+enum _stats_stage_t {
+	STATS_QUEUE, /* input read until taken by the control stage */
+	STATS_MAP, /* translation */
+	STATS_OUTPUT, /* scheduling until write returned */
+	STATS_TOTAL, /* input read until write returned */
+	STATS_STAGES
+};
+
+typedef struct _stats_path_t {
+	histogram_t hist[STATS_STAGES];
+	unsigned long long inp; /* messages read from the port */
+	unsigned long long out; /* messages written to the port */
+	unsigned long long expired; /* messages to the port dropped at their write deadline */
+} stats_path_t;
+
+/* Adds to a counter with a single writer, readers load it atomically. */
+static inline void stats_count(unsigned long long *const counter, const unsigned long long n)
+{
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static inline unsigned histogram_index(unsigned long long value)
+{
+	unsigned msb, shift;
+	if (value < (1ULL << HISTOGRAM_SUB_BITS))
+		return value;
+	if (value >> HISTOGRAM_VALUE_BITS)
+		value = (1ULL << HISTOGRAM_VALUE_BITS) - 1;
+	msb = 63 - __builtin_clzll(value);
+	shift = msb - HISTOGRAM_SUB_BITS + 1;
+	return (shift << (HISTOGRAM_SUB_BITS - 1)) + (unsigned)(value >> shift);
+}
+
+static inline void histogram_add(histogram_t *const hist, const tic_t value)
+{
+	const unsigned long long val = value < 0 ? 0 : value;
+	const unsigned idx = histogram_index(val);
+	__atomic_store_n(&hist->bucket[idx], hist->bucket[idx] + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&hist->sum, hist->sum + val, __ATOMIC_RELAXED);
+	if (value > hist->max)
+		__atomic_store_n(&hist->max, value, __ATOMIC_RELAXED);
+	__atomic_store_n(&hist->count, hist->count + 1, __ATOMIC_RELEASE);
+}
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Returns the lower bound of the bucket holding the given quantile (0..1). */
+tic_t histogram_quantile(const histogram_t *const hist, const double quantile);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,225 @@
+#include "trace.h"
+#include "capture.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define TRACE_LINE_SIZE 1024
+#define TRACE_DEVICES 8
+#define TRACE_SIZE_MIN 1024
+
+typedef struct _trace_text_t {
+	trace_t *trace;
+	unsigned dev;
+} trace_text_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static int trace_push(trace_t *const trace, const unsigned dev, const midi_event_t *const event);
+static int trace_event(void *const context, const midi_event_t *const event);
+static int trace_map(trace_t *const trace, const char *const path, const char *const map, const tic_t tic);
+static const char *trace_capture(trace_t *const trace, const char *const buf, const size_t len, const char *const *const devices, const unsigned count);
+static const char *trace_text(trace_t *const trace, const char *const path, const char *const buf, const char *const *const devices, const unsigned count, unsigned *const line);
+
+#ifdef __cplusplus
+}
+#endif
+
+static int trace_push(trace_t *const trace, const unsigned dev, const midi_event_t *const event)
+{
+	if (trace->count == trace->size)
+	{
+		const size_t size = trace->size ? 2 * trace->size : TRACE_SIZE_MIN;
+		trace_event_t *const events = (trace_event_t *)realloc(trace->events, size * sizeof(trace_event_t));
+		if (!events)
+			return -1;
+		trace->events = events;
+		trace->size = size;
+	}
+	trace->events[trace->count].event = *event;
+	trace->events[trace->count].dev = dev;
+	trace->count++;
+	return 0;
+}
+
+static int trace_event(void *const context, const midi_event_t *const event)
+{
+	trace_text_t *const ctx = (trace_text_t *)context;
+	return trace_push(ctx->trace, ctx->dev, event);
+}
+
+/* Adds a mapping change, map is relative to the directory of the trace at path. */
+static int trace_map(trace_t *const trace, const char *const path, const char *const map, const tic_t tic)
+{
+	const char *const slash = strrchr(path, '/');
+	const int len = (*map != '/') && slash ? slash - path + 1 : 0;
+	midi_event_t event = midi_event_initializer();
+	char **maps, *str;
+	if (!(str = (char *)malloc(len + strlen(map) + 1)))
+		return -1;
+	sprintf(str, "%.*s%s", len, path, map);
+	if (!(maps = (char **)realloc(trace->maps, (trace->map_count + 1) * sizeof(char *))))
+	{
+		free(str);
+		return -1;
+	}
+	trace->maps = maps;
+	trace->maps[trace->map_count] = str;
+	event.tic = tic;
+	event.msg = trace->map_count++;
+	return trace_push(trace, TRACE_MAP, &event);
+}
+
+static const char *trace_capture(trace_t *const trace, const char *const buf, const size_t len, const char *const *const devices, const unsigned count)
+{
+	const capture_header_t *const header = (const capture_header_t *)buf;
+	const capture_record_t *const ring = (const capture_record_t *)(header + 1);
+	int map[CAPTURE_DEVICES];
+	unsigned long long pos, first;
+	unsigned i, j;
+	if ((len < sizeof(capture_header_t)) || (header->version != CAPTURE_VERSION) || (header->record_size != sizeof(capture_record_t)) ||
+		!header->records || (header->records & (header->records - 1)) || !header->tics_per_sec ||
+		(len < sizeof(capture_header_t) + (size_t)header->records * sizeof(capture_record_t)))
+		return "invalid capture file";
+	for (i = 0; i < CAPTURE_DEVICES; i++)
+	{
+		map[i] = -1;
+		for (j = 0; j < count; j++)
+		{
+			if (header->devices[i][0] && !strncasecmp(header->devices[i], devices[j], CAPTURE_NAME_SIZE))
+				map[i] = j;
+		}
+	}
+	first = header->head > header->records ? header->head - header->records : 0;
+	for (pos = first; pos < header->head; pos++)
+	{
+		const capture_record_t *const rec = &ring[pos & (header->records - 1)];
+		midi_event_t event = midi_event_initializer();
+		event.msg = rec->msg;
+		if ((rec->seq != (unsigned)pos) || (rec->dir & CAPTURE_OUT) || !midi_len(&event))
+			continue;
+		if ((rec->dir >= CAPTURE_DEVICES) || (map[rec->dir] < 0))
+			return "unknown device in capture";
+		event.tic = header->tics_per_sec == TICS_PER_SEC ? rec->tic : (tic_t)((double)rec->tic * TICS_PER_SEC / header->tics_per_sec);
+		if (trace_push(trace, map[rec->dir], &event))
+			return "out of memory";
+	}
+	return 0;
+}
+
+static const char *trace_text(trace_t *const trace, const char *const path, const char *const buf, const char *const *const devices, const unsigned count, unsigned *const line)
+{
+	midi_parser_t parsers[TRACE_DEVICES];
+	const char *ptr = buf;
+	tic_t last = 0;
+	unsigned i;
+	if (count > TRACE_DEVICES)
+		return "too many devices";
+	for (i = 0; i < count; i++)
+		midi_parser_reset(&parsers[i]);
+	while (*ptr)
+	{
+		char str[TRACE_LINE_SIZE], *tok, *save, *end;
+		unsigned char bytes[TRACE_LINE_SIZE / 2];
+		const char *const eol = ptr + strcspn(ptr, "\n");
+		trace_text_t ctx = { .trace = trace, .dev = 0 };
+		size_t n = 0;
+		double ms;
+		tic_t tic;
+		++*line;
+		if ((size_t)(eol - ptr) >= sizeof(str))
+			return "line too long";
+		memcpy(str, ptr, eol - ptr);
+		str[eol - ptr] = 0;
+		ptr = *eol ? eol + 1 : eol;
+		if ((tok = strchr(str, '#')))
+			*tok = 0;
+		if (!(tok = strtok_r(str, " \t\r", &save)))
+			continue;
+		ms = strtod(tok, &end);
+		if ((end == tok) || *end || (ms < 0))
+			return "invalid time";
+		if ((tic = (tic_t)(ms * (TICS_PER_SEC / 1000))) < last)
+			return "time goes backwards";
+		last = tic;
+		if (!(tok = strtok_r(0, " \t\r", &save)))
+			return "missing device";
+		if (!strcasecmp(tok, "map"))
+		{
+			if (!(tok = strtok_r(0, " \t\r", &save)) || strtok_r(0, " \t\r", &save))
+				return "expected one mapping path";
+			if (trace_map(trace, path, tok, tic))
+				return "out of memory";
+			continue;
+		}
+		for (ctx.dev = 0; (ctx.dev < count) && strcasecmp(tok, devices[ctx.dev]); ctx.dev++);
+		if (ctx.dev >= count)
+			return "unknown device";
+		while ((tok = strtok_r(0, " \t\r", &save)))
+		{
+			const unsigned long val = strtoul(tok, &end, 16);
+			if ((end == tok) || *end || (val > 0xff))
+				return "invalid byte";
+			bytes[n++] = val;
+		}
+		if (midi_parse(&parsers[ctx.dev], bytes, n, tic, &trace_event, &ctx) < 0)
+			return "out of memory";
+	}
+	return 0;
+}
+
+trace_t *trace_load(const char *const path, const char *const *const devices, const unsigned count, unsigned *const line, const char **const error)
+{
+	FILE *file;
+	char *buf = 0;
+	long size;
+	trace_t *trace = 0;
+
+	*line = 0;
+	if (!(file = fopen(path, "rb")))
+	{
+		*error = "cannot open file";
+		return 0;
+	}
+	*error = "cannot read file";
+	if (fseek(file, 0, SEEK_END) || ((size = ftell(file)) < 0) || fseek(file, 0, SEEK_SET))
+		goto exit0;
+	*error = "out of memory";
+	if (!(buf = (char *)malloc(size + 1)) || !(trace = (trace_t *)calloc(1, sizeof(trace_t))))
+		goto exit0;
+	*error = "cannot read file";
+	if (fread(buf, 1, size, file) != (size_t)size)
+		goto exit0;
+	buf[size] = 0;
+	if ((size_t)size >= sizeof(CAPTURE_MAGIC) && !memcmp(buf, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)))
+		*error = trace_capture(trace, buf, size, devices, count);
+	else
+		*error = trace_text(trace, path, buf, devices, count, line);
+	if (*error)
+		goto exit0;
+	free(buf);
+	fclose(file);
+	return trace;
+
+exit0:
+	trace_free(trace);
+	free(buf);
+	fclose(file);
+	return 0;
+}
+
+void trace_free(trace_t *const trace)
+{
+	size_t i;
+	if (!trace)
+		return;
+	for (i = 0; i < trace->map_count; i++)
+		free(trace->maps[i]);
+	free(trace->maps);
+	free(trace->events);
+	free(trace);
+}
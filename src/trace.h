@@ -0,0 +1,48 @@
+#ifndef INC_TRACE_H
+#define INC_TRACE_H
+
+#include "midi.h"
+
+#include <stddef.h>
+
+/*
+ * Inbound event traces for the replay mode.
+ *
+ * A trace is either a capture file (inbound records are used) or a text file
+ * with one time-stamped message per line, '#' starts a comment:
+ *   <ms> <device> <hex byte> ...
+ * Times are relative milliseconds and must not decrease. Bytes are parsed
+ * per device as a MIDI stream, i.e. running status and SysEx spanning lines
+ * are fine. A line "<ms> map <path>" swaps the mapping at that time like a
+ * reload, a relative path starts at the directory of the trace. It is an
+ * event of device TRACE_MAP whose message is the index of the path in maps.
+ */
+
+#define TRACE_MAP 0xff
+
+typedef struct _trace_event_t {
+	midi_event_t event;
+	unsigned dev;
+} trace_event_t;
+
+typedef struct _trace_t {
+	trace_event_t *events;
+	size_t count, size;
+	char **maps; /* mapping paths of text traces */
+	size_t map_count;
+} trace_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Returns 0 on failure; line and error describe the problem. */
+trace_t *trace_load(const char *const path, const char *const *const devices, const unsigned count, unsigned *const line, const char **const error);
+
+void trace_free(trace_t *const trace);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,358 @@
+#include "transport.h"
+
+#include <string.h>
+
+#ifndef API_WIN
+
+#include "api.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define TRANSPORT_CACHE_LINE 64
+
+/* Byte ring read by one side of a loopback pair and written by the other. */
+typedef struct _transport_ring_t {
+	unsigned head __attribute__((aligned(TRANSPORT_CACHE_LINE))); /* reader */
+	unsigned tail __attribute__((aligned(TRANSPORT_CACHE_LINE))); /* writer */
+	unsigned closed; /* writer gone */
+	unsigned waiting; /* writer found the ring full */
+	int wake; /* eventfd, signaled on the empty to non-empty transition */
+	int space; /* eventfd, held at its maximum (not writable) while the writer waits */
+	unsigned char buf[TRANSPORT_LOOPBACK_SIZE] __attribute__((aligned(TRANSPORT_CACHE_LINE)));
+} transport_ring_t;
+
+struct _transport_loopback_t {
+	char name[TRANSPORT_NAME_SIZE];
+	unsigned users; /* mask of open sides */
+	transport_ring_t ring[2]; /* ring[side] is read by side */
+	transport_loopback_t *next;
+};
+
+/* open loopback pairs, by name */
+static transport_loopback_t *loopbacks = 0;
+static mutex_t loopback_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static int raw_open(transport_t *const transport, const char *const path);
+static int nonblock_open(transport_t *const transport, const char *const path);
+static ssize_t raw_read(transport_t *const transport, unsigned char *const buf, const size_t size);
+static ssize_t raw_write(transport_t *const transport, const unsigned char *const buf, const size_t len);
+static int raw_fd(const transport_t *const transport);
+static void raw_close(transport_t *const transport);
+static int loopback_open(transport_t *const transport, const char *const path);
+static ssize_t loopback_read(transport_t *const transport, unsigned char *const buf, const size_t size);
+static ssize_t loopback_write(transport_t *const transport, const unsigned char *const buf, const size_t len);
+static int loopback_fd(const transport_t *const transport);
+static int loopback_fd_out(const transport_t *const transport);
+static void loopback_release(transport_ring_t *const ring);
+static void loopback_close(transport_t *const transport);
+
+#ifdef __cplusplus
+}
+#endif
+
+const transport_ops_t TRANSPORT_RAW =
+{
+	.name = "raw", .nonblock = 0,
+	.open = &raw_open, .read = &raw_read, .write = &raw_write, .fd = &raw_fd, .fd_out = &raw_fd, .close = &raw_close,
+};
+
+const transport_ops_t TRANSPORT_NONBLOCK =
+{
+	.name = "nonblock", .nonblock = 1,
+	.open = &nonblock_open, .read = &raw_read, .write = &raw_write, .fd = &raw_fd, .fd_out = &raw_fd, .close = &raw_close,
+};
+
+const transport_ops_t TRANSPORT_LOOPBACK =
+{
+	.name = "loopback", .nonblock = 1,
+	.open = &loopback_open, .read = &loopback_read, .write = &loopback_write, .fd = &loopback_fd, .fd_out = &loopback_fd_out, .close = &loopback_close,
+};
+
+static const transport_ops_t *const TRANSPORTS[] =
+{
+	&TRANSPORT_RAW,
+	&TRANSPORT_NONBLOCK,
+	&TRANSPORT_LOOPBACK,
+};
+
+const transport_ops_t *transport_find(const char *const name)
+{
+	unsigned i;
+	for (i = 0; i < sizeof(TRANSPORTS)/sizeof(*TRANSPORTS); i++)
+	{
+		if (!strcmp(TRANSPORTS[i]->name, name))
+			return TRANSPORTS[i];
+	}
+	return 0;
+}
+
+int transport_wait(const transport_t *const transport, const unsigned write, const int timeout)
+{
+	struct pollfd fds = { .fd = write ? transport_fd_out(transport) : transport_fd(transport), .events = write ? POLLOUT : POLLIN };
+	if ((poll(&fds, 1, timeout) < 0) && (errno != EINTR))
+		return -1;
+	return 0;
+}
+
+int transport_send(transport_t *const transport, const unsigned char *const buf, const size_t len)
+{
+	size_t sent = 0;
+	while (sent < len)
+	{
+		const ssize_t result = transport_write(transport, buf + sent, len - sent);
+		if (result < 0)
+			return -1;
+		if (!result && transport_wait(transport, 1/*write*/, -1/*timeout*/))
+			return -1;
+		sent += result;
+	}
+	return 0;
+}
+
+int unix_socket_stale(const char *const path)
+{
+	struct sockaddr_un sa;
+	struct stat st;
+	int fd, result, err;
+	if (strlen(path) >= sizeof(sa.sun_path))
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	if (lstat(path, &st))
+		return errno == ENOENT ? 0 : -1;
+	if (!S_ISSOCK(st.st_mode))
+		return 0;
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+	result = connect(fd, (const struct sockaddr *)&sa, sizeof(sa));
+	err = errno;
+	close(fd);
+	if (!result || (err != ECONNREFUSED))
+	{
+		/* accepted or a full backlog, the owner is alive */
+		errno = !result || (err == EAGAIN) ? EADDRINUSE : err;
+		return -1;
+	}
+	return unlink(path);
+}
+
+static int raw_open(transport_t *const transport, const char *const path)
+{
+	return (transport->fd = open(path, O_RDWR | O_CLOEXEC)) < 0 ? -1 : 0;
+}
+
+static int nonblock_open(transport_t *const transport, const char *const path)
+{
+	return (transport->fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC)) < 0 ? -1 : 0;
+}
+
+static ssize_t raw_read(transport_t *const transport, unsigned char *const buf, const size_t size)
+{
+	ssize_t result;
+	while ((result = read(transport->fd, buf, size)) < 0)
+	{
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+			return 0;
+		if (errno != EINTR)
+			return -1;
+	}
+	if (!result)
+	{
+		errno = EPIPE;
+		return -1;
+	}
+	return result;
+}
+
+static ssize_t raw_write(transport_t *const transport, const unsigned char *const buf, const size_t len)
+{
+	ssize_t result;
+	while ((result = write(transport->fd, buf, len)) < 0)
+	{
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+			return 0;
+		if (errno != EINTR)
+			return -1;
+	}
+	return result;
+}
+
+static int raw_fd(const transport_t *const transport)
+{
+	return transport->fd;
+}
+
+static void raw_close(transport_t *const transport)
+{
+	close(transport->fd);
+	transport->fd = -1;
+}
+
+static int loopback_open(transport_t *const transport, const char *const path)
+{
+	transport_loopback_t *loopback;
+	unsigned side, i;
+	mutex_lock(&loopback_mutex);
+	for (loopback = loopbacks; loopback; loopback = loopback->next)
+	{
+		if (!strcmp(loopback->name, path) && (loopback->users != 3))
+			break;
+	}
+	if (!loopback)
+	{
+		if (!(loopback = (transport_loopback_t *)aligned_alloc(TRANSPORT_CACHE_LINE, sizeof(*loopback))))
+			goto exit0;
+		memset(loopback, 0, sizeof(*loopback));
+		strncpy(loopback->name, path, sizeof(loopback->name) - 1);
+		for (i = 0; i < 4; i++)
+		{
+			int *const fd = i & 1 ? &loopback->ring[i >> 1].space : &loopback->ring[i >> 1].wake;
+			if ((*fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) >= 0)
+				continue;
+			while (i--)
+				close(i & 1 ? loopback->ring[i >> 1].space : loopback->ring[i >> 1].wake);
+			goto exit1;
+		}
+		loopback->next = loopbacks;
+		loopbacks = loopback;
+	}
+	side = loopback->users & 1;
+	loopback->users |= 1 << side;
+	/* a reopened side starts with an empty inbound ring and a live outbound one */
+	loopback->ring[side].head = __atomic_load_n(&loopback->ring[side].tail, __ATOMIC_ACQUIRE);
+	loopback_release(&loopback->ring[side]);
+	__atomic_store_n(&loopback->ring[side ^ 1].closed, 0, __ATOMIC_RELEASE);
+	transport->loopback = loopback;
+	transport->side = side;
+	transport->fd = loopback->ring[side].wake;
+	mutex_unlock(&loopback_mutex);
+	return 0;
+
+exit1:
+	free(loopback);
+exit0:
+	mutex_unlock(&loopback_mutex);
+	return -1;
+}
+
+static ssize_t loopback_read(transport_t *const transport, unsigned char *const buf, const size_t size)
+{
+	transport_ring_t *const ring = &transport->loopback->ring[transport->side];
+	const unsigned head = ring->head;
+	const unsigned closed = __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE);
+	unsigned tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE), len, first;
+	if (head == tail)
+	{
+		eventfd_t value;
+		/* consume the wakeup before the re-check, so none is lost */
+		eventfd_read(ring->wake, &value);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (head == (tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)))
+		{
+			if (!closed)
+				return 0;
+			errno = EPIPE;
+			return -1;
+		}
+	}
+	len = tail - head < size ? tail - head : size;
+	first = TRANSPORT_LOOPBACK_SIZE - (head & (TRANSPORT_LOOPBACK_SIZE - 1));
+	if (first > len)
+		first = len;
+	memcpy(buf, ring->buf + (head & (TRANSPORT_LOOPBACK_SIZE - 1)), first);
+	memcpy(buf + first, ring->buf, len - first);
+	__atomic_store_n(&ring->head, head + len, __ATOMIC_RELEASE);
+	loopback_release(ring);
+	return len;
+}
+
+static ssize_t loopback_write(transport_t *const transport, const unsigned char *const buf, const size_t len)
+{
+	transport_ring_t *const ring = &transport->loopback->ring[transport->side ^ 1];
+	const unsigned tail = ring->tail;
+	unsigned head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE), first, n = len;
+	if (tail - head == TRANSPORT_LOOPBACK_SIZE)
+	{
+		/* not writable until loopback_release(), unless the reader just made room */
+		eventfd_write(ring->space, 0xfffffffffffffffeULL);
+		__atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+		if (tail - (head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST)) == TRANSPORT_LOOPBACK_SIZE)
+			return 0;
+		loopback_release(ring);
+	}
+	if (n > TRANSPORT_LOOPBACK_SIZE - (tail - head))
+		n = TRANSPORT_LOOPBACK_SIZE - (tail - head);
+	first = TRANSPORT_LOOPBACK_SIZE - (tail & (TRANSPORT_LOOPBACK_SIZE - 1));
+	if (first > n)
+		first = n;
+	memcpy(ring->buf + (tail & (TRANSPORT_LOOPBACK_SIZE - 1)), buf, first);
+	memcpy(ring->buf, buf + first, n - first);
+	__atomic_store_n(&ring->tail, tail + n, __ATOMIC_RELEASE);
+	/* pairs with the fence in loopback_read() */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	if (n && (head == tail))
+		eventfd_write(ring->wake, 1);
+	return n;
+}
+
+static int loopback_fd(const transport_t *const transport)
+{
+	return transport->fd;
+}
+
+static int loopback_fd_out(const transport_t *const transport)
+{
+	return transport->loopback->ring[transport->side ^ 1].space;
+}
+
+/* Makes the writer's descriptor writable again after the reader freed space, pairs with loopback_write(). */
+static void loopback_release(transport_ring_t *const ring)
+{
+	eventfd_t value;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->waiting, __ATOMIC_RELAXED) && __atomic_exchange_n(&ring->waiting, 0, __ATOMIC_SEQ_CST))
+		eventfd_read(ring->space, &value);
+}
+
+static void loopback_close(transport_t *const transport)
+{
+	transport_loopback_t *const loopback = transport->loopback;
+	transport_ring_t *const peer = &loopback->ring[transport->side ^ 1];
+	mutex_lock(&loopback_mutex);
+	/* the peer reads end of stream once it drained the ring */
+	__atomic_store_n(&peer->closed, 1, __ATOMIC_RELEASE);
+	eventfd_write(peer->wake, 1);
+	if (!(loopback->users &= ~(1 << transport->side)))
+	{
+		transport_loopback_t **link;
+		for (link = &loopbacks; *link != loopback; link = &(*link)->next);
+		*link = loopback->next;
+		close(loopback->ring[0].wake);
+		close(loopback->ring[1].wake);
+		close(loopback->ring[0].space);
+		close(loopback->ring[1].space);
+		free(loopback);
+	}
+	mutex_unlock(&loopback_mutex);
+	transport->loopback = 0;
+	transport->fd = -1;
+}
+
+#endif
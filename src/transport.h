@@ -0,0 +1,124 @@
+#ifndef INC_TRANSPORT_H
+#define INC_TRANSPORT_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Pluggable device transports.
+ *
+ * A transport moves raw MIDI bytes between podfbv and one device. read()
+ * and write() move as many bytes as one call allows. They return the number
+ * of bytes moved, 0 if the transport would block and -1 on failure or end of
+ * stream. Blocking backends never return 0 for a non-empty request; for
+ * non-blocking ones the descriptor returned by fd() becomes readable and the
+ * one returned by fd_out() writable when the call can make progress, they
+ * are meant for poll/epoll and are the same descriptor on most backends.
+ *
+ * Backends:
+ * - "raw": ALSA rawmidi device node (or any tty/fifo), blocking.
+ * - "nonblock": the same, opened with O_NONBLOCK.
+ * - "loopback": in-process byte pipe. The first open of a name creates a
+ *   pair, the second one connects to its other end. Bytes are exchanged
+ *   through a shared ring without copies to the kernel; an eventfd is only
+ *   signaled when the ring turns non-empty. A write takes what fits, a full
+ *   ring turns the writable descriptor (an eventfd of its own) unwritable
+ *   until the reader frees space. A read from a closed peer fails with
+ *   EPIPE. Non-blocking.
+ * - "rtpmidi": RTP-MIDI network session, see rtpmidi.h. Non-blocking, set
+ *   per port instead of by name.
+ */
+
+#define TRANSPORT_LOOPBACK_SIZE 4096 /*bytes per direction, power of two*/
+#define TRANSPORT_NAME_SIZE 64
+
+typedef struct _transport_t transport_t;
+
+typedef struct _transport_ops_t {
+	const char *name;
+	unsigned nonblock;
+	int (*open)(transport_t *const transport, const char *const path);
+	ssize_t (*read)(transport_t *const transport, unsigned char *const buf, const size_t size);
+	ssize_t (*write)(transport_t *const transport, const unsigned char *const buf, const size_t len);
+	int (*fd)(const transport_t *const transport);
+	int (*fd_out)(const transport_t *const transport);
+	void (*close)(transport_t *const transport);
+} transport_ops_t;
+
+typedef struct _transport_loopback_t transport_loopback_t;
+typedef struct _transport_rtpmidi_t transport_rtpmidi_t;
+
+struct _transport_t {
+	const transport_ops_t *ops;
+	int fd; /* negative while closed */
+	transport_loopback_t *loopback;
+	unsigned side;
+	transport_rtpmidi_t *rtpmidi;
+};
+
+#define transport_initializer(_ops) { \
+	.ops = _ops, .fd = -1, .loopback = 0, .side = 0, .rtpmidi = 0 }
+
+extern const transport_ops_t TRANSPORT_RAW, TRANSPORT_NONBLOCK, TRANSPORT_LOOPBACK;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Returns the backend registered under name or 0. */
+const transport_ops_t *transport_find(const char *const name);
+
+/* Waits until the transport is readable (writable), timeout in ms or -1. */
+int transport_wait(const transport_t *const transport, const unsigned write, const int timeout);
+
+/* Writes all of buf, waiting as needed on non-blocking transports. */
+int transport_send(transport_t *const transport, const unsigned char *const buf, const size_t len);
+
+/*
+ * Removes a unix socket left behind by a killed daemon before it is bound
+ * again, fails with EADDRINUSE if one still listens on it. Anything else
+ * at path is left for bind() to fail on.
+ */
+int unix_socket_stale(const char *const path);
+
+#ifdef __cplusplus
+}
+#endif
+
+static inline int transport_open(transport_t *const transport, const char *const path)
+{
+	return transport->ops->open(transport, path);
+}
+
+static inline ssize_t transport_read(transport_t *const transport, unsigned char *const buf, const size_t size)
+{
+	return transport->ops->read(transport, buf, size);
+}
+
+static inline ssize_t transport_write(transport_t *const transport, const unsigned char *const buf, const size_t len)
+{
+	return transport->ops->write(transport, buf, len);
+}
+
+static inline int transport_fd(const transport_t *const transport)
+{
+	return transport->ops->fd(transport);
+}
+
+static inline int transport_fd_out(const transport_t *const transport)
+{
+	return transport->ops->fd_out(transport);
+}
+
+static inline int transport_opened(const transport_t *const transport)
+{
+	return transport->fd >= 0;
+}
+
+static inline void transport_close(transport_t *const transport)
+{
+	if (transport->fd >= 0)
+		transport->ops->close(transport);
+}
+
+#endif